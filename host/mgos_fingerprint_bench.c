@@ -0,0 +1,787 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks; see mgos_fingerprint_bench.h. Every measurement runs against
+// a fresh simulated module with a library of cfg.library templates, where
+// finger n is stored in slot n - 1. The shards benchmark gives every module
+// fingers of its own, following on from those of the previous one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+#include "mgos_fingerprint_bench.h"
+#include "mgos_fingerprint_internal.h"
+#include "mgos_fingerprint_sim.h"
+
+static const uint32_t mgos_fingerprint_bench_bauds[] = {9600, 19200, 38400,
+                                                        57600, 115200};
+
+// A driver on a simulated module, and what the service loop reported.
+struct mgos_fingerprint_bench {
+  const struct mgos_fingerprint_bench_cfg *cfg;
+  FILE *out;
+  struct mgos_fingerprint_sim *sim;
+  struct mgos_fingerprint_transport transport;
+  struct mgos_fingerprint *dev;
+  uint32_t events;  // bit per event seen
+  uint32_t bytes;   // moved by the data phase
+  uint32_t *samples;
+};
+
+// Completion of the command being timed.
+struct mgos_fingerprint_bench_wait {
+  bool done;
+  int16_t rc;
+};
+
+static void mgos_fingerprint_bench_handler(struct mgos_fingerprint *dev,
+                                           int ev, void *ev_data,
+                                           void *user_data) {
+  ((struct mgos_fingerprint_bench *) user_data)->events |= 1UL << ev;
+  (void) dev;
+  (void) ev_data;
+}
+
+// A module with the benchmark's library, `finger` stored in slot 0.
+static struct mgos_fingerprint_sim *mgos_fingerprint_bench_sim(
+    const struct mgos_fingerprint_bench_cfg *bcfg, uint32_t baud,
+    uint8_t datalen, bool auto_commands, uint32_t finger) {
+  struct mgos_fingerprint_sim_cfg scfg;
+  struct mgos_fingerprint_sim *sim;
+
+  mgos_fingerprint_sim_config_set_defaults(&scfg);
+  scfg.baud = baud;
+  scfg.datapacket_length = datalen;
+  scfg.capacity = bcfg->library + bcfg->iterations + 1;
+  scfg.auto_commands = auto_commands;
+  scfg.wire_time = bcfg->wire_time;
+  if (!(sim = mgos_fingerprint_sim_create(&scfg))) return NULL;
+  for (uint16_t id = 0; id < bcfg->library; id++)
+    mgos_fingerprint_sim_enroll(sim, id, finger + id);
+  return sim;
+}
+
+static void mgos_fingerprint_bench_dev_cfg(
+    struct mgos_fingerprint_cfg *cfg, uint32_t baud, uint8_t datalen,
+    const struct mgos_fingerprint_transport *transport) {
+  mgos_fingerprint_config_set_defaults(cfg);
+  cfg->uart_baud_rate = baud;
+  cfg->uart_baud_autodetect = false;
+  cfg->datapacket_length = datalen;
+  cfg->transport = transport;
+}
+
+static bool mgos_fingerprint_bench_open(struct mgos_fingerprint_bench *b,
+                                        uint32_t baud, uint8_t datalen,
+                                        bool auto_commands) {
+  struct mgos_fingerprint_cfg cfg;
+
+  b->sim =
+      mgos_fingerprint_bench_sim(b->cfg, baud, datalen, auto_commands, 1);
+  if (!b->sim) return false;
+  mgos_fingerprint_sim_transport(b->sim, &b->transport);
+  mgos_fingerprint_bench_dev_cfg(&cfg, baud, datalen, &b->transport);
+  cfg.handler = mgos_fingerprint_bench_handler;
+  cfg.handler_user_data = b;
+  if (!(b->dev = mgos_fingerprint_create(&cfg))) {
+    mgos_fingerprint_sim_destroy(&b->sim);
+    return false;
+  }
+  return true;
+}
+
+static void mgos_fingerprint_bench_close(struct mgos_fingerprint_bench *b) {
+  mgos_fingerprint_destroy(&b->dev);
+  mgos_fingerprint_sim_destroy(&b->sim);
+}
+
+static void mgos_fingerprint_bench_cb(struct mgos_fingerprint *dev,
+                                      const struct mgos_fingerprint_result *res,
+                                      void *cb_arg) {
+  struct mgos_fingerprint_bench_wait *w =
+      (struct mgos_fingerprint_bench_wait *) cb_arg;
+
+  if (res->more) return;
+  w->rc = res->rc;
+  w->done = true;
+  (void) dev;
+}
+
+// Drives the device until the command completes, without sleeping between
+// polls, so the result is not rounded up to the poll interval.
+static int16_t mgos_fingerprint_bench_wait(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_bench_wait *w,
+    int16_t submitted) {
+  if (submitted != MGOS_FINGERPRINT_OK) return submitted;
+  while (!w->done) mgos_fingerprint_poll(dev);
+  return w->rc;
+}
+
+static int mgos_fingerprint_bench_cmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+// Appends ,"n":..,"mean_us":.. and percentiles of `n` samples to a line.
+static void mgos_fingerprint_bench_summary(FILE *out, uint32_t *samples,
+                                           uint16_t n) {
+  uint64_t sum = 0;
+
+  if (n == 0) {
+    fprintf(out, ",\"n\":0");
+    return;
+  }
+  qsort(samples, n, sizeof(*samples), mgos_fingerprint_bench_cmp);
+  for (uint16_t i = 0; i < n; i++) sum += samples[i];
+  fprintf(out,
+          ",\"n\":%u,\"mean_us\":%lu,\"p50_us\":%u,\"p99_us\":%u,"
+          "\"max_us\":%u",
+          n, (unsigned long) (sum / n), samples[n / 2],
+          samples[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1], samples[n - 1]);
+}
+
+static FILE *mgos_fingerprint_bench_out(
+    const struct mgos_fingerprint_bench_cfg *cfg) {
+  return cfg->out ? cfg->out : stdout;
+}
+
+bool mgos_fingerprint_bench_frame(
+    const struct mgos_fingerprint_bench_cfg *cfg) {
+  struct mgos_fingerprint *dev;
+  struct mgos_fingerprint_packet pkt;
+  FILE *out;
+
+  if (!cfg) return false;
+  out = mgos_fingerprint_bench_out(cfg);
+  // Framing and parsing need no module, just an address.
+  if (!(dev = calloc(1, sizeof(*dev)))) return false;
+  dev->address = MGOS_FINGERPRINT_DEFAULT_ADDRESS;
+  memset(&pkt, 0, sizeof(pkt));
+  for (uint8_t dl = cfg->datalen_min; dl <= cfg->datalen_max; dl++) {
+    uint16_t n = 32 << dl, flen = MGOS_FINGERPRINT_HEADER_LEN + n + 2;
+    uint32_t frames = cfg->frame_bytes / flen, parsed;
+    uint8_t *buf = malloc((size_t) frames * flen);
+    int64_t t, build_us, parse_us;
+
+    if (!buf || frames == 0) {
+      free(buf);
+      continue;
+    }
+    for (uint16_t i = 0; i < n; i++) pkt.data[i] = i * 7;
+    t = mgos_uptime_micros();
+    for (uint32_t i = 0; i < frames; i++) {
+      pkt.data[0] = i;
+      mgos_fingerprint_frame_build(dev, &pkt, MGOS_FINGERPRINT_DATAPACKET, n);
+      memcpy(buf + (size_t) i * flen, &pkt, flen);
+    }
+    build_us = mgos_uptime_micros() - t;
+    t = mgos_uptime_micros();
+    parsed = mgos_fingerprint_rx_feed(dev, buf, (size_t) frames * flen);
+    parse_us = mgos_uptime_micros() - t;
+    fprintf(out,
+            "{\"bench\":\"frame\",\"datalen\":%u,\"frames\":%u,"
+            "\"parsed\":%u,\"bytes\":%lu,\"build_ns_per_byte\":%.2f,"
+            "\"parse_ns_per_byte\":%.2f,\"checksum_errors\":%u}\n",
+            n, frames, parsed, (unsigned long) frames * flen,
+            build_us * 1e3 / ((double) frames * flen),
+            parse_us * 1e3 / ((double) frames * flen),
+            dev->link_stats.checksum_errors);
+    free(buf);
+  }
+  free(dev);
+  return true;
+}
+
+static int16_t mgos_fingerprint_bench_index(struct mgos_fingerprint *dev,
+                                            mgos_fingerprint_cb cb,
+                                            void *cb_arg) {
+  return mgos_fingerprint_model_index_async(dev, 0, cb, cb_arg);
+}
+
+static int16_t mgos_fingerprint_bench_search(struct mgos_fingerprint *dev,
+                                             mgos_fingerprint_cb cb,
+                                             void *cb_arg) {
+  return mgos_fingerprint_database_search_async(dev, 1, cb, cb_arg);
+}
+
+static const struct {
+  const char *name;
+  int16_t (*submit)(struct mgos_fingerprint *dev, mgos_fingerprint_cb cb,
+                    void *cb_arg);
+} mgos_fingerprint_bench_cmds[] = {
+    {"handshake", mgos_fingerprint_handshake_async},
+    {"read_sysparams", mgos_fingerprint_get_system_params_async},
+    {"template_count", mgos_fingerprint_model_count_async},
+    {"index_page", mgos_fingerprint_bench_index},
+    {"search", mgos_fingerprint_bench_search},
+};
+
+bool mgos_fingerprint_bench_rtt(const struct mgos_fingerprint_bench_cfg *cfg) {
+  struct mgos_fingerprint_bench b;
+
+  if (!cfg) return false;
+  memset(&b, 0, sizeof(b));
+  b.cfg = cfg;
+  b.out = mgos_fingerprint_bench_out(cfg);
+  if (!(b.samples = calloc(cfg->iterations + 1, sizeof(*b.samples))))
+    return false;
+  for (uint8_t r = 0; r < sizeof(mgos_fingerprint_bench_bauds) /
+                              sizeof(mgos_fingerprint_bench_bauds[0]);
+       r++) {
+    uint32_t baud = mgos_fingerprint_bench_bauds[r];
+
+    if (baud < cfg->baud_min || baud > cfg->baud_max) continue;
+    for (uint8_t dl = cfg->datalen_min; dl <= cfg->datalen_max; dl++) {
+      if (!mgos_fingerprint_bench_open(&b, baud, dl, true)) goto err;
+      // The search runs over the char buffer of a finger in the library.
+      mgos_fingerprint_sim_set_finger(b.sim, cfg->library / 2 + 1);
+      mgos_fingerprint_image_get(b.dev);
+      mgos_fingerprint_image_genchar(b.dev, 1);
+      for (uint8_t c = 0; c < sizeof(mgos_fingerprint_bench_cmds) /
+                                  sizeof(mgos_fingerprint_bench_cmds[0]);
+           c++) {
+        uint16_t n = 0, errors = 0;
+
+        for (uint16_t i = 0; i < cfg->iterations; i++) {
+          struct mgos_fingerprint_bench_wait w = {false, 0};
+          int64_t t = mgos_uptime_micros();
+          int16_t rc = mgos_fingerprint_bench_wait(
+              b.dev, &w, mgos_fingerprint_bench_cmds[c].submit(
+                             b.dev, mgos_fingerprint_bench_cb, &w));
+
+          // Any acknowledge is a round trip; only a timeout is not.
+          if (rc < 0) {
+            errors++;
+            continue;
+          }
+          b.samples[n++] = (uint32_t)(mgos_uptime_micros() - t);
+        }
+        fprintf(b.out,
+                "{\"bench\":\"rtt\",\"baud\":%u,\"datalen\":%u,"
+                "\"cmd\":\"%s\",\"errors\":%u",
+                baud, 32 << dl, mgos_fingerprint_bench_cmds[c].name, errors);
+        mgos_fingerprint_bench_summary(b.out, b.samples, n);
+        fprintf(b.out, "}\n");
+      }
+      mgos_fingerprint_bench_close(&b);
+    }
+  }
+  free(b.samples);
+  return true;
+
+err:
+  free(b.samples);
+  return false;
+}
+
+static bool mgos_fingerprint_bench_sink(const uint8_t *chunk, size_t len,
+                                        void *ud) {
+  ((struct mgos_fingerprint_bench *) ud)->bytes += len;
+  (void) chunk;
+  return true;
+}
+
+static bool mgos_fingerprint_bench_source(uint8_t *chunk, size_t len,
+                                          void *ud) {
+  memset(chunk, 0x5A, len);
+  ((struct mgos_fingerprint_bench *) ud)->bytes += len;
+  return true;
+}
+
+// Times cfg.transfers runs of one transfer, and reports its throughput.
+static void mgos_fingerprint_bench_xfer(struct mgos_fingerprint_bench *b,
+                                        uint32_t baud, uint8_t dl,
+                                        const char *op) {
+  uint16_t n = 0, errors = 0;
+  uint32_t bytes = 0;
+  uint64_t total_us = 0;
+
+  for (uint16_t i = 0; i < b->cfg->transfers; i++) {
+    struct mgos_fingerprint_bench_wait w = {false, 0};
+    int64_t t = mgos_uptime_micros();
+    int16_t rc;
+
+    b->bytes = 0;
+    if (!strcmp(op, "template_download"))
+      rc = mgos_fingerprint_model_download_stream_async(
+          b->dev, 1, mgos_fingerprint_bench_sink, b, mgos_fingerprint_bench_cb,
+          &w);
+    else if (!strcmp(op, "template_upload"))
+      rc = mgos_fingerprint_model_upload_stream_async(
+          b->dev, 2, mgos_fingerprint_bench_source, b, 0,
+          mgos_fingerprint_bench_cb, &w);
+    else
+      rc = mgos_fingerprint_image_download_stream_async(
+          b->dev, mgos_fingerprint_bench_sink, b, mgos_fingerprint_bench_cb,
+          &w);
+    rc = mgos_fingerprint_bench_wait(b->dev, &w, rc);
+    if (rc == MGOS_FINGERPRINT_OK && !strcmp(op, "template_upload")) {
+      // Data packets are not acknowledged: the upload is only known to have
+      // arrived when the next command is answered.
+      w.done = false;
+      rc = mgos_fingerprint_bench_wait(
+          b->dev, &w,
+          mgos_fingerprint_handshake_async(b->dev, mgos_fingerprint_bench_cb,
+                                           &w));
+    }
+    if (rc != MGOS_FINGERPRINT_OK) {
+      errors++;
+      continue;
+    }
+    b->samples[n] = (uint32_t)(mgos_uptime_micros() - t);
+    total_us += b->samples[n++];
+    bytes = b->bytes;
+  }
+  fprintf(b->out,
+          "{\"bench\":\"transfer\",\"baud\":%u,\"datalen\":%u,\"op\":\"%s\","
+          "\"bytes\":%u,\"errors\":%u,\"bytes_per_s\":%lu",
+          baud, 32 << dl, op, bytes, errors,
+          total_us ? (unsigned long) ((uint64_t) bytes * n * 1000000 /
+                                      total_us)
+                   : 0UL);
+  mgos_fingerprint_bench_summary(b->out, b->samples, n);
+  fprintf(b->out, "}\n");
+}
+
+bool mgos_fingerprint_bench_transfer(
+    const struct mgos_fingerprint_bench_cfg *cfg) {
+  struct mgos_fingerprint_bench b;
+
+  if (!cfg) return false;
+  memset(&b, 0, sizeof(b));
+  b.cfg = cfg;
+  b.out = mgos_fingerprint_bench_out(cfg);
+  if (!(b.samples = calloc(cfg->transfers + 1, sizeof(*b.samples))))
+    return false;
+  for (uint8_t r = 0; r < sizeof(mgos_fingerprint_bench_bauds) /
+                              sizeof(mgos_fingerprint_bench_bauds[0]);
+       r++) {
+    uint32_t baud = mgos_fingerprint_bench_bauds[r];
+
+    if (baud < cfg->baud_min || baud > cfg->baud_max) continue;
+    for (uint8_t dl = cfg->datalen_min; dl <= cfg->datalen_max; dl++) {
+      if (!mgos_fingerprint_bench_open(&b, baud, dl, true)) {
+        free(b.samples);
+        return false;
+      }
+      mgos_fingerprint_sim_set_finger(b.sim, 1);
+      mgos_fingerprint_image_get(b.dev);
+      mgos_fingerprint_image_genchar(b.dev, 1);
+      mgos_fingerprint_bench_xfer(&b, baud, dl, "template_download");
+      mgos_fingerprint_bench_xfer(&b, baud, dl, "template_upload");
+      if (cfg->images) mgos_fingerprint_bench_xfer(&b, baud, dl, "image");
+      mgos_fingerprint_bench_close(&b);
+    }
+  }
+  free(b.samples);
+  return true;
+}
+
+// Provisions cfg.imports templates with mgos_fingerprint_model_import(), and
+// the same one upload and store at a time, for comparison. Both use the sync
+// API, which sleeps between polls.
+static bool mgos_fingerprint_bench_import_run(
+    struct mgos_fingerprint_bench *b, uint8_t dl,
+    struct mgos_fingerprint_template *tpl) {
+  uint16_t n = b->cfg->imports, next = 0, errors = 0;
+  uint64_t import_us, seq_us;
+  int64_t t;
+
+  t = mgos_uptime_micros();
+  while (next < n) {
+    uint16_t from = next;
+
+    if (MGOS_FINGERPRINT_OK ==
+        mgos_fingerprint_model_import(b->dev, tpl, n, &next, NULL, NULL))
+      break;
+    // Resumes after the failed template.
+    if (next == from) next++;
+    errors++;
+  }
+  import_us = mgos_uptime_micros() - t;
+
+  t = mgos_uptime_micros();
+  for (uint16_t i = 0; i < n; i++) {
+    if (MGOS_FINGERPRINT_OK != mgos_fingerprint_model_upload_buf(
+                                   b->dev, 1, tpl[i].data,
+                                   b->dev->info.model_size) ||
+        MGOS_FINGERPRINT_OK != mgos_fingerprint_model_store(b->dev,
+                                                            tpl[i].id, 1))
+      errors++;
+  }
+  seq_us = mgos_uptime_micros() - t;
+
+  fprintf(b->out,
+          "{\"bench\":\"import\",\"baud\":%u,\"datalen\":%u,"
+          "\"templates\":%u,\"errors\":%u,\"import_per_s\":%.2f,"
+          "\"sequential_per_s\":%.2f}\n",
+          b->cfg->cycle_baud, 32 << dl, n, errors,
+          import_us ? n * 1e6 / import_us : 0.0,
+          seq_us ? n * 1e6 / seq_us : 0.0);
+  return true;
+}
+
+bool mgos_fingerprint_bench_import(
+    const struct mgos_fingerprint_bench_cfg *cfg) {
+  struct mgos_fingerprint_bench b;
+  struct mgos_fingerprint_template *tpl;
+  uint8_t *data = NULL;
+  bool ok = true;
+
+  if (!cfg) return false;
+  memset(&b, 0, sizeof(b));
+  b.cfg = cfg;
+  b.out = mgos_fingerprint_bench_out(cfg);
+  if (!(tpl = calloc(cfg->imports + 1, sizeof(*tpl)))) return false;
+  for (uint8_t dl = cfg->datalen_min; dl <= cfg->datalen_max && ok; dl++) {
+    if (!mgos_fingerprint_bench_open(&b, cfg->cycle_baud, dl, false)) {
+      ok = false;
+      break;
+    }
+    if (!data && !(data = malloc(b.dev->info.model_size))) {
+      ok = false;
+    } else {
+      memset(data, 0x5A, b.dev->info.model_size);
+      for (uint16_t i = 0; i < cfg->imports; i++) {
+        tpl[i].id = i % b.dev->system_params.library_size;
+        tpl[i].data = data;
+        tpl[i].len = 0;
+      }
+      ok = mgos_fingerprint_bench_import_run(&b, dl, tpl);
+    }
+    mgos_fingerprint_bench_close(&b);
+  }
+  free(data);
+  free(tpl);
+  return ok;
+}
+
+// One identify or enroll, from the first service tick to its result. The
+// ticks follow each other without the service period in between; while the
+// service waits for the finger to be lifted, it is lifted and put back.
+// Enrolling step by step takes three ticks.
+static bool mgos_fingerprint_bench_svc(struct mgos_fingerprint_bench *b,
+                                       uint32_t finger, int ok_ev,
+                                       int error_ev) {
+  uint32_t done = (1UL << ok_ev) | (1UL << error_ev);
+
+  b->events = 0;
+  mgos_fingerprint_sim_set_finger(b->sim, finger);
+  for (uint8_t tick = 0; tick < 4 && !(b->events & done); tick++) {
+    bool lift = b->dev->svc_state == MGOS_FINGERPRINT_STATE_ENROLL_LIFT;
+
+    if (lift) mgos_fingerprint_sim_set_finger(b->sim, 0);
+    mgos_fingerprint_svc_timer(b->dev);
+    while (b->dev->svc_busy) mgos_fingerprint_poll(b->dev);
+    if (lift) mgos_fingerprint_sim_set_finger(b->sim, finger);
+  }
+  return (b->events & (1UL << ok_ev)) != 0;
+}
+
+bool mgos_fingerprint_bench_cycle(
+    const struct mgos_fingerprint_bench_cfg *cfg) {
+  struct mgos_fingerprint_bench b;
+
+  if (!cfg) return false;
+  memset(&b, 0, sizeof(b));
+  b.cfg = cfg;
+  b.out = mgos_fingerprint_bench_out(cfg);
+  if (!(b.samples = calloc(cfg->iterations + 1, sizeof(*b.samples))))
+    return false;
+  // Step by step, then with the module's auto commands.
+  for (uint8_t a = 0; a < 2; a++) {
+    uint16_t n, errors;
+
+    if (!mgos_fingerprint_bench_open(&b, cfg->cycle_baud,
+                                     MGOS_FINGERPRINT_DATALEN_128, a)) {
+      free(b.samples);
+      return false;
+    }
+
+    mgos_fingerprint_svc_mode_set(b.dev, MGOS_FINGERPRINT_MODE_MATCH);
+    n = errors = 0;
+    for (uint16_t i = 0; i < cfg->iterations; i++) {
+      int64_t t = mgos_uptime_micros();
+
+      // Fingers spread over the library, so searches vary in length.
+      if (!mgos_fingerprint_bench_svc(
+              &b, 1 + (i * 7919U) % (cfg->library ? cfg->library : 1),
+              MGOS_FINGERPRINT_EV_MATCH_OK, MGOS_FINGERPRINT_EV_MATCH_ERROR)) {
+        errors++;
+        continue;
+      }
+      b.samples[n++] = (uint32_t)(mgos_uptime_micros() - t);
+    }
+    fprintf(b.out,
+            "{\"bench\":\"cycle\",\"op\":\"identify\",\"auto\":%s,"
+            "\"baud\":%u,\"library\":%u,\"errors\":%u",
+            a ? "true" : "false", cfg->cycle_baud, cfg->library, errors);
+    mgos_fingerprint_bench_summary(b.out, b.samples, n);
+    fprintf(b.out, "}\n");
+
+    mgos_fingerprint_svc_mode_set(b.dev, MGOS_FINGERPRINT_MODE_ENROLL);
+    n = errors = 0;
+    for (uint16_t i = 0; i < cfg->iterations; i++) {
+      int64_t t = mgos_uptime_micros();
+
+      if (!mgos_fingerprint_bench_svc(&b, cfg->library + 1 + i,
+                                      MGOS_FINGERPRINT_EV_ENROLL_OK,
+                                      MGOS_FINGERPRINT_EV_ENROLL_ERROR)) {
+        errors++;
+        continue;
+      }
+      b.samples[n++] = (uint32_t)(mgos_uptime_micros() - t);
+    }
+    fprintf(b.out,
+            "{\"bench\":\"cycle\",\"op\":\"enroll\",\"auto\":%s,"
+            "\"baud\":%u,\"library\":%u,\"errors\":%u",
+            a ? "true" : "false", cfg->cycle_baud, cfg->library, errors);
+    mgos_fingerprint_bench_summary(b.out, b.samples, n);
+    fprintf(b.out, "}\n");
+    mgos_fingerprint_bench_close(&b);
+  }
+  free(b.samples);
+  return true;
+}
+
+// Results of one round of the readers benchmark.
+struct mgos_fingerprint_bench_round {
+  int64_t start_us;
+  uint8_t done;  // bit per reader that reported
+  uint32_t worst_us;
+  uint16_t errors;
+};
+
+static void mgos_fingerprint_bench_mgr_handler(struct mgos_fingerprint_mgr *mgr,
+                                               uint8_t reader, int ev,
+                                               void *ev_data, void *user_data) {
+  struct mgos_fingerprint_bench_round *round =
+      (struct mgos_fingerprint_bench_round *) user_data;
+  uint32_t us;
+
+  if (ev != MGOS_FINGERPRINT_EV_MATCH_OK &&
+      ev != MGOS_FINGERPRINT_EV_MATCH_ERROR)
+    return;
+  if (round->done & (1 << reader)) return;
+  round->done |= 1 << reader;
+  if (ev == MGOS_FINGERPRINT_EV_MATCH_ERROR) round->errors++;
+  us = (uint32_t)(mgos_uptime_micros() - round->start_us);
+  if (us > round->worst_us) round->worst_us = us;
+  (void) mgr;
+  (void) ev_data;
+}
+
+// Identifies a finger on every reader of one manager at once, and reports the
+// slowest reader per round. With n readers on n UARTs this should not grow
+// with n.
+static bool mgos_fingerprint_bench_mgr(
+    const struct mgos_fingerprint_bench_cfg *cfg, uint32_t *samples,
+    uint8_t n) {
+  struct mgos_fingerprint_sim *sims[MGOS_FINGERPRINT_MGR_READERS];
+  struct mgos_fingerprint_transport transports[MGOS_FINGERPRINT_MGR_READERS];
+  struct mgos_fingerprint_bench_round round;
+  struct mgos_fingerprint_mgr *mgr;
+  uint16_t k = 0, errors = 0;
+  bool ok = false;
+
+  memset(sims, 0, sizeof(sims));
+  memset(&round, 0, sizeof(round));
+  mgr = mgos_fingerprint_mgr_create(0, mgos_fingerprint_bench_mgr_handler,
+                                    &round);
+  if (!mgr) return false;
+  for (uint8_t r = 0; r < n; r++) {
+    struct mgos_fingerprint_cfg dcfg;
+
+    sims[r] = mgos_fingerprint_bench_sim(cfg, cfg->cycle_baud,
+                                         MGOS_FINGERPRINT_DATALEN_128, true, 1);
+    if (!sims[r]) goto out;
+    mgos_fingerprint_sim_transport(sims[r], &transports[r]);
+    mgos_fingerprint_bench_dev_cfg(&dcfg, cfg->cycle_baud,
+                                   MGOS_FINGERPRINT_DATALEN_128,
+                                   &transports[r]);
+    dcfg.uart_no = r;
+    if (mgos_fingerprint_mgr_add(mgr, &dcfg) < 0) goto out;
+  }
+
+  for (uint16_t i = 0; i < cfg->iterations; i++) {
+    // Start from idle readers, then put a finger on all of them.
+    for (uint8_t r = 0; r < n; r++) {
+      struct mgos_fingerprint *dev = mgos_fingerprint_mgr_get(mgr, r);
+
+      while (dev->svc_busy) mgos_fingerprint_poll(dev);
+      mgos_fingerprint_sim_set_finger(
+          sims[r], 1 + (i * 7919U + r * 31U) % (cfg->library + 1));
+    }
+    memset(&round, 0, sizeof(round));
+    round.start_us = mgos_uptime_micros();
+    while (round.done != (1 << n) - 1) mgos_fingerprint_mgr_tick(mgr);
+    for (uint8_t r = 0; r < n; r++) mgos_fingerprint_sim_set_finger(sims[r], 0);
+    if (round.errors > 0) {
+      errors++;
+      continue;
+    }
+    samples[k++] = round.worst_us;
+  }
+  fprintf(mgos_fingerprint_bench_out(cfg),
+          "{\"bench\":\"readers\",\"readers\":%u,\"baud\":%u,"
+          "\"library\":%u,\"errors\":%u",
+          n, cfg->cycle_baud, cfg->library, errors);
+  mgos_fingerprint_bench_summary(mgos_fingerprint_bench_out(cfg), samples, k);
+  fprintf(mgos_fingerprint_bench_out(cfg), "}\n");
+  ok = true;
+
+out:
+  mgos_fingerprint_mgr_destroy(&mgr);
+  for (uint8_t r = 0; r < n; r++) mgos_fingerprint_sim_destroy(&sims[r]);
+  return ok;
+}
+
+bool mgos_fingerprint_bench_readers(
+    const struct mgos_fingerprint_bench_cfg *cfg) {
+  uint32_t *samples;
+  bool ok = true;
+
+  if (!cfg || cfg->readers > MGOS_FINGERPRINT_MGR_READERS) return false;
+  if (!(samples = calloc(cfg->iterations + 1, sizeof(*samples)))) return false;
+  for (uint8_t n = 1; n <= cfg->readers && ok; n++)
+    ok = mgos_fingerprint_bench_mgr(cfg, samples, n);
+  free(samples);
+  return ok;
+}
+
+// Identifies a finger held by one of n sharded modules, captured on the
+// first. The probe is sent to the other shards once and they search side by
+// side, so from two shards on this should not grow with n. The sync API
+// sleeps between polls, so samples are rounded up to the poll interval.
+static bool mgos_fingerprint_bench_shard(
+    const struct mgos_fingerprint_bench_cfg *cfg, uint32_t *samples,
+    uint8_t n) {
+  struct mgos_fingerprint_sim *sims[MGOS_FINGERPRINT_SHARDS];
+  struct mgos_fingerprint_transport transports[MGOS_FINGERPRINT_SHARDS];
+  struct mgos_fingerprint *devs[MGOS_FINGERPRINT_SHARDS];
+  struct mgos_fingerprint_shards *shards = NULL;
+  uint32_t fingers = (uint32_t) n * cfg->library, slots;
+  uint16_t k = 0, errors = 0;
+  bool ok = false;
+
+  memset(sims, 0, sizeof(sims));
+  memset(devs, 0, sizeof(devs));
+  for (uint8_t r = 0; r < n; r++) {
+    struct mgos_fingerprint_cfg dcfg;
+
+    sims[r] = mgos_fingerprint_bench_sim(cfg, cfg->cycle_baud,
+                                         MGOS_FINGERPRINT_DATALEN_128, false,
+                                         1 + r * cfg->library);
+    if (!sims[r]) goto out;
+    mgos_fingerprint_sim_transport(sims[r], &transports[r]);
+    mgos_fingerprint_bench_dev_cfg(&dcfg, cfg->cycle_baud,
+                                   MGOS_FINGERPRINT_DATALEN_128,
+                                   &transports[r]);
+    dcfg.uart_no = r;
+    if (!(devs[r] = mgos_fingerprint_create(&dcfg))) goto out;
+  }
+  if (!(shards = mgos_fingerprint_shards_create(devs, n))) goto out;
+  slots = devs[0]->system_params.library_size;
+
+  for (uint16_t i = 0; i < cfg->iterations; i++) {
+    uint32_t finger = 1 + (i * 7919U) % (fingers + 1), id = 0;
+    int64_t start;
+    int16_t p;
+
+    mgos_fingerprint_sim_set_finger(sims[0], finger);
+    p = mgos_fingerprint_image_get(devs[0]);
+    if (p == MGOS_FINGERPRINT_OK)
+      p = mgos_fingerprint_image_genchar(devs[0], 1);
+    mgos_fingerprint_sim_set_finger(sims[0], 0);
+    if (p != MGOS_FINGERPRINT_OK) {
+      errors++;
+      continue;
+    }
+    start = mgos_uptime_micros();
+    p = mgos_fingerprint_shards_identify(shards, 0, &id, NULL);
+    // Each module has spare slots past its library.
+    if (finger > fingers ? p != MGOS_FINGERPRINT_NOTFOUND
+                         : p != MGOS_FINGERPRINT_OK ||
+                               id != (finger - 1) / cfg->library * slots +
+                                         (finger - 1) % cfg->library) {
+      errors++;
+      continue;
+    }
+    samples[k++] = (uint32_t)(mgos_uptime_micros() - start);
+  }
+  fprintf(mgos_fingerprint_bench_out(cfg),
+          "{\"bench\":\"shards\",\"shards\":%u,\"capacity\":%u,"
+          "\"baud\":%u,\"library\":%u,\"errors\":%u",
+          n, mgos_fingerprint_shards_capacity(shards), cfg->cycle_baud,
+          fingers, errors);
+  mgos_fingerprint_bench_summary(mgos_fingerprint_bench_out(cfg), samples, k);
+  fprintf(mgos_fingerprint_bench_out(cfg), "}\n");
+  ok = true;
+
+out:
+  mgos_fingerprint_shards_destroy(&shards);
+  for (uint8_t r = 0; r < n; r++) {
+    mgos_fingerprint_destroy(&devs[r]);
+    mgos_fingerprint_sim_destroy(&sims[r]);
+  }
+  return ok;
+}
+
+bool mgos_fingerprint_bench_shards(
+    const struct mgos_fingerprint_bench_cfg *cfg) {
+  uint32_t *samples;
+  bool ok = true;
+
+  if (!cfg || cfg->shards > MGOS_FINGERPRINT_SHARDS) return false;
+  if (!(samples = calloc(cfg->iterations + 1, sizeof(*samples)))) return false;
+  for (uint8_t n = 1; n <= cfg->shards && ok; n++)
+    ok = mgos_fingerprint_bench_shard(cfg, samples, n);
+  free(samples);
+  return ok;
+}
+
+void mgos_fingerprint_bench_config_set_defaults(
+    struct mgos_fingerprint_bench_cfg *cfg) {
+  if (!cfg) return;
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->out = NULL;
+  cfg->iterations = 20;
+  cfg->transfers = 3;
+  cfg->imports = 20;
+  cfg->baud_min = 9600;
+  cfg->baud_max = 115200;
+  cfg->datalen_min = MGOS_FINGERPRINT_DATALEN_32;
+  cfg->datalen_max = MGOS_FINGERPRINT_DATALEN_256;
+  cfg->frame_bytes = 1 << 20;
+  cfg->library = 100;
+  cfg->cycle_baud = 57600;
+  cfg->readers = 4;
+  cfg->shards = 4;
+  cfg->wire_time = true;
+  cfg->images = false;
+}
+
+bool mgos_fingerprint_bench_run(const struct mgos_fingerprint_bench_cfg *cfg) {
+  return mgos_fingerprint_bench_frame(cfg) && mgos_fingerprint_bench_rtt(cfg) &&
+         mgos_fingerprint_bench_transfer(cfg) &&
+         mgos_fingerprint_bench_import(cfg) &&
+         mgos_fingerprint_bench_cycle(cfg) &&
+         mgos_fingerprint_bench_readers(cfg) &&
+         mgos_fingerprint_bench_shards(cfg);
+}
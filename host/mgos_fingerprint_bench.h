@@ -0,0 +1,84 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of the driver against the simulated module, meant to run on a
+// host. Each result is one JSON object per line, so runs of two releases can
+// be compared by a script:
+//
+//   {"bench":"frame",...}     framing and checksum, and parsing, per byte
+//   {"bench":"rtt",...}       round trip of single commands
+//   {"bench":"transfer",...}  template and image transfers
+//   {"bench":"import",...}    templates per second of a bulk import
+//   {"bench":"cycle",...}     identify and enroll through the service loop
+//   {"bench":"readers",...}   slowest identify of several readers at once
+//   {"bench":"shards",...}    identify over a library sharded across modules
+//
+// Latencies are in microseconds. The simulator answers after the latencies
+// of a real module, so absolute numbers are only comparable between runs
+// with the same configuration. The driver is polled in a tight loop, so the
+// results show the cost of the driver and the link, not of the event loop.
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct mgos_fingerprint_bench_cfg {
+  FILE *out;            // for the results, stdout if NULL
+  uint16_t iterations;  // samples per latency
+  uint16_t transfers;   // transfers per throughput
+  uint16_t imports;     // templates per bulk import
+  // The standard baud rates and data packet lengths in these ranges are
+  // measured one by one.
+  uint32_t baud_min;
+  uint32_t baud_max;
+  uint8_t datalen_min;  // enum mgos_fingerprint_param_datalen
+  uint8_t datalen_max;
+  uint32_t frame_bytes;  // framed and parsed per data packet length
+  uint16_t library;      // templates in the simulated module
+  uint32_t cycle_baud;   // for the identify and enroll cycles
+  uint8_t readers;       // up to this many readers on one manager
+  uint8_t shards;        // up to this many modules in one sharded library
+  bool wire_time;        // let frames take their time on the wire
+  bool images;           // include image uploads in the transfers
+};
+
+void mgos_fingerprint_bench_config_set_defaults(
+    struct mgos_fingerprint_bench_cfg *cfg);
+
+// Each returns false if a simulated module could not be set up.
+bool mgos_fingerprint_bench_frame(const struct mgos_fingerprint_bench_cfg *cfg);
+bool mgos_fingerprint_bench_rtt(const struct mgos_fingerprint_bench_cfg *cfg);
+bool mgos_fingerprint_bench_transfer(
+    const struct mgos_fingerprint_bench_cfg *cfg);
+bool mgos_fingerprint_bench_import(
+    const struct mgos_fingerprint_bench_cfg *cfg);
+bool mgos_fingerprint_bench_cycle(const struct mgos_fingerprint_bench_cfg *cfg);
+bool mgos_fingerprint_bench_readers(
+    const struct mgos_fingerprint_bench_cfg *cfg);
+bool mgos_fingerprint_bench_shards(
+    const struct mgos_fingerprint_bench_cfg *cfg);
+// All of the above, in that order.
+bool mgos_fingerprint_bench_run(const struct mgos_fingerprint_bench_cfg *cfg);
+
+#ifdef __cplusplus
+}
+#endif
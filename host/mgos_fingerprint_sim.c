@@ -0,0 +1,910 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Simulated GROW module; see mgos_fingerprint_sim.h.
+//
+// Frames from the host are executed as soon as they are complete. Answers are
+// queued with the time they are due: the module works on one command at a
+// time, so each answer is due its latency after the later of the command's
+// arrival and the module's previous answer, plus its time on the wire.
+
+#ifdef __linux__
+#define _GNU_SOURCE  // posix_openpt() and friends
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+#include "mgos_fingerprint_sim.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define SIM_FRAME_MAX \
+  (MGOS_FINGERPRINT_HEADER_LEN + MGOS_FINGERPRINT_DATA_MAXLEN + 2)
+#define SIM_SCORE 200  // of a match; templates either match or they do not
+#define SIM_NOFINGER_US 10000  // to find the sensor empty
+#define SIM_FINGER_WAIT_US 2000000  // auto commands wait for a finger
+
+struct mgos_fingerprint_sim_frame {
+  struct mgos_fingerprint_sim_frame *next;
+  int64_t due_us;
+  uint32_t baud;  // rate it was sent at
+  uint16_t len;
+  uint16_t pos;
+  uint8_t bytes[];
+};
+
+struct mgos_fingerprint_sim {
+  struct mgos_fingerprint_sim_cfg cfg;
+  struct mgos_fingerprint_sim_faults faults;
+  uint32_t latency_us[256];
+  uint32_t commands;
+  uint32_t rand;
+
+  // Module state.
+  uint32_t password;
+  bool verified;  // password given since power on
+  uint32_t baud;
+  uint16_t security_level;
+  uint8_t datapacket_length;
+  uint32_t finger;  // on the sensor, 0 for none
+  uint32_t image;   // finger in the image buffer, 0 for none
+  uint8_t *chars[2];
+  uint8_t *library;  // capacity templates of model_size bytes
+  uint8_t *used;
+  uint8_t notepad[MGOS_FINGERPRINT_NOTEPAD_PAGES]
+                 [MGOS_FINGERPRINT_NOTEPAD_SIZE];
+
+  // Receiver.
+  uint8_t in[SIM_FRAME_MAX];
+  uint16_t in_len;
+  int8_t down;  // character buffer being downloaded into, or -1
+  uint32_t down_off;
+  int64_t in_clock_us;  // when the host's last byte has arrived
+
+  // Sender.
+  struct mgos_fingerprint_sim_frame *head, *tail;
+  int64_t clock_us;  // when the module is done with its last answer
+
+  // Host side.
+  uint32_t host_baud;
+  bool baud_check;
+  int pty;
+};
+
+// Latencies in microseconds of a module that is quick to answer but slow to
+// capture, extract and write to flash.
+static const struct {
+  uint8_t cmd;
+  uint32_t us;
+} mgos_fingerprint_sim_latencies[] = {
+    {MGOS_FINGERPRINT_CMD_GETIMAGE, 150000},
+    {MGOS_FINGERPRINT_CMD_IMAGE2TZ, 120000},
+    {MGOS_FINGERPRINT_CMD_PAIRMATCH, 20000},
+    {MGOS_FINGERPRINT_CMD_REGMODEL, 40000},
+    {MGOS_FINGERPRINT_CMD_SEARCH, 5000},
+    {MGOS_FINGERPRINT_CMD_HISPEEDSEARCH, 5000},
+    {MGOS_FINGERPRINT_CMD_STORE, 40000},
+    {MGOS_FINGERPRINT_CMD_LOAD, 10000},
+    {MGOS_FINGERPRINT_CMD_DELETE, 30000},
+    {MGOS_FINGERPRINT_CMD_EMPTYDATABASE, 60000},
+    {MGOS_FINGERPRINT_CMD_SETSYSPARAM, 30000},
+    {MGOS_FINGERPRINT_CMD_SETPASSWORD, 30000},
+    {MGOS_FINGERPRINT_CMD_WRITENOTEPAD, 30000},
+};
+
+static uint32_t mgos_fingerprint_sim_random(struct mgos_fingerprint_sim *sim) {
+  uint32_t x = sim->rand;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return sim->rand = x;
+}
+
+static bool mgos_fingerprint_sim_chance(struct mgos_fingerprint_sim *sim,
+                                        uint8_t pct) {
+  return pct > 0 && mgos_fingerprint_sim_random(sim) % 100 < pct;
+}
+
+// Time on the wire of `n` bytes, 10 bits each.
+static int64_t mgos_fingerprint_sim_wire_us(struct mgos_fingerprint_sim *sim,
+                                            size_t n) {
+  if (!sim->cfg.wire_time || sim->baud == 0) return 0;
+  return (int64_t) n * 10000000 / sim->baud;
+}
+
+// The features a finger yields: the same bytes for the same finger.
+static void mgos_fingerprint_sim_features(struct mgos_fingerprint_sim *sim,
+                                          uint32_t finger, uint8_t *buf) {
+  uint32_t x = finger * 2654435761U ^ 0x5A5AA5A5;
+
+  for (uint16_t i = 0; i < sim->cfg.model_size; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf[i] = x;
+  }
+}
+
+// The image buffer, four bits per pixel: the same bytes for the same finger.
+static uint32_t mgos_fingerprint_sim_image(struct mgos_fingerprint_sim *sim,
+                                           uint8_t *buf) {
+  uint32_t len = (uint32_t) sim->cfg.sensor_width * sim->cfg.sensor_height / 2;
+
+  if (buf)
+    for (uint32_t i = 0; i < len; i++) buf[i] = i * sim->image;
+  return len;
+}
+
+static uint8_t *mgos_fingerprint_sim_model(struct mgos_fingerprint_sim *sim,
+                                           uint16_t id) {
+  return sim->library + (size_t) id * sim->cfg.model_size;
+}
+
+// Queues a frame `delay_us` after the module's clock, injecting faults.
+static void mgos_fingerprint_sim_send(struct mgos_fingerprint_sim *sim,
+                                      uint8_t type, const uint8_t *data,
+                                      uint16_t n, uint32_t delay_us) {
+  static const uint8_t noise[] = {0x12, 0xEF};
+  struct mgos_fingerprint_sim_frame *f;
+  bool noisy = mgos_fingerprint_sim_chance(sim, sim->faults.noise);
+  uint16_t len = MGOS_FINGERPRINT_HEADER_LEN + n + 2, sum = n + 2 + type;
+  uint8_t *p;
+
+  if (noisy) len += sizeof(noise);
+  sim->clock_us += delay_us + mgos_fingerprint_sim_wire_us(sim, len);
+  if (mgos_fingerprint_sim_chance(sim, sim->faults.drop)) return;
+  if (!(f = calloc(1, sizeof(*f) + len))) return;
+  f->due_us = sim->clock_us;
+  f->baud = sim->baud;
+  f->len = len;
+  p = f->bytes;
+  if (noisy) {
+    memcpy(p, noise, sizeof(noise));
+    p += sizeof(noise);
+  }
+  *p++ = MGOS_FINGERPRINT_STARTCODE >> 8;
+  *p++ = MGOS_FINGERPRINT_STARTCODE & 0xFF;
+  *p++ = sim->cfg.address >> 24;
+  *p++ = sim->cfg.address >> 16;
+  *p++ = sim->cfg.address >> 8;
+  *p++ = sim->cfg.address;
+  *p++ = type;
+  *p++ = (n + 2) >> 8;
+  *p++ = (n + 2) & 0xFF;
+  for (uint16_t i = 0; i < n; i++) sum += *p++ = data[i];
+  if (mgos_fingerprint_sim_chance(sim, sim->faults.corrupt)) sum ^= 0x01;
+  *p++ = sum >> 8;
+  *p = sum & 0xFF;
+
+  if (sim->tail)
+    sim->tail->next = f;
+  else
+    sim->head = f;
+  sim->tail = f;
+}
+
+static void mgos_fingerprint_sim_ack(struct mgos_fingerprint_sim *sim,
+                                     uint8_t code, const uint8_t *data,
+                                     uint16_t n, uint32_t delay_us) {
+  uint8_t buf[1 + 64];
+
+  buf[0] = code;
+  if (n > sizeof(buf) - 1) n = sizeof(buf) - 1;
+  if (n) memcpy(buf + 1, data, n);
+  mgos_fingerprint_sim_send(sim, MGOS_FINGERPRINT_ACKPACKET, buf, n + 1,
+                            delay_us);
+}
+
+// Sends `len` bytes in data packets of the configured length.
+static void mgos_fingerprint_sim_stream(struct mgos_fingerprint_sim *sim,
+                                        const uint8_t *data, uint32_t len) {
+  uint16_t chunk = 32 << (sim->datapacket_length & 0x03);
+
+  for (uint32_t off = 0; off < len; off += chunk) {
+    uint16_t n = len - off < chunk ? len - off : chunk;
+
+    mgos_fingerprint_sim_send(sim,
+                              off + n < len ? MGOS_FINGERPRINT_DATAPACKET
+                                            : MGOS_FINGERPRINT_ENDDATAPACKET,
+                              data + off, n, 0);
+  }
+}
+
+static void mgos_fingerprint_sim_search(struct mgos_fingerprint_sim *sim,
+                                        const uint8_t *d, uint16_t n) {
+  uint8_t cmd = d[0], buf = d[1] - 1, r[4] = {0};
+  uint32_t start = (d[2] << 8) | d[3], count = (d[4] << 8) | d[5];
+  uint32_t us = sim->latency_us[cmd], models = 0;
+  int32_t hit = -1;
+
+  if (n < 6 || buf > 1 || start >= sim->cfg.capacity) {
+    mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_PAGEID, r, 4, us);
+    return;
+  }
+  if (start + count > sim->cfg.capacity) count = sim->cfg.capacity - start;
+  for (uint32_t id = start; id < start + count; id++) {
+    if (!sim->used[id]) continue;
+    models++;
+    if (hit < 0 && !memcmp(sim->chars[buf], mgos_fingerprint_sim_model(sim, id),
+                           sim->cfg.model_size))
+      hit = id;
+  }
+  // A high speed search stops at the first hit.
+  us += sim->cfg.search_us_per_model * models /
+        (cmd == MGOS_FINGERPRINT_CMD_HISPEEDSEARCH ? 4 : 1);
+  if (hit < 0) {
+    mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_NOTFOUND, r, 4, us);
+    return;
+  }
+  r[0] = hit >> 8;
+  r[1] = hit & 0xFF;
+  r[2] = SIM_SCORE >> 8;
+  r[3] = SIM_SCORE & 0xFF;
+  mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 4, us);
+}
+
+static void mgos_fingerprint_sim_auto_enroll(struct mgos_fingerprint_sim *sim,
+                                             const uint8_t *d) {
+  uint16_t id = (d[1] << 8) | d[2];
+  uint8_t times = d[3] ? d[3] : 2, r[2];
+
+  if (id >= sim->cfg.capacity) {
+    mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_PAGEID, NULL, 0, 0);
+    return;
+  }
+  for (uint8_t i = 1; i <= times; i++) {
+    r[1] = i;
+    if (!sim->finger) {
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_FINGERTIMEOUT, NULL,
+                               0, SIM_FINGER_WAIT_US);
+      return;
+    }
+    r[0] = MGOS_FINGERPRINT_AUTO_IMAGE;
+    mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 2,
+                             sim->latency_us[MGOS_FINGERPRINT_CMD_GETIMAGE]);
+    r[0] = MGOS_FINGERPRINT_AUTO_GENCHAR;
+    mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 2,
+                             sim->latency_us[MGOS_FINGERPRINT_CMD_IMAGE2TZ]);
+    if (i == times) break;
+    r[0] = MGOS_FINGERPRINT_AUTO_LIFT;
+    mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 2, 0);
+  }
+  r[0] = MGOS_FINGERPRINT_AUTO_COMBINE;
+  r[1] = 0;
+  mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 2,
+                           sim->latency_us[MGOS_FINGERPRINT_CMD_REGMODEL]);
+  mgos_fingerprint_sim_features(sim, sim->finger,
+                                mgos_fingerprint_sim_model(sim, id));
+  sim->used[id] = 1;
+  r[0] = MGOS_FINGERPRINT_AUTO_STORE;
+  mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 2,
+                           sim->latency_us[MGOS_FINGERPRINT_CMD_STORE]);
+}
+
+static void mgos_fingerprint_sim_auto_identify(
+    struct mgos_fingerprint_sim *sim, const uint8_t *d) {
+  uint8_t r[5] = {MGOS_FINGERPRINT_AUTO_IMAGE, 0, 0, 0, 0};
+  uint8_t search[6] = {MGOS_FINGERPRINT_CMD_SEARCH, 1, d[2], d[3], d[4], d[5]};
+  struct mgos_fingerprint_sim_frame *last;
+
+  if (!sim->finger) {
+    mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_FINGERTIMEOUT, NULL,
+                             0, SIM_FINGER_WAIT_US);
+    return;
+  }
+  mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 5,
+                           sim->latency_us[MGOS_FINGERPRINT_CMD_GETIMAGE]);
+  r[0] = MGOS_FINGERPRINT_AUTO_GENCHAR;
+  mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 5,
+                           sim->latency_us[MGOS_FINGERPRINT_CMD_IMAGE2TZ]);
+  // The search step reads like a search acknowledge with the step in front.
+  sim->image = sim->finger;
+  mgos_fingerprint_sim_features(sim, sim->image, sim->chars[0]);
+  last = sim->tail;
+  mgos_fingerprint_sim_search(sim, search, sizeof(search));
+  if (sim->tail == last) return;  // dropped
+  {
+    struct mgos_fingerprint_sim_frame *f = sim->tail;
+    uint8_t code = f->bytes[f->len - 7];
+
+    memcpy(r + 1, &f->bytes[f->len - 6], 4);
+    r[0] = MGOS_FINGERPRINT_AUTO_SEARCH;
+    // Rebuild it in place of the search acknowledge.
+    for (struct mgos_fingerprint_sim_frame **pp = &sim->head; *pp;
+         pp = &(*pp)->next) {
+      if (*pp != f) continue;
+      *pp = NULL;
+      sim->tail = last;
+      break;
+    }
+    sim->clock_us = f->due_us;
+    free(f);
+    mgos_fingerprint_sim_ack(sim, code, r, 5, 0);
+  }
+}
+
+static void mgos_fingerprint_sim_sysparams(struct mgos_fingerprint_sim *sim) {
+  uint8_t p[16] = {0};
+
+  p[4] = sim->cfg.capacity >> 8;
+  p[5] = sim->cfg.capacity & 0xFF;
+  p[7] = sim->security_level;
+  p[8] = sim->cfg.address >> 24;
+  p[9] = sim->cfg.address >> 16;
+  p[10] = sim->cfg.address >> 8;
+  p[11] = sim->cfg.address;
+  p[13] = sim->datapacket_length;
+  p[15] = sim->baud / 9600;
+  mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, p, sizeof(p), 0);
+}
+
+static void mgos_fingerprint_sim_info(struct mgos_fingerprint_sim *sim) {
+  struct mgos_fingerprint_info info;
+
+  memset(&info, 0, sizeof(info));
+  // The auto commands are only tried on the module families that have them.
+  strncpy(info.module_model, sim->cfg.auto_commands ? "R503-SIM" : "SIM",
+          sizeof(info.module_model));
+  memcpy(info.module_batch, "SIM1", sizeof(info.module_batch));
+  snprintf(info.module_serial, sizeof(info.module_serial), "%07x",
+           (unsigned) (sim->cfg.seed & 0x0FFFFFFF));
+  info.hwver = htons(0x0100);
+  memcpy(info.sensor_model, "SIMSENS", 7);
+  info.sensor_width = htons(sim->cfg.sensor_width);
+  info.sensor_height = htons(sim->cfg.sensor_height);
+  info.model_size = htons(sim->cfg.model_size);
+  info.model_capacity = htons(sim->cfg.capacity);
+  mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, (uint8_t *) &info,
+                           sizeof(info), 0);
+}
+
+static void mgos_fingerprint_sim_param(struct mgos_fingerprint_sim *sim,
+                                       uint8_t param, uint8_t value,
+                                       uint32_t us) {
+  switch (param) {
+    case MGOS_FINGERPRINT_PARAM_BAUDRATE:
+      if (value != 1 && value != 2 && value != 4 && value != 6 &&
+          value != 12)
+        break;
+      // Acknowledged at the old rate, then the module switches.
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      sim->baud = (uint32_t) value * 9600;
+      return;
+    case MGOS_FINGERPRINT_PARAM_SECURITY_LEVEL:
+      if (value < 1 || value > 5) break;
+      sim->security_level = value;
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      return;
+    case MGOS_FINGERPRINT_PARAM_DATAPACKET_LENGTH:
+      if (value > MGOS_FINGERPRINT_DATALEN_256) break;
+      sim->datapacket_length = value;
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      return;
+  }
+  mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_CONFIGREG, NULL, 0, us);
+}
+
+static void mgos_fingerprint_sim_command(struct mgos_fingerprint_sim *sim,
+                                         const uint8_t *d, uint16_t n) {
+  uint8_t cmd = d[0], buf = n > 1 ? d[1] - 1 : 0;
+  uint8_t r[MGOS_FINGERPRINT_NOTEPAD_SIZE];
+  uint32_t us = sim->latency_us[cmd];
+  uint16_t id = n > 3 ? (d[2] << 8) | d[3] : 0;
+
+  sim->commands++;
+  memset(r, 0, sizeof(r));
+  // A module with a password of its own wants it before anything else.
+  if (!sim->verified && sim->password != MGOS_FINGERPRINT_DEFAULT_PASSWORD &&
+      cmd != MGOS_FINGERPRINT_CMD_HANDSHAKE &&
+      cmd != MGOS_FINGERPRINT_CMD_VERIFYPASSWORD) {
+    mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_PASSWORD, NULL, 0, us);
+    return;
+  }
+  switch (cmd) {
+    case MGOS_FINGERPRINT_CMD_GETIMAGE:
+      // Only a finger is scanned; an empty sensor is noticed at once.
+      sim->image = sim->finger;
+      if (sim->finger)
+        mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      else
+        mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_NOFINGER, NULL, 0,
+                                 SIM_NOFINGER_US);
+      return;
+    case MGOS_FINGERPRINT_CMD_IMAGE2TZ:
+      if (buf > 1 || !sim->image) break;
+      mgos_fingerprint_sim_features(sim, sim->image, sim->chars[buf]);
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      return;
+    case MGOS_FINGERPRINT_CMD_PAIRMATCH:
+      if (memcmp(sim->chars[0], sim->chars[1], sim->cfg.model_size)) {
+        mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_MATCH, r, 2, us);
+        return;
+      }
+      r[0] = SIM_SCORE >> 8;
+      r[1] = SIM_SCORE & 0xFF;
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 2, us);
+      return;
+    case MGOS_FINGERPRINT_CMD_HISPEEDSEARCH:
+      if (!sim->cfg.hispeed_search) goto invalid;
+      // fallthrough
+    case MGOS_FINGERPRINT_CMD_SEARCH:
+      mgos_fingerprint_sim_search(sim, d, n);
+      return;
+    case MGOS_FINGERPRINT_CMD_REGMODEL:
+      mgos_fingerprint_sim_ack(
+          sim,
+          memcmp(sim->chars[0], sim->chars[1], sim->cfg.model_size)
+              ? MGOS_FINGERPRINT_FAIL_COMBINE
+              : MGOS_FINGERPRINT_OK,
+          NULL, 0, us);
+      return;
+    case MGOS_FINGERPRINT_CMD_STORE:
+      if (buf > 1 || id >= sim->cfg.capacity) {
+        mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_PAGEID, NULL, 0,
+                                 us);
+        return;
+      }
+      memcpy(mgos_fingerprint_sim_model(sim, id), sim->chars[buf],
+             sim->cfg.model_size);
+      sim->used[id] = 1;
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      return;
+    case MGOS_FINGERPRINT_CMD_LOAD:
+      if (buf > 1 || id >= sim->cfg.capacity) {
+        mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_PAGEID, NULL, 0,
+                                 us);
+        return;
+      }
+      if (!sim->used[id]) {
+        mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_TEMPLATEREAD, NULL,
+                                 0, us);
+        return;
+      }
+      memcpy(sim->chars[buf], mgos_fingerprint_sim_model(sim, id),
+             sim->cfg.model_size);
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      return;
+    case MGOS_FINGERPRINT_CMD_UPCHAR:
+      if (buf > 1) break;
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      mgos_fingerprint_sim_stream(sim, sim->chars[buf], sim->cfg.model_size);
+      return;
+    case MGOS_FINGERPRINT_CMD_DOWNCHAR:
+      if (buf > 1) break;
+      sim->down = buf;
+      sim->down_off = 0;
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      return;
+    case MGOS_FINGERPRINT_CMD_IMGUPLOAD: {
+      uint32_t len = mgos_fingerprint_sim_image(sim, NULL);
+      uint8_t *img;
+
+      if (!sim->image || !(img = malloc(len))) {
+        mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_IMAGEUPLOAD, NULL,
+                                 0, us);
+        return;
+      }
+      mgos_fingerprint_sim_image(sim, img);
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      mgos_fingerprint_sim_stream(sim, img, len);
+      free(img);
+      return;
+    }
+    case MGOS_FINGERPRINT_CMD_DELETE: {
+      uint16_t first = (d[1] << 8) | d[2], count = (d[3] << 8) | d[4];
+
+      if (n < 5 || (uint32_t) first + count > sim->cfg.capacity) {
+        mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_TEMPLATEDELETE,
+                                 NULL, 0, us);
+        return;
+      }
+      memset(sim->used + first, 0, count);
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      return;
+    }
+    case MGOS_FINGERPRINT_CMD_EMPTYDATABASE:
+      memset(sim->used, 0, sim->cfg.capacity);
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      return;
+    case MGOS_FINGERPRINT_CMD_SETSYSPARAM:
+      if (n < 3) break;
+      mgos_fingerprint_sim_param(sim, d[1], d[2], us);
+      return;
+    case MGOS_FINGERPRINT_CMD_READSYSPARAM:
+      mgos_fingerprint_sim_sysparams(sim);
+      return;
+    case MGOS_FINGERPRINT_CMD_SETPASSWORD:
+    case MGOS_FINGERPRINT_CMD_VERIFYPASSWORD: {
+      uint32_t pw;
+
+      if (n < 5) break;
+      pw = ((uint32_t) d[1] << 24) | ((uint32_t) d[2] << 16) |
+           ((uint32_t) d[3] << 8) | d[4];
+      if (cmd == MGOS_FINGERPRINT_CMD_SETPASSWORD) sim->password = pw;
+      if (pw == sim->password) sim->verified = true;
+      mgos_fingerprint_sim_ack(sim,
+                               pw == sim->password
+                                   ? MGOS_FINGERPRINT_OK
+                                   : MGOS_FINGERPRINT_FAIL_PASSWORD,
+                               NULL, 0, us);
+      return;
+    }
+    case MGOS_FINGERPRINT_CMD_GETRANDOM: {
+      uint32_t x = mgos_fingerprint_sim_random(sim);
+
+      r[0] = x >> 24;
+      r[1] = x >> 16;
+      r[2] = x >> 8;
+      r[3] = x;
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 4, us);
+      return;
+    }
+    case MGOS_FINGERPRINT_CMD_WRITENOTEPAD:
+    case MGOS_FINGERPRINT_CMD_READNOTEPAD:
+      if (n < 2 || d[1] >= MGOS_FINGERPRINT_NOTEPAD_PAGES) {
+        mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_NOTEPADPAGE, NULL,
+                                 0, us);
+        return;
+      }
+      if (cmd == MGOS_FINGERPRINT_CMD_READNOTEPAD) {
+        mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, sim->notepad[d[1]],
+                                 MGOS_FINGERPRINT_NOTEPAD_SIZE, us);
+        return;
+      }
+      if (n < 2 + MGOS_FINGERPRINT_NOTEPAD_SIZE) break;
+      memcpy(sim->notepad[d[1]], d + 2, MGOS_FINGERPRINT_NOTEPAD_SIZE);
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      return;
+    case MGOS_FINGERPRINT_CMD_TEMPLATECOUNT: {
+      uint16_t count = 0;
+
+      for (uint16_t i = 0; i < sim->cfg.capacity; i++) count += sim->used[i];
+      r[0] = count >> 8;
+      r[1] = count & 0xFF;
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 2, us);
+      return;
+    }
+    case MGOS_FINGERPRINT_CMD_READTEMPLATEINDEX:
+      if (n < 2) break;
+      for (uint16_t i = 0; i < MGOS_FINGERPRINT_TEMPLATES_PER_PAGE; i++) {
+        uint32_t slot = d[1] * MGOS_FINGERPRINT_TEMPLATES_PER_PAGE + i;
+
+        if (slot < sim->cfg.capacity && sim->used[slot])
+          r[i / 8] |= 1 << (i % 8);
+      }
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, r, 32, us);
+      return;
+    case MGOS_FINGERPRINT_CMD_AUTOENROLL:
+      if (!sim->cfg.auto_commands || n < 4) goto invalid;
+      mgos_fingerprint_sim_auto_enroll(sim, d);
+      return;
+    case MGOS_FINGERPRINT_CMD_AUTOIDENTIFY:
+      if (!sim->cfg.auto_commands || n < 6) goto invalid;
+      mgos_fingerprint_sim_auto_identify(sim, d);
+      return;
+    case MGOS_FINGERPRINT_CMD_READPRODINFO:
+      mgos_fingerprint_sim_info(sim);
+      return;
+    case MGOS_FINGERPRINT_CMD_STANDBY:
+    case MGOS_FINGERPRINT_CMD_LED_CONTROL:
+    case MGOS_FINGERPRINT_CMD_HANDSHAKE:
+    case MGOS_FINGERPRINT_CMD_LEDON:
+    case MGOS_FINGERPRINT_CMD_LEDOFF:
+      mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_OK, NULL, 0, us);
+      return;
+    default:
+      goto invalid;
+  }
+  // Malformed parameters.
+  mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_PACKETRECIEVEERR, NULL, 0,
+                           us);
+  return;
+
+invalid:
+  mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_FAIL_INVALIDREG, NULL, 0, us);
+}
+
+// Executes a complete frame; `d` is its payload without the checksum.
+static void mgos_fingerprint_sim_frame(struct mgos_fingerprint_sim *sim,
+                                       uint8_t type, const uint8_t *d,
+                                       uint16_t n) {
+  if (type == MGOS_FINGERPRINT_DATAPACKET ||
+      type == MGOS_FINGERPRINT_ENDDATAPACKET) {
+    if (sim->down < 0) return;
+    if (sim->down_off + n > sim->cfg.model_size)
+      n = sim->cfg.model_size - sim->down_off;
+    memcpy(sim->chars[sim->down] + sim->down_off, d, n);
+    sim->down_off += n;
+    if (type == MGOS_FINGERPRINT_ENDDATAPACKET) sim->down = -1;
+    return;
+  }
+  if (type != MGOS_FINGERPRINT_COMMANDPACKET || n == 0) return;
+  mgos_fingerprint_sim_command(sim, d, n);
+}
+
+// Takes bytes from the host. They arrive after their time on the wire,
+// behind whatever the host wrote before them.
+static void mgos_fingerprint_sim_input(struct mgos_fingerprint_sim *sim,
+                                       const uint8_t *buf, size_t len) {
+  int64_t now = mgos_uptime_micros();
+
+  if (sim->in_clock_us < now) sim->in_clock_us = now;
+  sim->in_clock_us += mgos_fingerprint_sim_wire_us(sim, len);
+  if (sim->clock_us < sim->in_clock_us) sim->clock_us = sim->in_clock_us;
+  while (len > 0) {
+    const uint8_t *p = sim->in;
+    uint16_t flen, sum;
+    size_t want, n;
+
+    want = sim->in_len < MGOS_FINGERPRINT_HEADER_LEN
+               ? MGOS_FINGERPRINT_HEADER_LEN
+               : MGOS_FINGERPRINT_HEADER_LEN + ((p[7] << 8) | p[8]);
+    n = want - sim->in_len < len ? want - sim->in_len : len;
+    memcpy(sim->in + sim->in_len, buf, n);
+    sim->in_len += n;
+    buf += n;
+    len -= n;
+    if (sim->in_len < want) continue;
+
+    flen = (p[7] << 8) | p[8];
+    if (sim->in_len == MGOS_FINGERPRINT_HEADER_LEN) {
+      // Hunt for a header that makes sense.
+      if (p[0] != (MGOS_FINGERPRINT_STARTCODE >> 8) ||
+          p[1] != (MGOS_FINGERPRINT_STARTCODE & 0xFF) || flen < 2 ||
+          (size_t) MGOS_FINGERPRINT_HEADER_LEN + flen > sizeof(sim->in)) {
+        memmove(sim->in, sim->in + 1, --sim->in_len);
+      }
+      continue;
+    }
+    sim->in_len = 0;
+    if (((uint32_t) p[2] << 24 | (uint32_t) p[3] << 16 |
+         (uint32_t) p[4] << 8 | p[5]) != sim->cfg.address)
+      continue;
+    sum = flen + p[6];
+    for (uint16_t i = 0; i < flen - 2; i++)
+      sum += p[MGOS_FINGERPRINT_HEADER_LEN + i];
+    if (p[MGOS_FINGERPRINT_HEADER_LEN + flen - 2] != sum >> 8 ||
+        p[MGOS_FINGERPRINT_HEADER_LEN + flen - 1] != (sum & 0xFF)) {
+      if (p[6] == MGOS_FINGERPRINT_COMMANDPACKET)
+        mgos_fingerprint_sim_ack(sim, MGOS_FINGERPRINT_PACKETRECIEVEERR, NULL,
+                                 0, 0);
+      continue;
+    }
+    mgos_fingerprint_sim_frame(sim, p[6], p + MGOS_FINGERPRINT_HEADER_LEN,
+                               flen - 2);
+  }
+}
+
+// Hands out the bytes that are due. With `baud` set, frames sent at another
+// rate are garbage to the host and are dropped.
+static size_t mgos_fingerprint_sim_output(struct mgos_fingerprint_sim *sim,
+                                          uint8_t *buf, size_t len,
+                                          uint32_t baud) {
+  int64_t now = mgos_uptime_micros();
+  size_t done = 0;
+
+  while (done < len && sim->head && sim->head->due_us <= now) {
+    struct mgos_fingerprint_sim_frame *f = sim->head;
+    size_t n = f->len - f->pos;
+
+    if (baud && f->baud != baud) {
+      f->pos = f->len;
+      n = 0;
+    }
+    if (n > len - done) n = len - done;
+    memcpy(buf + done, f->bytes + f->pos, n);
+    f->pos += n;
+    done += n;
+    if (f->pos < f->len) break;
+    sim->head = f->next;
+    if (!sim->head) sim->tail = NULL;
+    free(f);
+  }
+  return done;
+}
+
+static size_t mgos_fingerprint_sim_read(void *ctx, void *buf, size_t len) {
+  struct mgos_fingerprint_sim *sim = (struct mgos_fingerprint_sim *) ctx;
+
+  return mgos_fingerprint_sim_output(sim, buf, len, sim->host_baud);
+}
+
+static size_t mgos_fingerprint_sim_write(void *ctx, const void *buf,
+                                         size_t len) {
+  struct mgos_fingerprint_sim *sim = (struct mgos_fingerprint_sim *) ctx;
+
+  // At the wrong rate the module sees garbage, and the host silence.
+  if (sim->host_baud == sim->baud) mgos_fingerprint_sim_input(sim, buf, len);
+  return len;
+}
+
+static bool mgos_fingerprint_sim_set_baud(void *ctx, uint32_t baud) {
+  ((struct mgos_fingerprint_sim *) ctx)->host_baud = baud;
+  return true;
+}
+
+void mgos_fingerprint_sim_transport(
+    struct mgos_fingerprint_sim *sim,
+    struct mgos_fingerprint_transport *transport) {
+  memset(transport, 0, sizeof(*transport));
+  transport->read = mgos_fingerprint_sim_read;
+  transport->write = mgos_fingerprint_sim_write;
+  transport->set_baud = mgos_fingerprint_sim_set_baud;
+  transport->ctx = sim;
+  sim->host_baud = sim->baud;
+}
+
+#ifdef __linux__
+bool mgos_fingerprint_sim_pty_open(struct mgos_fingerprint_sim *sim,
+                                   char *name, size_t len) {
+  int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+  if (fd < 0) return false;
+  if (grantpt(fd) != 0 || unlockpt(fd) != 0 ||
+      ptsname_r(fd, name, len) != 0) {
+    close(fd);
+    return false;
+  }
+  if (sim->pty >= 0) close(sim->pty);
+  sim->pty = fd;
+  return true;
+}
+
+void mgos_fingerprint_sim_pty_poll(struct mgos_fingerprint_sim *sim) {
+  uint8_t buf[SIM_FRAME_MAX];
+  ssize_t n;
+  size_t out;
+
+  if (sim->pty < 0) return;
+  while ((n = read(sim->pty, buf, sizeof(buf))) > 0)
+    mgos_fingerprint_sim_input(sim, buf, n);
+  while ((out = mgos_fingerprint_sim_output(sim, buf, sizeof(buf), 0)) > 0) {
+    if (write(sim->pty, buf, out) != (ssize_t) out) break;
+  }
+}
+#endif
+
+void mgos_fingerprint_sim_config_set_defaults(
+    struct mgos_fingerprint_sim_cfg *cfg) {
+  if (!cfg) return;
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->address = MGOS_FINGERPRINT_DEFAULT_ADDRESS;
+  cfg->password = MGOS_FINGERPRINT_DEFAULT_PASSWORD;
+  cfg->baud = 57600;
+  cfg->capacity = 200;
+  cfg->model_size = 1536;
+  cfg->sensor_width = 192;
+  cfg->sensor_height = 192;
+  cfg->datapacket_length = MGOS_FINGERPRINT_DATALEN_128;
+  cfg->hispeed_search = true;
+  cfg->auto_commands = true;
+  cfg->wire_time = true;
+  cfg->search_us_per_model = 200;
+  cfg->seed = 1;
+}
+
+struct mgos_fingerprint_sim *mgos_fingerprint_sim_create(
+    const struct mgos_fingerprint_sim_cfg *cfg) {
+  struct mgos_fingerprint_sim *sim;
+
+  if (!cfg || cfg->capacity == 0 || cfg->model_size == 0) return NULL;
+  if (!(sim = calloc(1, sizeof(*sim)))) return NULL;
+  sim->cfg = *cfg;
+  sim->rand = cfg->seed ? cfg->seed : 1;
+  sim->password = cfg->password;
+  sim->baud = cfg->baud;
+  sim->security_level = MGOS_FINGERPRINT_FRR_3;
+  sim->datapacket_length = cfg->datapacket_length;
+  sim->down = -1;
+  sim->pty = -1;
+  for (size_t i = 0; i < sizeof(sim->latency_us) / sizeof(sim->latency_us[0]);
+       i++)
+    sim->latency_us[i] = 1000;
+  for (size_t i = 0; i < sizeof(mgos_fingerprint_sim_latencies) /
+                             sizeof(mgos_fingerprint_sim_latencies[0]);
+       i++)
+    sim->latency_us[mgos_fingerprint_sim_latencies[i].cmd] =
+        mgos_fingerprint_sim_latencies[i].us;
+  sim->chars[0] = calloc(2, cfg->model_size);
+  sim->library = calloc(cfg->capacity, cfg->model_size);
+  sim->used = calloc(cfg->capacity, 1);
+  if (!sim->chars[0] || !sim->library || !sim->used) {
+    mgos_fingerprint_sim_destroy(&sim);
+    return NULL;
+  }
+  sim->chars[1] = sim->chars[0] + cfg->model_size;
+  return sim;
+}
+
+void mgos_fingerprint_sim_destroy(struct mgos_fingerprint_sim **sim) {
+  if (!sim || !*sim) return;
+  while ((*sim)->head) {
+    struct mgos_fingerprint_sim_frame *f = (*sim)->head;
+
+    (*sim)->head = f->next;
+    free(f);
+  }
+#ifdef __linux__
+  if ((*sim)->pty >= 0) close((*sim)->pty);
+#endif
+  free((*sim)->chars[0]);
+  free((*sim)->library);
+  free((*sim)->used);
+  free(*sim);
+  *sim = NULL;
+}
+
+void mgos_fingerprint_sim_set_latency(struct mgos_fingerprint_sim *sim,
+                                      uint8_t cmd, uint32_t us) {
+  if (sim) sim->latency_us[cmd] = us;
+}
+
+void mgos_fingerprint_sim_set_faults(
+    struct mgos_fingerprint_sim *sim,
+    const struct mgos_fingerprint_sim_faults *faults) {
+  if (!sim) return;
+  if (faults)
+    sim->faults = *faults;
+  else
+    memset(&sim->faults, 0, sizeof(sim->faults));
+}
+
+void mgos_fingerprint_sim_set_finger(struct mgos_fingerprint_sim *sim,
+                                     uint32_t finger) {
+  if (sim) sim->finger = finger;
+}
+
+bool mgos_fingerprint_sim_enroll(struct mgos_fingerprint_sim *sim, uint16_t id,
+                                 uint32_t finger) {
+  if (!sim || id >= sim->cfg.capacity || finger == 0) return false;
+  mgos_fingerprint_sim_features(sim, finger,
+                                mgos_fingerprint_sim_model(sim, id));
+  sim->used[id] = 1;
+  return true;
+}
+
+bool mgos_fingerprint_sim_model_get(struct mgos_fingerprint_sim *sim,
+                                    uint16_t id, uint8_t *buf) {
+  if (!sim || id >= sim->cfg.capacity || !sim->used[id]) return false;
+  memcpy(buf, mgos_fingerprint_sim_model(sim, id), sim->cfg.model_size);
+  return true;
+}
+
+size_t mgos_fingerprint_sim_image_get(struct mgos_fingerprint_sim *sim,
+                                      uint8_t *buf, size_t size) {
+  if (!sim || !sim->image) return 0;
+  if (size < mgos_fingerprint_sim_image(sim, NULL)) return 0;
+  return mgos_fingerprint_sim_image(sim, buf);
+}
+
+void mgos_fingerprint_sim_restart(struct mgos_fingerprint_sim *sim) {
+  if (!sim) return;
+  sim->verified = false;
+  sim->image = 0;
+  memset(sim->chars[0], 0, 2 * sim->cfg.model_size);
+}
+
+uint32_t mgos_fingerprint_sim_commands(struct mgos_fingerprint_sim *sim) {
+  return sim ? sim->commands : 0;
+}
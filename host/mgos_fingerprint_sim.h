@@ -0,0 +1,122 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Simulated GROW module, to run the driver without hardware: in the same
+// process through mgos_fingerprint_sim_transport(), or on a pseudo terminal
+// for a driver in another process. It implements the command set the driver
+// uses, with a template library, notepad and system parameters, and answers
+// after a configurable latency per command. Faults are injected into the
+// frames it sends.
+//
+// A finger is a number: the same number always yields the same features, so
+// an enrolled finger is found again by a search. Templates are opaque bytes
+// derived from that number.
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mgos_fingerprint.h"
+
+struct mgos_fingerprint_sim_cfg {
+  uint32_t address;
+  uint32_t password;
+  uint32_t baud;  // rate the module listens at
+  uint16_t capacity;
+  uint16_t model_size;  // bytes per template
+  uint16_t sensor_width;
+  uint16_t sensor_height;
+  uint8_t datapacket_length;  // enum mgos_fingerprint_param_datalen
+  bool hispeed_search;        // otherwise HISPEEDSEARCH is rejected
+  bool auto_commands;         // otherwise AUTOENROLL/AUTOIDENTIFY are
+  // Delay frames by their time on the wire at the current baud rate, in both
+  // directions, on top of the command latency.
+  bool wire_time;
+  // Search time per template in the library, on top of the search latency.
+  uint32_t search_us_per_model;
+  uint32_t seed;  // for faults and random numbers
+};
+
+// Faults, in percent of the frames the module sends: frames that are lost,
+// that arrive with a wrong checksum, and that have line noise before them.
+struct mgos_fingerprint_sim_faults {
+  uint8_t drop;
+  uint8_t corrupt;
+  uint8_t noise;
+};
+
+struct mgos_fingerprint_sim;
+
+void mgos_fingerprint_sim_config_set_defaults(
+    struct mgos_fingerprint_sim_cfg *cfg);
+struct mgos_fingerprint_sim *mgos_fingerprint_sim_create(
+    const struct mgos_fingerprint_sim_cfg *cfg);
+void mgos_fingerprint_sim_destroy(struct mgos_fingerprint_sim **sim);
+
+// Time from the end of a command to its acknowledge. Each step of the auto
+// commands takes the latency of the command it stands for. A capture with no
+// finger on the sensor is answered after 10ms whatever its latency, and an
+// auto command gives up on the finger after 2s.
+void mgos_fingerprint_sim_set_latency(struct mgos_fingerprint_sim *sim,
+                                      uint8_t cmd, uint32_t us);
+void mgos_fingerprint_sim_set_faults(
+    struct mgos_fingerprint_sim *sim,
+    const struct mgos_fingerprint_sim_faults *faults);
+// Puts a finger on the sensor, or takes it off with 0.
+void mgos_fingerprint_sim_set_finger(struct mgos_fingerprint_sim *sim,
+                                     uint32_t finger);
+// Stores the template of `finger` in slot `id`, as if it had been enrolled.
+bool mgos_fingerprint_sim_enroll(struct mgos_fingerprint_sim *sim, uint16_t id,
+                                 uint32_t finger);
+// Copies the template in slot `id`, cfg.model_size bytes, to `buf`. False if
+// the slot is empty.
+bool mgos_fingerprint_sim_model_get(struct mgos_fingerprint_sim *sim,
+                                    uint16_t id, uint8_t *buf);
+// Copies the image buffer to `buf`, and returns its length. 0 if there is no
+// image, or it does not fit in `size` bytes.
+size_t mgos_fingerprint_sim_image_get(struct mgos_fingerprint_sim *sim,
+                                      uint8_t *buf, size_t size);
+// Power cycles the module: the library, notepad and parameters stay, the
+// image and character buffers are cleared and the password is asked again.
+void mgos_fingerprint_sim_restart(struct mgos_fingerprint_sim *sim);
+// Commands the module has executed.
+uint32_t mgos_fingerprint_sim_commands(struct mgos_fingerprint_sim *sim);
+
+// In-process transport to the simulator, for cfg.transport. The simulator
+// must outlive the driver using it. The host's baud rate is tracked, and
+// nothing gets through while it differs from the module's.
+void mgos_fingerprint_sim_transport(
+    struct mgos_fingerprint_sim *sim,
+    struct mgos_fingerprint_transport *transport);
+
+#ifdef __linux__
+// Serves the simulator on a new pseudo terminal, whose name is put in `name`
+// for mgos_fingerprint_tty_open() elsewhere. The caller pumps it with
+// mgos_fingerprint_sim_pty_poll(). The baud rate is not checked on a pty.
+bool mgos_fingerprint_sim_pty_open(struct mgos_fingerprint_sim *sim,
+                                   char *name, size_t len);
+void mgos_fingerprint_sim_pty_poll(struct mgos_fingerprint_sim *sim);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,1041 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests; see mgos_fingerprint_test.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+#include "mgos_fingerprint_sim.h"
+#include "mgos_fingerprint_test.h"
+
+#define TEST_CHECK(cond)                                            \
+  do {                                                              \
+    if (!(cond)) {                                                  \
+      LOG(LL_ERROR, ("%s:%d: %s", __func__, __LINE__, #cond));      \
+      goto out;                                                     \
+    }                                                               \
+  } while (0)
+
+// A driver on a simulated module.
+struct mgos_fingerprint_test {
+  struct mgos_fingerprint_sim *sim;
+  struct mgos_fingerprint_transport transport;
+  struct mgos_fingerprint *dev;
+};
+
+static void mgos_fingerprint_test_dev_cfg(struct mgos_fingerprint_test *t,
+                                          struct mgos_fingerprint_cfg *cfg,
+                                          uint32_t baud) {
+  mgos_fingerprint_sim_transport(t->sim, &t->transport);
+  mgos_fingerprint_config_set_defaults(cfg);
+  cfg->uart_baud_rate = baud;
+  cfg->transport = &t->transport;
+}
+
+static void mgos_fingerprint_test_close(struct mgos_fingerprint_test *t) {
+  mgos_fingerprint_destroy(&t->dev);
+  mgos_fingerprint_sim_destroy(&t->sim);
+}
+
+static bool mgos_fingerprint_test_sim(struct mgos_fingerprint_test *t,
+                                      struct mgos_fingerprint_cfg *cfg) {
+  struct mgos_fingerprint_sim_cfg scfg;
+
+  mgos_fingerprint_sim_config_set_defaults(&scfg);
+  if (!(t->sim = mgos_fingerprint_sim_create(&scfg))) return false;
+  mgos_fingerprint_test_dev_cfg(t, cfg, scfg.baud);
+  return true;
+}
+
+static void mgos_fingerprint_test_cb(struct mgos_fingerprint *dev,
+                                     const struct mgos_fingerprint_result *res,
+                                     void *cb_arg) {
+  *(struct mgos_fingerprint_result *) cb_arg = *res;
+  ((struct mgos_fingerprint_result *) cb_arg)->data = NULL;
+  (void) dev;
+}
+
+bool mgos_fingerprint_test_timeouts(void) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_cfg cfg;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  TEST_CHECK(mgos_fingerprint_test_sim(&t, &cfg));
+  TEST_CHECK(!cfg.adaptive_timeouts);
+  // A slow scan, well within the configured timeout of a capture.
+  mgos_fingerprint_sim_set_latency(t.sim, MGOS_FINGERPRINT_CMD_GETIMAGE,
+                                   400000);
+  cfg.adaptive_timeouts = true;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+
+  // The service loop polls an empty sensor like this on every tick.
+  for (uint8_t i = 0; i < 16; i++)
+    TEST_CHECK(mgos_fingerprint_image_get(t.dev) ==
+               MGOS_FINGERPRINT_NOFINGER);
+  mgos_fingerprint_sim_set_finger(t.sim, 1);
+  TEST_CHECK(mgos_fingerprint_image_get(t.dev) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_image_genchar(t.dev, 1) == MGOS_FINGERPRINT_OK);
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+
+bool mgos_fingerprint_test_late_reply(void) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_result random, count;
+  struct mgos_fingerprint_cfg cfg;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  memset(&random, 0, sizeof(random));
+  memset(&count, 0, sizeof(count));
+  TEST_CHECK(mgos_fingerprint_test_sim(&t, &cfg));
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  for (uint16_t id = 0; id < 3; id++)
+    mgos_fingerprint_sim_enroll(t.sim, id, id + 1);
+  // Answered 50ms after its 300ms timeout.
+  mgos_fingerprint_sim_set_latency(t.sim, MGOS_FINGERPRINT_CMD_GETRANDOM,
+                                   350000);
+
+  TEST_CHECK(mgos_fingerprint_get_random_number_async(
+                 t.dev, mgos_fingerprint_test_cb, &random) ==
+             MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_model_count_async(
+                 t.dev, mgos_fingerprint_test_cb, &count) ==
+             MGOS_FINGERPRINT_OK);
+  while (count.cmd == 0) {
+    mgos_fingerprint_poll(t.dev);
+    mgos_msleep(MGOS_FINGERPRINT_POLL_INTERVAL);
+  }
+  TEST_CHECK(random.rc == MGOS_FINGERPRINT_TIMEOUT);
+  TEST_CHECK(count.rc == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(count.count == 3);
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+
+bool mgos_fingerprint_test_search_fallback(void) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_sim_cfg scfg;
+  struct mgos_fingerprint_cfg cfg;
+  struct mgos_fingerprint_result search, del;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  memset(&search, 0, sizeof(search));
+  memset(&del, 0, sizeof(del));
+  mgos_fingerprint_sim_config_set_defaults(&scfg);
+  scfg.hispeed_search = false;
+  TEST_CHECK((t.sim = mgos_fingerprint_sim_create(&scfg)) != NULL);
+  mgos_fingerprint_sim_enroll(t.sim, 4, 5);
+  mgos_fingerprint_sim_set_finger(t.sim, 5);
+  mgos_fingerprint_test_dev_cfg(&t, &cfg, scfg.baud);
+  cfg.search_strategy = MGOS_FINGERPRINT_SEARCH_AUTO;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_image_get(t.dev) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_image_genchar(t.dev, 1) == MGOS_FINGERPRINT_OK);
+
+  TEST_CHECK(mgos_fingerprint_database_search_async(
+                 t.dev, 1, mgos_fingerprint_test_cb, &search) ==
+             MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_model_delete_async(
+                 t.dev, 4, 1, mgos_fingerprint_test_cb, &del) ==
+             MGOS_FINGERPRINT_OK);
+  while (del.cmd == 0) {
+    mgos_fingerprint_poll(t.dev);
+    mgos_msleep(MGOS_FINGERPRINT_POLL_INTERVAL);
+  }
+  TEST_CHECK(search.rc == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(search.finger_id == 4);
+  TEST_CHECK(del.rc == MGOS_FINGERPRINT_OK);
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+
+// Passes frames on to the module, spoiling the checksum of the next `frames`
+// commands with instruction code `code`, and putting the `noise_len` bytes of
+// `noise` before the reply to the next command.
+struct mgos_fingerprint_test_garble {
+  struct mgos_fingerprint_transport io;
+  uint8_t code;
+  uint8_t frames;
+  const uint8_t *noise;
+  size_t noise_len;
+  bool noise_due;
+};
+
+static size_t mgos_fingerprint_test_garble_read(void *ctx, void *buf,
+                                                size_t len) {
+  struct mgos_fingerprint_test_garble *g =
+      (struct mgos_fingerprint_test_garble *) ctx;
+
+  if (g->noise_due && g->noise_len > 0) {
+    if (len > g->noise_len) len = g->noise_len;
+    memcpy(buf, g->noise, len);
+    g->noise += len;
+    g->noise_len -= len;
+    g->noise_due = g->noise_len > 0;
+    return len;
+  }
+  return g->io.read(g->io.ctx, buf, len);
+}
+
+static size_t mgos_fingerprint_test_garble_write(void *ctx, const void *buf,
+                                                 size_t len) {
+  struct mgos_fingerprint_test_garble *g =
+      (struct mgos_fingerprint_test_garble *) ctx;
+  uint8_t frame[sizeof(struct mgos_fingerprint_packet)];
+
+  if (g->noise_len > 0) g->noise_due = true;
+  if (g->frames == 0 || len > sizeof(frame) ||
+      len <= MGOS_FINGERPRINT_HEADER_LEN ||
+      ((const uint8_t *) buf)[MGOS_FINGERPRINT_HEADER_LEN] != g->code)
+    return g->io.write(g->io.ctx, buf, len);
+  g->frames--;
+  memcpy(frame, buf, len);
+  frame[len - 1] ^= 0x01;
+  return g->io.write(g->io.ctx, frame, len);
+}
+
+static bool mgos_fingerprint_test_garble_set_baud(void *ctx, uint32_t baud) {
+  struct mgos_fingerprint_test_garble *g =
+      (struct mgos_fingerprint_test_garble *) ctx;
+
+  return g->io.set_baud(g->io.ctx, baud);
+}
+
+static void mgos_fingerprint_test_garble(
+    struct mgos_fingerprint_test *t, struct mgos_fingerprint_test_garble *g,
+    uint8_t code) {
+  memset(g, 0, sizeof(*g));
+  g->io = t->transport;
+  g->code = code;
+  t->transport.read = mgos_fingerprint_test_garble_read;
+  t->transport.write = mgos_fingerprint_test_garble_write;
+  t->transport.set_baud = mgos_fingerprint_test_garble_set_baud;
+  t->transport.ctx = g;
+}
+
+bool mgos_fingerprint_test_search_noise(void) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_test_garble g;
+  struct mgos_fingerprint_cfg cfg;
+  uint16_t id = 0, score;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  TEST_CHECK(mgos_fingerprint_test_sim(&t, &cfg));
+  mgos_fingerprint_test_garble(&t, &g, MGOS_FINGERPRINT_CMD_HISPEEDSEARCH);
+  mgos_fingerprint_sim_enroll(t.sim, 4, 5);
+  mgos_fingerprint_sim_set_finger(t.sim, 5);
+  cfg.search_strategy = MGOS_FINGERPRINT_SEARCH_AUTO;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_image_get(t.dev) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_image_genchar(t.dev, 1) == MGOS_FINGERPRINT_OK);
+
+  // One garbled frame is retried, and high speed search stays in use.
+  g.frames = 1;
+  TEST_CHECK(mgos_fingerprint_database_search(t.dev, &id, &score, 1) ==
+             MGOS_FINGERPRINT_OK);
+  TEST_CHECK(id == 4);
+  TEST_CHECK(!t.dev->hispeed_unsupported);
+
+  // A run of them gives up on it.
+  g.frames = MGOS_FINGERPRINT_HISPEED_ERRORS;
+  for (uint8_t i = 0; i < MGOS_FINGERPRINT_HISPEED_ERRORS; i++) {
+    id = 0;
+    TEST_CHECK(mgos_fingerprint_database_search(t.dev, &id, &score, 1) ==
+               MGOS_FINGERPRINT_OK);
+    TEST_CHECK(id == 4);
+  }
+  TEST_CHECK(t.dev->hispeed_unsupported);
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+
+bool mgos_fingerprint_test_resync(void) {
+  // Stray bytes, then a header with a payload longer than any frame.
+  static const uint8_t noise[] = {0x00, 0xEF, 0x55, 0xEF, 0x01, 0xFF, 0xFF,
+                                  0xFF, 0xFF, 0x07, 0xFF, 0xFF, 0x12};
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_test_garble g;
+  struct mgos_fingerprint_sim_faults faults;
+  struct mgos_fingerprint_link_stats ls;
+  struct mgos_fingerprint_cfg cfg;
+  uint32_t resyncs;
+  uint16_t n = 0;
+  int64_t start;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  memset(&faults, 0, sizeof(faults));
+  TEST_CHECK(mgos_fingerprint_test_sim(&t, &cfg));
+  mgos_fingerprint_test_garble(&t, &g, 0);
+  mgos_fingerprint_sim_enroll(t.sim, 4, 5);
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  mgos_fingerprint_get_link_stats(t.dev, &ls);
+  resyncs = ls.resyncs;
+
+  // Line noise before each frame of the module is skipped.
+  faults.noise = 100;
+  mgos_fingerprint_sim_set_faults(t.sim, &faults);
+  start = mgos_uptime_micros();
+  TEST_CHECK(mgos_fingerprint_model_count(t.dev, &n) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(n == 1);
+  TEST_CHECK(mgos_uptime_micros() - start < 300000);
+  mgos_fingerprint_get_link_stats(t.dev, &ls);
+  TEST_CHECK(ls.resyncs > resyncs);
+  resyncs = ls.resyncs;
+
+  // So is a header that cannot be a frame of the module.
+  mgos_fingerprint_sim_set_faults(t.sim, NULL);
+  g.noise = noise;
+  g.noise_len = sizeof(noise);
+  n = 0;
+  start = mgos_uptime_micros();
+  TEST_CHECK(mgos_fingerprint_model_count(t.dev, &n) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(n == 1);
+  TEST_CHECK(mgos_uptime_micros() - start < 300000);
+  TEST_CHECK(g.noise_len == 0);
+  mgos_fingerprint_get_link_stats(t.dev, &ls);
+  TEST_CHECK(ls.resyncs > resyncs);
+
+  // A reply with a bad checksum fails its command at once, and the next one
+  // goes through.
+  faults.noise = 0;
+  faults.corrupt = 100;
+  mgos_fingerprint_sim_set_faults(t.sim, &faults);
+  start = mgos_uptime_micros();
+  TEST_CHECK(mgos_fingerprint_model_count(t.dev, &n) ==
+             MGOS_FINGERPRINT_READ_ERROR);
+  mgos_fingerprint_sim_set_faults(t.sim, NULL);
+  n = 0;
+  TEST_CHECK(mgos_fingerprint_model_count(t.dev, &n) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(n == 1);
+  TEST_CHECK(mgos_uptime_micros() - start < 300000);
+  mgos_fingerprint_get_link_stats(t.dev, &ls);
+  TEST_CHECK(ls.checksum_errors == 1);
+  TEST_CHECK(ls.timeouts == 0);
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+
+bool mgos_fingerprint_test_revoke_stale(void) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_delete_range ranges[4];
+  struct mgos_fingerprint_cfg cfg;
+  const uint16_t ids[] = {0, 2};
+  uint16_t n = 0;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  TEST_CHECK(mgos_fingerprint_test_sim(&t, &cfg));
+  mgos_fingerprint_sim_enroll(t.sim, 0, 1);
+  mgos_fingerprint_sim_enroll(t.sim, 2, 3);
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  // The cache now holds slots 0 and 2, and slot 1 looks empty.
+  mgos_fingerprint_sim_enroll(t.sim, 1, 2);
+
+  TEST_CHECK(mgos_fingerprint_model_delete_list(t.dev, ids, 2, ranges, 4,
+                                                &n) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(n == 2);
+  TEST_CHECK(mgos_fingerprint_model_count(t.dev, &n) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(n == 1);
+  TEST_CHECK(mgos_fingerprint_model_load(t.dev, 1, 1) == MGOS_FINGERPRINT_OK);
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+
+bool mgos_fingerprint_test_snapshot_strays(void) {
+  const char *path = "/tmp/mgos_fingerprint_test.snap";
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_cfg cfg;
+  uint16_t n = 0;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  TEST_CHECK(mgos_fingerprint_test_sim(&t, &cfg));
+  mgos_fingerprint_sim_enroll(t.sim, 1, 2);
+  mgos_fingerprint_sim_enroll(t.sim, 5, 6);
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_snapshot_save(t.dev, path) ==
+             MGOS_FINGERPRINT_OK);
+  // Strays at 0, 2 and 6, kept apart by the snapshot's own templates.
+  mgos_fingerprint_sim_enroll(t.sim, 0, 1);
+  mgos_fingerprint_sim_enroll(t.sim, 2, 3);
+  mgos_fingerprint_sim_enroll(t.sim, 6, 7);
+  TEST_CHECK(mgos_fingerprint_index_refresh(t.dev) == MGOS_FINGERPRINT_OK);
+
+  TEST_CHECK(mgos_fingerprint_snapshot_restore(t.dev, path) ==
+             MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_model_count(t.dev, &n) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(n == 2);
+  TEST_CHECK(mgos_fingerprint_model_load(t.dev, 1, 1) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_model_load(t.dev, 5, 1) == MGOS_FINGERPRINT_OK);
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  remove(path);
+  return ok;
+}
+
+bool mgos_fingerprint_test_snapshot_order(void) {
+  const char *path = "/tmp/mgos_fingerprint_test.snap";
+  static const uint8_t swapped[] = {0x50, 0x53, 0x47, 0x46};
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_cfg cfg;
+  struct mgos_fingerprint_snapshot_header hdr;
+  struct mgos_fingerprint_snapshot_reader *r = NULL;
+  uint8_t head[8], rec[2];
+  FILE *fp = NULL;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  TEST_CHECK(mgos_fingerprint_test_sim(&t, &cfg));
+  mgos_fingerprint_sim_enroll(t.sim, 199, 2);
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_snapshot_save(t.dev, path) ==
+             MGOS_FINGERPRINT_OK);
+  TEST_CHECK((r = mgos_fingerprint_snapshot_reader_open(path, &hdr)) != NULL);
+  mgos_fingerprint_snapshot_reader_close(&r);
+
+  // Magic, version and the id of the first record, least significant first.
+  TEST_CHECK((fp = fopen(path, "r+b")) != NULL);
+  TEST_CHECK(fread(head, 1, sizeof(head), fp) == sizeof(head));
+  TEST_CHECK(memcmp(head, "FGSP\x01\x00", 6) == 0);
+  TEST_CHECK(fseek(fp, hdr.records_offset, SEEK_SET) == 0);
+  TEST_CHECK(fread(rec, 1, sizeof(rec), fp) == sizeof(rec));
+  TEST_CHECK(rec[0] == 199 && rec[1] == 0);
+
+  // A file written in the other byte order is refused.
+  TEST_CHECK(fseek(fp, 0, SEEK_SET) == 0);
+  TEST_CHECK(fwrite(swapped, 1, sizeof(swapped), fp) == sizeof(swapped));
+  TEST_CHECK(fclose(fp) == 0);
+  fp = NULL;
+  TEST_CHECK(mgos_fingerprint_snapshot_reader_open(path, NULL) == NULL);
+  ok = true;
+
+out:
+  if (fp) fclose(fp);
+  mgos_fingerprint_test_close(&t);
+  remove(path);
+  return ok;
+}
+
+// A buffer filled by a data sink.
+struct mgos_fingerprint_test_sink {
+  uint8_t *buf;
+  size_t size;
+  size_t len;
+};
+
+static bool mgos_fingerprint_test_sink(const uint8_t *chunk, size_t len,
+                                       void *ud) {
+  struct mgos_fingerprint_test_sink *sink = ud;
+
+  if (sink->len + len > sink->size) return false;
+  memcpy(sink->buf + sink->len, chunk, len);
+  sink->len += len;
+  return true;
+}
+
+bool mgos_fingerprint_test_transfers(void) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_sim_cfg scfg;
+  struct mgos_fingerprint_cfg cfg;
+  struct mgos_fingerprint_system_params params;
+  struct mgos_fingerprint_test_sink sink;
+  uint8_t *model = NULL, *back = NULL, *image = NULL, *want = NULL;
+  size_t model_size, image_size, len;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  mgos_fingerprint_sim_config_set_defaults(&scfg);
+  model_size = scfg.model_size;
+  image_size = (size_t) scfg.sensor_width * scfg.sensor_height / 2;
+  TEST_CHECK((model = malloc(model_size)) != NULL);
+  TEST_CHECK((back = malloc(model_size)) != NULL);
+  TEST_CHECK((image = malloc(image_size)) != NULL);
+  TEST_CHECK((want = malloc(image_size)) != NULL);
+
+  for (uint8_t dl = MGOS_FINGERPRINT_DATALEN_32;
+       dl <= MGOS_FINGERPRINT_DATALEN_256; dl++) {
+    TEST_CHECK((t.sim = mgos_fingerprint_sim_create(&scfg)) != NULL);
+    mgos_fingerprint_sim_enroll(t.sim, 2, 7);
+    mgos_fingerprint_test_dev_cfg(&t, &cfg, scfg.baud);
+    cfg.datapacket_length = dl;
+    TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+    TEST_CHECK(mgos_fingerprint_get_system_params(t.dev, &params) ==
+               MGOS_FINGERPRINT_OK);
+    TEST_CHECK(params.datapacket_length == dl);
+
+    // A template downloaded is the one in the library.
+    TEST_CHECK(mgos_fingerprint_model_load(t.dev, 2, 1) ==
+               MGOS_FINGERPRINT_OK);
+    TEST_CHECK(mgos_fingerprint_model_download_buf(t.dev, 1, back, model_size,
+                                                   &len) ==
+               MGOS_FINGERPRINT_OK);
+    TEST_CHECK(len == model_size);
+    TEST_CHECK(mgos_fingerprint_sim_model_get(t.sim, 2, model));
+    TEST_CHECK(memcmp(model, back, model_size) == 0);
+
+    // A template uploaded is stored as it was sent.
+    for (size_t i = 0; i < model_size; i++) model[i] = i * 31 + dl;
+    TEST_CHECK(mgos_fingerprint_model_upload_buf(t.dev, 2, model,
+                                                 model_size) ==
+               MGOS_FINGERPRINT_OK);
+    TEST_CHECK(mgos_fingerprint_model_store(t.dev, 5, 2) ==
+               MGOS_FINGERPRINT_OK);
+    TEST_CHECK(mgos_fingerprint_sim_model_get(t.sim, 5, back));
+    TEST_CHECK(memcmp(model, back, model_size) == 0);
+
+    // An image downloaded is the one on the sensor.
+    mgos_fingerprint_sim_set_finger(t.sim, 9);
+    TEST_CHECK(mgos_fingerprint_image_get(t.dev) == MGOS_FINGERPRINT_OK);
+    sink.buf = image;
+    sink.size = image_size;
+    sink.len = 0;
+    TEST_CHECK(mgos_fingerprint_image_download_stream(
+                   t.dev, mgos_fingerprint_test_sink, &sink) ==
+               MGOS_FINGERPRINT_OK);
+    TEST_CHECK(mgos_fingerprint_sim_image_get(t.sim, want, image_size) ==
+               image_size);
+    TEST_CHECK(sink.len == image_size);
+    TEST_CHECK(memcmp(want, image, image_size) == 0);
+    mgos_fingerprint_test_close(&t);
+  }
+  ok = true;
+
+out:
+  free(model);
+  free(back);
+  free(image);
+  free(want);
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+
+bool mgos_fingerprint_test_replay(void) {
+  const char *path = "/tmp/mgos_fingerprint_test.trace";
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_cfg cfg;
+  struct mgos_fingerprint_transport replay;
+  struct mgos_fingerprint_trace_entry e;
+  uint8_t *buf = NULL;
+  uint16_t n = 0;
+  size_t len;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  TEST_CHECK(mgos_fingerprint_test_sim(&t, &cfg));
+  mgos_fingerprint_sim_enroll(t.sim, 3, 4);
+  cfg.trace_len = 64;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_model_count(t.dev, &n) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_trace_save(t.dev, path));
+  mgos_fingerprint_test_close(&t);
+
+  // Commands and acknowledges fit in the trace, and play back as they were.
+  TEST_CHECK(mgos_fingerprint_replay_open(path, false, &replay));
+  cfg.trace_len = 0;
+  cfg.transport = &replay;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  n = 0;
+  TEST_CHECK(mgos_fingerprint_model_count(t.dev, &n) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(n == 1);
+  mgos_fingerprint_test_close(&t);
+
+  // Neither do the data packets of a template, but they keep their size.
+  TEST_CHECK(mgos_fingerprint_test_sim(&t, &cfg));
+  mgos_fingerprint_sim_enroll(t.sim, 3, 4);
+  cfg.trace_len = 64;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK((buf = malloc(t.dev->info.model_size)) != NULL);
+  TEST_CHECK(mgos_fingerprint_model_load(t.dev, 3, 1) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_model_download_buf(
+                 t.dev, 1, buf, t.dev->info.model_size, &len) ==
+             MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_trace_get(t.dev, &e, 1) == 1);
+  TEST_CHECK(!e.truncated);
+  TEST_CHECK(t.dev->trace[(t.dev->trace_head + t.dev->trace_len - 1) %
+                          t.dev->trace_len]
+                 .truncated);
+  TEST_CHECK(mgos_fingerprint_trace_save(t.dev, path));
+  mgos_fingerprint_test_close(&t);
+  TEST_CHECK(mgos_fingerprint_replay_open(path, false, &replay));
+  cfg.trace_len = 0;
+  cfg.transport = &replay;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_model_load(t.dev, 3, 1) == MGOS_FINGERPRINT_OK);
+  len = 0;
+  TEST_CHECK(mgos_fingerprint_model_download_buf(
+                 t.dev, 1, buf, t.dev->info.model_size, &len) ==
+             MGOS_FINGERPRINT_OK);
+  TEST_CHECK(len == t.dev->info.model_size);
+  ok = true;
+
+out:
+  free(buf);
+  mgos_fingerprint_test_close(&t);
+  remove(path);
+  return ok;
+}
+
+bool mgos_fingerprint_test_cache(void) {
+  const char *path = "/tmp/mgos_fingerprint_test.cache";
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_sim_cfg scfg;
+  struct mgos_fingerprint_cfg cfg;
+  struct mgos_fingerprint_system_params params;
+  uint8_t page[MGOS_FINGERPRINT_NOTEPAD_SIZE], back[sizeof(page)];
+  uint32_t commands, random;
+  uint16_t n = 0;
+  FILE *fp;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  memset(page, 0xA5, sizeof(page));
+  remove(path);
+  mgos_fingerprint_sim_config_set_defaults(&scfg);
+  scfg.password = 0x1234;
+  TEST_CHECK((t.sim = mgos_fingerprint_sim_create(&scfg)) != NULL);
+  mgos_fingerprint_sim_enroll(t.sim, 4, 5);
+  mgos_fingerprint_test_dev_cfg(&t, &cfg, scfg.baud);
+  cfg.password = scfg.password;
+  cfg.cache_path = path;
+
+  // Without a page the notepad is the application's, and nothing is cached.
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  for (uint8_t i = 0; i < MGOS_FINGERPRINT_NOTEPAD_PAGES; i++)
+    TEST_CHECK(mgos_fingerprint_notepad_write(t.dev, i, page) ==
+               MGOS_FINGERPRINT_OK);
+  mgos_fingerprint_destroy(&t.dev);
+  if ((fp = fopen(path, "rb"))) fclose(fp);
+  TEST_CHECK(fp == NULL);
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_model_delete(t.dev, 4, 1) ==
+             MGOS_FINGERPRINT_OK);
+  for (uint8_t i = 0; i < MGOS_FINGERPRINT_NOTEPAD_PAGES; i++) {
+    TEST_CHECK(mgos_fingerprint_notepad_read(t.dev, i, back) ==
+               MGOS_FINGERPRINT_OK);
+    TEST_CHECK(memcmp(page, back, sizeof(page)) == 0);
+  }
+  mgos_fingerprint_destroy(&t.dev);
+
+  // With one, a restarted module is ready after the password and the page.
+  mgos_fingerprint_sim_enroll(t.sim, 4, 5);
+  cfg.cache_notepad_page = 3;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  mgos_fingerprint_destroy(&t.dev);
+  mgos_fingerprint_sim_restart(t.sim);
+  commands = mgos_fingerprint_sim_commands(t.sim);
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_sim_commands(t.sim) - commands == 2);
+  TEST_CHECK(mgos_fingerprint_get_random_number(t.dev, &random) ==
+             MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_model_count(t.dev, &n) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(n == 1);
+  TEST_CHECK(mgos_fingerprint_notepad_read(t.dev, 2, back) ==
+             MGOS_FINGERPRINT_OK);
+  TEST_CHECK(memcmp(page, back, sizeof(page)) == 0);
+  mgos_fingerprint_destroy(&t.dev);
+
+  // A setting changed in the config is applied on a warm start too.
+  cfg.datapacket_length = MGOS_FINGERPRINT_DATALEN_256;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_get_system_params(t.dev, &params) ==
+             MGOS_FINGERPRINT_OK);
+  TEST_CHECK(params.datapacket_length == MGOS_FINGERPRINT_DATALEN_256);
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  remove(path);
+  return ok;
+}
+
+bool mgos_fingerprint_test_replicas(void) {
+  struct mgos_fingerprint_test t[3];
+  struct mgos_fingerprint_replica *r[2] = {NULL, NULL};
+  struct mgos_fingerprint_replica_stats st;
+  struct mgos_fingerprint_cfg cfg;
+  struct mgos_fingerprint *dst;
+  bool ok = false;
+
+  memset(t, 0, sizeof(t));
+  for (uint8_t i = 0; i < 3; i++) {
+    TEST_CHECK(mgos_fingerprint_test_sim(&t[i], &cfg));
+    mgos_fingerprint_sim_enroll(t[i].sim, 0, 1);
+    TEST_CHECK((t[i].dev = mgos_fingerprint_create(&cfg)) != NULL);
+  }
+  // One source in two replicas, whose targets already hold its template.
+  for (uint8_t i = 0; i < 2; i++) {
+    dst = t[i + 1].dev;
+    TEST_CHECK((r[i] = mgos_fingerprint_replica_create(t[0].dev, &dst, 1)));
+    TEST_CHECK(mgos_fingerprint_replica_sync(r[i], &st) ==
+               MGOS_FINGERPRINT_OK);
+    TEST_CHECK(st.fetched == 1 && st.compared == 1 && st.copied == 0);
+  }
+
+  // Overwritten on the source: each replica sees the change on its own.
+  mgos_fingerprint_sim_set_finger(t[0].sim, 2);
+  TEST_CHECK(mgos_fingerprint_image_get(t[0].dev) == MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_image_genchar(t[0].dev, 1) ==
+             MGOS_FINGERPRINT_OK);
+  TEST_CHECK(mgos_fingerprint_model_store(t[0].dev, 0, 1) ==
+             MGOS_FINGERPRINT_OK);
+  for (uint8_t i = 0; i < 2; i++) {
+    TEST_CHECK(mgos_fingerprint_replica_sync(r[i], &st) ==
+               MGOS_FINGERPRINT_OK);
+    TEST_CHECK(st.copied == 1);
+  }
+  ok = true;
+
+out:
+  for (uint8_t i = 0; i < 2; i++) mgos_fingerprint_replica_destroy(&r[i]);
+  for (uint8_t i = 0; i < 3; i++) mgos_fingerprint_test_close(&t[i]);
+  return ok;
+}
+
+static void mgos_fingerprint_test_handler(struct mgos_fingerprint *dev,
+                                          int ev, void *ev_data,
+                                          void *user_data) {
+  if (ev == MGOS_FINGERPRINT_EV_MATCH_OK)
+    *(uint32_t *) user_data = *(uint32_t *) ev_data;
+  (void) dev;
+}
+
+bool mgos_fingerprint_test_auto(void) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_sim_cfg scfg;
+  struct mgos_fingerprint_cfg cfg;
+  struct mgos_fingerprint_op_stats ops[MGOS_FINGERPRINT_STATS_OPS];
+  uint32_t match = 0;
+  uint8_t i, n;
+  int64_t us;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  mgos_fingerprint_sim_config_set_defaults(&scfg);
+  scfg.auto_commands = false;
+  TEST_CHECK((t.sim = mgos_fingerprint_sim_create(&scfg)) != NULL);
+  mgos_fingerprint_test_dev_cfg(&t, &cfg, scfg.baud);
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(!mgos_fingerprint_auto_supported(t.dev));
+  mgos_fingerprint_test_close(&t);
+
+  scfg.auto_commands = true;
+  TEST_CHECK((t.sim = mgos_fingerprint_sim_create(&scfg)) != NULL);
+  mgos_fingerprint_sim_enroll(t.sim, 7, 8);
+  mgos_fingerprint_test_dev_cfg(&t, &cfg, scfg.baud);
+  cfg.handler = mgos_fingerprint_test_handler;
+  cfg.handler_user_data = &match;
+  cfg.collect_stats = true;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_auto_supported(t.dev));
+  TEST_CHECK(mgos_fingerprint_svc_mode_set(t.dev, MGOS_FINGERPRINT_MODE_MATCH));
+
+  // An empty sensor costs a tick one capture, not a wait for a finger.
+  us = mgos_uptime_micros();
+  mgos_fingerprint_svc_timer(t.dev);
+  while (t.dev->svc_busy) mgos_fingerprint_poll(t.dev);
+  TEST_CHECK(mgos_uptime_micros() - us < 100000);
+  TEST_CHECK(match == 0);
+
+  mgos_fingerprint_sim_set_finger(t.sim, 8);
+  mgos_fingerprint_svc_timer(t.dev);
+  while (t.dev->svc_busy) mgos_fingerprint_poll(t.dev);
+  TEST_CHECK((match & 0xFFFF) == 7);
+
+  // AutoIdentify has a row of its own in the statistics.
+  n = mgos_fingerprint_get_stats(t.dev, ops, MGOS_FINGERPRINT_STATS_OPS);
+  for (i = 0; i < n; i++)
+    if (ops[i].cmd == MGOS_FINGERPRINT_CMD_AUTOIDENTIFY) break;
+  TEST_CHECK(i < n && ops[i].count == 1);
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+
+bool mgos_fingerprint_test_svc_buffers(void) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_sim_cfg scfg;
+  struct mgos_fingerprint_cfg cfg;
+  uint32_t match = 0;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  mgos_fingerprint_sim_config_set_defaults(&scfg);
+  scfg.auto_commands = false;
+  TEST_CHECK((t.sim = mgos_fingerprint_sim_create(&scfg)) != NULL);
+  mgos_fingerprint_sim_enroll(t.sim, 3, 4);
+  mgos_fingerprint_sim_enroll(t.sim, 7, 8);
+  mgos_fingerprint_sim_set_finger(t.sim, 8);
+  mgos_fingerprint_test_dev_cfg(&t, &cfg, scfg.baud);
+  cfg.handler = mgos_fingerprint_test_handler;
+  cfg.handler_user_data = &match;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_svc_mode_set(t.dev, MGOS_FINGERPRINT_MODE_MATCH));
+
+  // Load another template into char buffer 1 while the chain extracts the
+  // finger into it, before its search.
+  mgos_fingerprint_svc_timer(t.dev);
+  while (!t.dev->cmd_busy ||
+         t.dev->cmd.data[0] != MGOS_FINGERPRINT_CMD_IMAGE2TZ)
+    mgos_fingerprint_poll(t.dev);
+  TEST_CHECK(mgos_fingerprint_model_load(t.dev, 3, 1) == MGOS_FINGERPRINT_OK);
+  while (t.dev->svc_busy) mgos_fingerprint_poll(t.dev);
+  TEST_CHECK((match & 0xFFFF) == 7);
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+
+static void mgos_fingerprint_test_events(struct mgos_fingerprint *dev, int ev,
+                                         void *ev_data, void *user_data) {
+  *(uint32_t *) user_data |= 1 << ev;
+  (void) dev;
+  (void) ev_data;
+}
+
+bool mgos_fingerprint_test_svc_mode_switch(void) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_sim_cfg scfg;
+  struct mgos_fingerprint_cfg cfg;
+  uint32_t events = 0;
+  int mode = -1;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  mgos_fingerprint_sim_config_set_defaults(&scfg);
+  scfg.auto_commands = false;
+  TEST_CHECK((t.sim = mgos_fingerprint_sim_create(&scfg)) != NULL);
+  mgos_fingerprint_sim_set_finger(t.sim, 8);
+  mgos_fingerprint_test_dev_cfg(&t, &cfg, scfg.baud);
+  cfg.handler = mgos_fingerprint_test_events;
+  cfg.handler_user_data = &events;
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(
+      mgos_fingerprint_svc_mode_set(t.dev, MGOS_FINGERPRINT_MODE_ENROLL));
+
+  // Back to match mode while the first capture of an enrollment is being
+  // extracted: the chain stops, and the mode stays.
+  mgos_fingerprint_svc_timer(t.dev);
+  while (!t.dev->cmd_busy ||
+         t.dev->cmd.data[0] != MGOS_FINGERPRINT_CMD_IMAGE2TZ)
+    mgos_fingerprint_poll(t.dev);
+  TEST_CHECK(mgos_fingerprint_svc_mode_set(t.dev, MGOS_FINGERPRINT_MODE_MATCH));
+  events = 0;
+  while (t.dev->svc_busy) mgos_fingerprint_poll(t.dev);
+  TEST_CHECK(mgos_fingerprint_svc_mode_get(t.dev, &mode));
+  TEST_CHECK(mode == MGOS_FINGERPRINT_MODE_MATCH);
+  TEST_CHECK(events == 0);
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+
+bool mgos_fingerprint_test_auto_noise(void) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_test_garble g;
+  struct mgos_fingerprint_result res;
+  struct mgos_fingerprint_cfg cfg;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  memset(&res, 0, sizeof(res));
+  TEST_CHECK(mgos_fingerprint_test_sim(&t, &cfg));
+  mgos_fingerprint_test_garble(&t, &g, MGOS_FINGERPRINT_CMD_AUTOIDENTIFY);
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+  TEST_CHECK(mgos_fingerprint_auto_supported(t.dev));
+
+  g.frames = 1;
+  TEST_CHECK(mgos_fingerprint_auto_identify_async(
+                 t.dev, mgos_fingerprint_test_cb, &res) ==
+             MGOS_FINGERPRINT_OK);
+  while (res.cmd == 0) {
+    mgos_fingerprint_poll(t.dev);
+    mgos_msleep(MGOS_FINGERPRINT_POLL_INTERVAL);
+  }
+  TEST_CHECK(res.rc == MGOS_FINGERPRINT_PACKETRECIEVEERR);
+  TEST_CHECK(mgos_fingerprint_auto_supported(t.dev));
+  ok = true;
+
+out:
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+
+// Time to create a driver configured for 57600 baud on a module at `baud`,
+// in microseconds, or -1 if it failed.
+static int64_t mgos_fingerprint_test_detect_at(uint32_t baud, uint32_t first,
+                                               bool autodetect) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_sim_cfg scfg;
+  struct mgos_fingerprint_cfg cfg;
+  int64_t us = -1;
+
+  memset(&t, 0, sizeof(t));
+  mgos_fingerprint_sim_config_set_defaults(&scfg);
+  scfg.baud = baud;
+  if (!(t.sim = mgos_fingerprint_sim_create(&scfg))) return -1;
+  mgos_fingerprint_test_dev_cfg(&t, &cfg, first);
+  cfg.uart_baud_autodetect = autodetect;
+  us = mgos_uptime_micros();
+  t.dev = mgos_fingerprint_create(&cfg);
+  us = mgos_uptime_micros() - us;
+  if (!t.dev || t.dev->uart_baud != baud) us = -1;
+  mgos_fingerprint_test_close(&t);
+  return us;
+}
+
+bool mgos_fingerprint_test_autodetect(void) {
+  static const uint32_t bauds[] = {9600, 19200, 38400, 57600, 115200};
+  bool ok = false;
+
+  for (uint8_t i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+    int64_t known = mgos_fingerprint_test_detect_at(bauds[i], bauds[i], false);
+    int64_t found = mgos_fingerprint_test_detect_at(bauds[i], 57600, true);
+
+    TEST_CHECK(known >= 0 && found >= 0);
+    // Finding the rate adds well under a second to the bring-up.
+    TEST_CHECK(found - known < 600000);
+    if (bauds[i] != 57600)
+      TEST_CHECK(mgos_fingerprint_test_detect_at(bauds[i], 57600, false) < 0);
+  }
+  ok = true;
+
+out:
+  return ok;
+}
+
+#ifdef __linux__
+// CPU time of this process, in microseconds.
+static int64_t mgos_fingerprint_test_cpu_us(void) {
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return (int64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+         ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+bool mgos_fingerprint_test_pty_cpu(void) {
+  struct mgos_fingerprint_test t;
+  struct mgos_fingerprint_cfg cfg;
+  char name[64];
+  int64_t cpu_us, wall_us;
+  uint16_t n;
+  pid_t pid = -1;
+  bool ok = false;
+
+  memset(&t, 0, sizeof(t));
+  TEST_CHECK(mgos_fingerprint_test_sim(&t, &cfg));
+  mgos_fingerprint_sim_set_latency(t.sim, MGOS_FINGERPRINT_CMD_TEMPLATECOUNT,
+                                   50000);
+  TEST_CHECK(mgos_fingerprint_sim_pty_open(t.sim, name, sizeof(name)));
+  // The module lives in a process of its own, so only the driver is timed.
+  TEST_CHECK((pid = fork()) >= 0);
+  if (pid == 0) {
+    for (;;) {
+      mgos_fingerprint_sim_pty_poll(t.sim);
+      usleep(200);
+    }
+  }
+  TEST_CHECK(mgos_fingerprint_tty_open(name, cfg.uart_baud_rate, &t.transport));
+  TEST_CHECK((t.dev = mgos_fingerprint_create(&cfg)) != NULL);
+
+  cpu_us = mgos_fingerprint_test_cpu_us();
+  wall_us = mgos_uptime_micros();
+  for (uint8_t i = 0; i < 20; i++)
+    TEST_CHECK(mgos_fingerprint_model_count(t.dev, &n) == MGOS_FINGERPRINT_OK);
+  cpu_us = (mgos_fingerprint_test_cpu_us() - cpu_us) / 20;
+  wall_us = (mgos_uptime_micros() - wall_us) / 20;
+  LOG(LL_INFO, ("%lld us CPU per transaction of %lld us",
+                (long long) cpu_us, (long long) wall_us));
+  // Waiting on the module must leave the CPU to others.
+  TEST_CHECK(cpu_us * 10 < wall_us);
+  ok = true;
+
+out:
+  if (pid > 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+  }
+  mgos_fingerprint_test_close(&t);
+  return ok;
+}
+#endif
+
+int mgos_fingerprint_test_run(void) {
+  int failed = 0;
+
+  failed += !mgos_fingerprint_test_timeouts();
+  failed += !mgos_fingerprint_test_late_reply();
+  failed += !mgos_fingerprint_test_search_fallback();
+  failed += !mgos_fingerprint_test_search_noise();
+  failed += !mgos_fingerprint_test_resync();
+  failed += !mgos_fingerprint_test_revoke_stale();
+  failed += !mgos_fingerprint_test_snapshot_strays();
+  failed += !mgos_fingerprint_test_snapshot_order();
+  failed += !mgos_fingerprint_test_transfers();
+  failed += !mgos_fingerprint_test_replay();
+  failed += !mgos_fingerprint_test_cache();
+  failed += !mgos_fingerprint_test_replicas();
+  failed += !mgos_fingerprint_test_autodetect();
+  failed += !mgos_fingerprint_test_auto();
+  failed += !mgos_fingerprint_test_auto_noise();
+  failed += !mgos_fingerprint_test_svc_buffers();
+  failed += !mgos_fingerprint_test_svc_mode_switch();
+#ifdef __linux__
+  failed += !mgos_fingerprint_test_pty_cpu();
+#endif
+  return failed;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the driver against the simulated module, meant to run on a host
+// next to the benchmarks. Each test sets up its own modules, returns true if
+// it passed, and logs the check that failed otherwise.
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+// Captures on an empty sensor, then one with a finger, with adaptive
+// timeouts on: the quick empty captures must not shorten the timeout of the
+// slow one.
+bool mgos_fingerprint_test_timeouts(void);
+// A command that times out with another queued behind it: the late reply to
+// the first must not be taken for the reply to the second.
+bool mgos_fingerprint_test_late_reply(void);
+// A search in auto mode on a module without high speed search, with a
+// delete of the slot it finds queued behind it: the search falls back to a
+// normal one, and still finds the template before the delete runs.
+bool mgos_fingerprint_test_search_fallback(void);
+// Auto search on a module with high speed search, whose commands arrive
+// garbled: one receive error is retried without giving up on high speed
+// search, a run of them falls back to the normal one for good.
+bool mgos_fingerprint_test_search_noise(void);
+// Replies behind line noise, behind a header with an oversize length and
+// with a bad checksum: the parser finds the next frame, and the transaction
+// after each fault completes without waiting out a timeout.
+bool mgos_fingerprint_test_resync(void);
+// Revokes templates around a slot that was enrolled behind the driver's back:
+// that template must survive.
+bool mgos_fingerprint_test_revoke_stale(void);
+// Restores a snapshot over a module with templates the snapshot does not
+// have, in several runs: they all go, and the snapshot's own stay.
+bool mgos_fingerprint_test_snapshot_strays(void);
+// Templates and images through the data packets at each length of enum
+// mgos_fingerprint_param_datalen: a download yields the bytes the module
+// holds, and an upload stores the bytes sent.
+bool mgos_fingerprint_test_transfers(void);
+// A snapshot is written little-endian, and one with a byte-swapped magic is
+// refused.
+bool mgos_fingerprint_test_snapshot_order(void);
+// A trace of a session plays back through the replay transport, and so does
+// one with the truncated data packets of a template download, at their size.
+bool mgos_fingerprint_test_replay(void);
+// The descriptor cache leaves the notepad alone unless given a page, and a
+// warm start on a module with a password verifies it first.
+bool mgos_fingerprint_test_cache(void);
+// Two replicas of one source: a change is seen by both, and a template that
+// is already on a target is not written again.
+bool mgos_fingerprint_test_replicas(void);
+// Auto commands are found by probing the module, and the service only sends
+// AutoIdentify once a finger is on the sensor.
+bool mgos_fingerprint_test_auto(void);
+// An AutoIdentify that reaches the module garbled fails, but the auto
+// commands found at create stay in use.
+bool mgos_fingerprint_test_auto_noise(void);
+// A synchronous model_load() into char buffer 1 while the service is between
+// extracting a finger there and searching it: the search must still see the
+// finger on the sensor.
+bool mgos_fingerprint_test_svc_buffers(void);
+// Match mode set while an enrollment is in progress: the enrollment stops
+// without an error, and the service stays in match mode.
+bool mgos_fingerprint_test_svc_mode_switch(void);
+// A module at each rate of enum mgos_fingerprint_param_baudrate, found from
+// the default rate: with autodetection it is found within 600ms, without it
+// create() fails.
+bool mgos_fingerprint_test_autodetect(void);
+#ifdef __linux__
+// Transactions with a module behind a pseudo terminal in another process:
+// the driver must spend a small part of each one on the CPU, and idle while
+// the module works.
+bool mgos_fingerprint_test_pty_cpu(void);
+#endif
+
+// All of the above. Returns the number of tests that failed.
+int mgos_fingerprint_test_run(void);
+
+#ifdef __cplusplus
+}
+#endif
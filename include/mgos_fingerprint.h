@@ -49,12 +49,15 @@ extern "C" {
 #define MGOS_FINGERPRINT_FAIL_CONFIGREG 0x1B
 #define MGOS_FINGERPRINT_FAIL_NOTEPADPAGE 0x1C
 #define MGOS_FINGERPRINT_FAIL_COMMS 0x1D
+#define MGOS_FINGERPRINT_FAIL_FINGERTIMEOUT 0x26
 #define MGOS_FINGERPRINT_HANDSHAKE_OK 0x55
 
 /* Error codes */
 #define MGOS_FINGERPRINT_TIMEOUT -1
 #define MGOS_FINGERPRINT_READ_ERROR -2
 #define MGOS_FINGERPRINT_NOFREEINDEX -3
+#define MGOS_FINGERPRINT_BUSY -4
+#define MGOS_FINGERPRINT_ABORTED -5
 
 #define MGOS_FINGERPRINT_DEFAULT_PASSWORD 0x00000000
 #define MGOS_FINGERPRINT_DEFAULT_ADDRESS 0xFFFFFFFF
@@ -130,6 +133,49 @@ typedef void (*mgos_fingerprint_ev_handler)(struct mgos_fingerprint *finger,
                                             int ev, void *ev_data,
                                             void *user_data);
 
+// Outcome of an asynchronous command. `rc` holds the confirmation code, or
+// one of the negative error codes above. Decoded fields are only filled in
+// by the commands that return them; `data` points at the raw acknowledge
+// payload following the confirmation code, and is valid only for the
+// duration of the callback.
+struct mgos_fingerprint_result {
+  uint8_t cmd;
+  int16_t rc;
+  uint16_t finger_id;  // database_search
+  uint16_t score;      // database_search, model_matchpair
+  uint16_t count;      // model_count
+  uint32_t number;     // get_random_number
+  uint8_t step;        // auto_enroll, auto_identify: MGOS_FINGERPRINT_AUTO_*
+  bool more;           // further acknowledges follow for this command
+  const uint8_t *data;
+  uint16_t len;
+  uint32_t transferred;  // bytes moved in data packets, for data transfers
+};
+
+typedef void (*mgos_fingerprint_cb)(struct mgos_fingerprint *dev,
+                                    const struct mgos_fingerprint_result *res,
+                                    void *cb_arg);
+
+// Data phase of image and template transfers. A sink is handed the payload of
+// each data packet from the module as it is parsed, and returns false to abort
+// the transfer. A source fills the next `len` bytes to send to the module, and
+// returns false to abort.
+typedef bool (*mgos_fingerprint_data_sink)(const uint8_t *chunk, size_t len,
+                                           void *ud);
+typedef bool (*mgos_fingerprint_data_source)(uint8_t *chunk, size_t len,
+                                             void *ud);
+
+// Steps reported by the AutoEnroll / AutoIdentify commands, one acknowledge
+// each. MGOS_FINGERPRINT_AUTO_STORE and MGOS_FINGERPRINT_AUTO_SEARCH are the
+// final steps of enroll and identify respectively.
+#define MGOS_FINGERPRINT_AUTO_CHECK 0x00
+#define MGOS_FINGERPRINT_AUTO_IMAGE 0x01
+#define MGOS_FINGERPRINT_AUTO_GENCHAR 0x02
+#define MGOS_FINGERPRINT_AUTO_LIFT 0x03
+#define MGOS_FINGERPRINT_AUTO_COMBINE 0x04
+#define MGOS_FINGERPRINT_AUTO_SEARCH 0x05
+#define MGOS_FINGERPRINT_AUTO_STORE 0x06
+
 #define MGOS_FINGERPRINT_MODE_MATCH 0x01   // Search/DB mode
 #define MGOS_FINGERPRINT_MODE_ENROLL 0x02  // Enroll mode
 
@@ -144,17 +190,92 @@ typedef void (*mgos_fingerprint_ev_handler)(struct mgos_fingerprint *finger,
 #define MGOS_FINGERPRINT_EV_ENROLL_OK 0x0008
 #define MGOS_FINGERPRINT_EV_ENROLL_ERROR 0x0009
 
+enum mgos_fingerprint_search_strategy {
+  MGOS_FINGERPRINT_SEARCH_NORMAL = 0,  // CMD_SEARCH
+  MGOS_FINGERPRINT_SEARCH_HISPEED,     // CMD_HISPEEDSEARCH
+  MGOS_FINGERPRINT_SEARCH_AUTO,        // whichever is faster on this module
+};
+
+// Acknowledge timeout of one instruction code (as in the module's datasheet,
+// eg. 0x04 for SEARCH), overriding the driver's default for it.
+struct mgos_fingerprint_timeout {
+  uint8_t cmd;
+  uint16_t ms;
+};
+
+// Byte stream to the module. By default the driver talks to cfg.uart_no; a
+// transport in cfg.transport stands in for it, eg. a replay of a recorded
+// trace. read() must not block. The driver owns the transport once it is
+// passed to create(), and calls close() on destroy or when create() fails.
+struct mgos_fingerprint_transport {
+  size_t (*read)(void *ctx, void *buf, size_t len);
+  size_t (*write)(void *ctx, const void *buf, size_t len);
+  void (*flush)(void *ctx);                    // NULL if not needed
+  bool (*set_baud)(void *ctx, uint32_t baud);  // NULL if the rate is fixed
+  void (*close)(void *ctx);                    // NULL if not needed
+  void *ctx;
+};
+
 struct mgos_fingerprint_cfg {
   uint32_t password;
   uint32_t address;
   uint8_t uart_no;
   uint32_t uart_baud_rate;
+  // Highest rate to raise the link to at create time, or 0 (the default) to
+  // stay at uart_baud_rate. Raising it writes the rate to the module's flash.
+  // The new rate is verified with a handshake, and the module is set back to
+  // uart_baud_rate if that fails.
+  uint32_t uart_baud_max;
+  // Find the module at any rate of enum mgos_fingerprint_param_baudrate if it
+  // does not answer at uart_baud_rate, for units left at another rate.
+  bool uart_baud_autodetect;
+
+  // File to keep the module's parameters, info and template index in, or
+  // NULL. With it, create() on a known module costs two commands instead of
+  // reading them all again. The file is only used together with a notepad
+  // page for its generation counter.
+  const char *cache_path;
+  // Notepad page the driver may overwrite with the cache generation, or -1
+  // (the default) to leave the notepad to the application and not cache.
+  int8_t cache_notepad_page;
+
+  // Every command has its own timeout; see struct mgos_fingerprint_timeout.
+  // Adaptive timeouts, off by default, follow the measured latency of each
+  // successful command, so a dead module is noticed within a few round trips
+  // of a cheap command, and never exceed the configured value. Capture,
+  // extraction, matching and search always wait the configured value, as
+  // their latency depends on the finger.
+  const struct mgos_fingerprint_timeout *timeouts;
+  uint8_t num_timeouts;
+  bool adaptive_timeouts;
+
+  // Keep struct mgos_fingerprint_op_stats for every command, and log a line
+  // of them every stats_log_secs seconds if that is not 0.
+  bool collect_stats;
+  uint16_t stats_log_secs;
+
+  // Keep the last trace_len frames sent and received in a ring, for
+  // mgos_fingerprint_trace_dump() and mgos_fingerprint_trace_save(). The ring
+  // is allocated once, in create().
+  uint16_t trace_len;
+
+  // Talk to the module through this instead of uart_no; see
+  // struct mgos_fingerprint_transport.
+  const struct mgos_fingerprint_transport *transport;
 
   // User callback event handler
   mgos_fingerprint_ev_handler handler;
   void *handler_user_data;
 
   int enroll_timeout_secs;
+
+  // Used by mgos_fingerprint_database_search() and the service.
+  enum mgos_fingerprint_search_strategy search_strategy;
+
+  // Data packet length to configure at create time, one of
+  // enum mgos_fingerprint_param_datalen, or -1 to keep the module's setting.
+  // Larger packets move images and templates in fewer frames.
+  int datapacket_length;
 };
 
 // Structural
@@ -170,9 +291,14 @@ int16_t mgos_fingerprint_get_param(struct mgos_fingerprint *dev,
 int16_t mgos_fingerprint_set_param(struct mgos_fingerprint *dev,
                                    enum mgos_fingerprint_param param,
                                    uint8_t value);
+// Always reads the parameters from the module, refreshing the driver's copy.
+// mgos_fingerprint_get_param() is served from that copy, which is updated by
+// mgos_fingerprint_set_param(); invalidate it if the module was changed
+// behind the driver's back, and the next get_param() reads it again.
 int16_t mgos_fingerprint_get_system_params(
     struct mgos_fingerprint *dev,
     struct mgos_fingerprint_system_params *params);
+void mgos_fingerprint_system_params_invalidate(struct mgos_fingerprint *dev);
 int16_t mgos_fingerprint_get_info(struct mgos_fingerprint *dev,
                                   struct mgos_fingerprint_info *info);
 
@@ -186,6 +312,26 @@ int16_t mgos_fingerprint_model_download(struct mgos_fingerprint *dev,
                                         uint8_t slot);
 int16_t mgos_fingerprint_model_upload(struct mgos_fingerprint *dev,
                                       uint8_t slot);
+
+// Template transfers between a char buffer of the module and the host.
+// Downloads hand each data packet to `sink` until the end-of-data packet;
+// uploads pull `len` bytes (info.model_size if 0) from `source` and send them
+// in data packets of the negotiated length. The _buf variants copy to and
+// from a caller's buffer; a download fails with MGOS_FINGERPRINT_ABORTED if
+// the template does not fit in `size` bytes.
+int16_t mgos_fingerprint_model_download_stream(struct mgos_fingerprint *dev,
+                                               uint8_t slot,
+                                               mgos_fingerprint_data_sink sink,
+                                               void *ud);
+int16_t mgos_fingerprint_model_download_buf(struct mgos_fingerprint *dev,
+                                            uint8_t slot, uint8_t *buf,
+                                            size_t size, size_t *len);
+int16_t mgos_fingerprint_model_upload_stream(
+    struct mgos_fingerprint *dev, uint8_t slot,
+    mgos_fingerprint_data_source source, void *ud, size_t len);
+int16_t mgos_fingerprint_model_upload_buf(struct mgos_fingerprint *dev,
+                                          uint8_t slot, const uint8_t *buf,
+                                          size_t len);
 int16_t mgos_fingerprint_model_delete(struct mgos_fingerprint *dev, uint16_t id,
                                       uint16_t how_many);
 int16_t mgos_fingerprint_model_count(struct mgos_fingerprint *dev,
@@ -199,11 +345,23 @@ int16_t mgos_fingerprint_image_genchar(struct mgos_fingerprint *dev,
                                        uint8_t slot);
 int16_t mgos_fingerprint_image_download(struct mgos_fingerprint *dev);
 
+// Uploads the image buffer of the module, handing each data packet to `sink`
+// as it arrives, so the image is never held in RAM as a whole.
+// mgos_fingerprint_image_download() reads and drops it.
+int16_t mgos_fingerprint_image_download_stream(struct mgos_fingerprint *dev,
+                                               mgos_fingerprint_data_sink sink,
+                                               void *ud);
+int16_t mgos_fingerprint_image_download_file(struct mgos_fingerprint *dev,
+                                             const char *path);
+
 // Database functions
 int16_t mgos_fingerprint_database_erase(struct mgos_fingerprint *dev);
 int16_t mgos_fingerprint_database_search(struct mgos_fingerprint *dev,
                                          uint16_t *finger_id, uint16_t *score,
                                          uint8_t slot);
+int16_t mgos_fingerprint_database_search_hispeed(struct mgos_fingerprint *dev,
+                                                 uint16_t *finger_id,
+                                                 uint16_t *score, uint8_t slot);
 
 // LED functions
 int16_t mgos_fingerprint_led_on(struct mgos_fingerprint *dev);
@@ -219,10 +377,394 @@ int16_t mgos_fingerprint_handshake(struct mgos_fingerprint *dev);
 int16_t mgos_fingerprint_get_random_number(struct mgos_fingerprint *dev,
                                            uint32_t *number);
 int16_t mgos_fingerprint_get_free_id(struct mgos_fingerprint *dev, int16_t *id);
+
+// Link health since create. The receive parser hunts for the start code of
+// the next frame after line noise, so a stray byte costs the bytes around it
+// rather than a timeout.
+struct mgos_fingerprint_link_stats {
+  uint32_t resyncs;    // times the parser lost and regained frame sync
+  uint32_t discarded;  // bytes dropped while hunting, or with no command
+  uint32_t checksum_errors;
+  uint32_t timeouts;
+};
+void mgos_fingerprint_get_link_stats(struct mgos_fingerprint *dev,
+                                     struct mgos_fingerprint_link_stats *stats);
+
+// Transactions per instruction code since create or the last reset, with
+// cfg.collect_stats. Latencies are kept in histograms: bucket 0 counts those
+// under 1ms, bucket i those under 2^i ms and the last one all slower ones.
+// A slow write points at the UART, a slow first byte at the module, and
+// checksum errors at the line.
+#define MGOS_FINGERPRINT_STATS_BUCKETS 12
+#define MGOS_FINGERPRINT_STATS_OPS 31  // most entries get_stats() returns
+struct mgos_fingerprint_op_stats {
+  uint8_t cmd;  // instruction code, 0 for all commands without a timeout row
+  uint32_t count;
+  uint32_t timeouts;
+  uint32_t checksum_errors;
+  uint32_t bad_packets;  // answered with anything but an acknowledge
+  uint16_t write_hist[MGOS_FINGERPRINT_STATS_BUCKETS];  // request on the wire
+  uint16_t ttfb_hist[MGOS_FINGERPRINT_STATS_BUCKETS];   // to the first byte
+  uint16_t total_hist[MGOS_FINGERPRINT_STATS_BUCKETS];  // to the result
+};
+// Copies the entries of the commands that were used into `ops` and returns
+// their number, at most `max`.
+uint8_t mgos_fingerprint_get_stats(struct mgos_fingerprint *dev,
+                                   struct mgos_fingerprint_op_stats *ops,
+                                   uint8_t max);
+void mgos_fingerprint_reset_stats(struct mgos_fingerprint *dev);
+
+// Frame trace, with cfg.trace_len. Every frame sent or received is kept with
+// its time, direction and result; the ring holds the last trace_len of them.
+// Only the start of each payload is kept, enough for any command and
+// acknowledge; a longer one, such as a data packet of a template, is marked
+// as truncated.
+#define MGOS_FINGERPRINT_TRACE_BYTES 48
+#define MGOS_FINGERPRINT_TRACE_TX 0
+#define MGOS_FINGERPRINT_TRACE_RX 1
+struct __attribute__((packed)) mgos_fingerprint_trace_entry {
+  uint32_t time_us;  // mgos_uptime_micros(), wraps after 71 minutes
+  int16_t rc;        // TX: bytes written; RX: payload length, or error
+  uint16_t len;      // length field of the packet, payload and checksum
+  uint8_t dir;       // MGOS_FINGERPRINT_TRACE_TX or MGOS_FINGERPRINT_TRACE_RX
+  uint8_t type;      // packet type
+  bool truncated;    // the payload did not fit in data[]
+  uint8_t data[MGOS_FINGERPRINT_TRACE_BYTES];  // start of the payload
+};
+// Copies up to `max` entries into `entries`, oldest first, and returns their
+// number.
+uint16_t mgos_fingerprint_trace_get(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_trace_entry *entries,
+    uint16_t max);
+// Logs the ring, one line per frame, oldest first.
+void mgos_fingerprint_trace_dump(struct mgos_fingerprint *dev);
+// Writes the ring to a file that mgos_fingerprint_replay_open() can play.
+bool mgos_fingerprint_trace_save(struct mgos_fingerprint *dev,
+                                 const char *path);
+void mgos_fingerprint_trace_clear(struct mgos_fingerprint *dev);
+
+// Replay transport: answers the driver with the frames received in a saved
+// trace. Each command that is sent is matched to the next one of the same
+// instruction code in the trace, and the frames received after it are played
+// back; with `realtime`, at the delays they were recorded with. Timeouts,
+// checksum errors and latency spikes of the field come back as they were.
+// A truncated data packet is played back at its recorded length and type,
+// with zeros for the bytes that were not kept, so a template or image comes
+// back with the right size but not its content. A trace with a truncated
+// acknowledge in it is refused.
+bool mgos_fingerprint_replay_open(const char *path, bool realtime,
+                                  struct mgos_fingerprint_transport *transport);
+
+#ifdef __linux__
+// POSIX terminal transport, eg. a USB serial adapter or the pseudo terminal
+// of mgos_fingerprint_sim_pty_open(), at `baud` 8N1.
+bool mgos_fingerprint_tty_open(const char *path, uint32_t baud,
+                               struct mgos_fingerprint_transport *transport);
+#endif
+
+// Notepad: pages of free-form bytes in the module's flash, left to the host.
+// With cfg.cache_path, page cfg.cache_notepad_page holds the module's serial
+// number and a generation counter that is bumped on every change of the
+// flash database, which tells whether the cache file is still current.
+// Anything else the application kept on that page is lost.
+#define MGOS_FINGERPRINT_NOTEPAD_PAGES 16
+#define MGOS_FINGERPRINT_NOTEPAD_SIZE 32
+int16_t mgos_fingerprint_notepad_read(struct mgos_fingerprint *dev,
+                                      uint8_t page, uint8_t *buf);
+int16_t mgos_fingerprint_notepad_write(struct mgos_fingerprint *dev,
+                                       uint8_t page, const uint8_t *buf);
+
+// Template index cache: the occupied flash slots are read from the module at
+// create time and tracked as models are stored, deleted or erased through
+// this driver. mgos_fingerprint_index_refresh() re-reads them, eg. after the
+// module was changed by another host.
+int16_t mgos_fingerprint_index_refresh(struct mgos_fingerprint *dev);
+
+// Returns the lowest enrolled id greater than `after` (pass -1 to start), or
+// MGOS_FINGERPRINT_NOFREEINDEX when there are no more. Served from the cache.
+int16_t mgos_fingerprint_model_next(struct mgos_fingerprint *dev,
+                                    int16_t after);
 int16_t mgos_fingerprint_verify_password(struct mgos_fingerprint *dev);
 int16_t mgos_fingerprint_set_password(struct mgos_fingerprint *dev,
                                       uint32_t pwd);
 
+// Asynchronous variants: each returns MGOS_FINGERPRINT_OK once the command
+// is queued, or MGOS_FINGERPRINT_BUSY if the device queue is full. Commands
+// are sent back-to-back in submission order; the callback runs from the UART
+// dispatcher when the module acknowledges, or from a timer when it does not
+// answer in time. Any task may submit.
+int16_t mgos_fingerprint_verify_password_async(struct mgos_fingerprint *dev,
+                                               mgos_fingerprint_cb cb,
+                                               void *cb_arg);
+int16_t mgos_fingerprint_set_password_async(struct mgos_fingerprint *dev,
+                                            uint32_t pwd,
+                                            mgos_fingerprint_cb cb,
+                                            void *cb_arg);
+int16_t mgos_fingerprint_set_param_async(struct mgos_fingerprint *dev,
+                                         enum mgos_fingerprint_param param,
+                                         uint8_t value, mgos_fingerprint_cb cb,
+                                         void *cb_arg);
+int16_t mgos_fingerprint_get_system_params_async(struct mgos_fingerprint *dev,
+                                                 mgos_fingerprint_cb cb,
+                                                 void *cb_arg);
+int16_t mgos_fingerprint_get_info_async(struct mgos_fingerprint *dev,
+                                        mgos_fingerprint_cb cb, void *cb_arg);
+int16_t mgos_fingerprint_model_combine_async(struct mgos_fingerprint *dev,
+                                             mgos_fingerprint_cb cb,
+                                             void *cb_arg);
+int16_t mgos_fingerprint_model_load_async(struct mgos_fingerprint *dev,
+                                          uint16_t id, uint8_t slot,
+                                          mgos_fingerprint_cb cb, void *cb_arg);
+int16_t mgos_fingerprint_model_store_async(struct mgos_fingerprint *dev,
+                                           uint16_t id, uint8_t slot,
+                                           mgos_fingerprint_cb cb,
+                                           void *cb_arg);
+int16_t mgos_fingerprint_model_download_async(struct mgos_fingerprint *dev,
+                                              uint8_t slot,
+                                              mgos_fingerprint_cb cb,
+                                              void *cb_arg);
+int16_t mgos_fingerprint_model_upload_async(struct mgos_fingerprint *dev,
+                                            uint8_t slot,
+                                            mgos_fingerprint_cb cb,
+                                            void *cb_arg);
+int16_t mgos_fingerprint_model_download_stream_async(
+    struct mgos_fingerprint *dev, uint8_t slot, mgos_fingerprint_data_sink sink,
+    void *ud, mgos_fingerprint_cb cb, void *cb_arg);
+int16_t mgos_fingerprint_model_upload_stream_async(
+    struct mgos_fingerprint *dev, uint8_t slot,
+    mgos_fingerprint_data_source source, void *ud, size_t len,
+    mgos_fingerprint_cb cb, void *cb_arg);
+int16_t mgos_fingerprint_model_delete_async(struct mgos_fingerprint *dev,
+                                            uint16_t id, uint16_t how_many,
+                                            mgos_fingerprint_cb cb,
+                                            void *cb_arg);
+int16_t mgos_fingerprint_model_count_async(struct mgos_fingerprint *dev,
+                                           mgos_fingerprint_cb cb,
+                                           void *cb_arg);
+int16_t mgos_fingerprint_model_matchpair_async(struct mgos_fingerprint *dev,
+                                               mgos_fingerprint_cb cb,
+                                               void *cb_arg);
+// Reads one page of the template index: `res->data` holds a bitmap of
+// 256 templates, LSB first.
+int16_t mgos_fingerprint_model_index_async(struct mgos_fingerprint *dev,
+                                           uint8_t page, mgos_fingerprint_cb cb,
+                                           void *cb_arg);
+int16_t mgos_fingerprint_image_get_async(struct mgos_fingerprint *dev,
+                                         mgos_fingerprint_cb cb, void *cb_arg);
+int16_t mgos_fingerprint_image_genchar_async(struct mgos_fingerprint *dev,
+                                             uint8_t slot,
+                                             mgos_fingerprint_cb cb,
+                                             void *cb_arg);
+int16_t mgos_fingerprint_image_download_async(struct mgos_fingerprint *dev,
+                                              mgos_fingerprint_cb cb,
+                                              void *cb_arg);
+int16_t mgos_fingerprint_image_download_stream_async(
+    struct mgos_fingerprint *dev, mgos_fingerprint_data_sink sink, void *ud,
+    mgos_fingerprint_cb cb, void *cb_arg);
+int16_t mgos_fingerprint_database_erase_async(struct mgos_fingerprint *dev,
+                                              mgos_fingerprint_cb cb,
+                                              void *cb_arg);
+int16_t mgos_fingerprint_database_search_async(struct mgos_fingerprint *dev,
+                                               uint8_t slot,
+                                               mgos_fingerprint_cb cb,
+                                               void *cb_arg);
+int16_t mgos_fingerprint_database_search_hispeed_async(
+    struct mgos_fingerprint *dev, uint8_t slot, mgos_fingerprint_cb cb,
+    void *cb_arg);
+int16_t mgos_fingerprint_led_on_async(struct mgos_fingerprint *dev,
+                                      mgos_fingerprint_cb cb, void *cb_arg);
+int16_t mgos_fingerprint_led_off_async(struct mgos_fingerprint *dev,
+                                       mgos_fingerprint_cb cb, void *cb_arg);
+int16_t mgos_fingerprint_led_aura_async(
+    struct mgos_fingerprint *dev,
+    enum mgos_fingerprint_aura_control control_code, uint8_t speed,
+    enum mgos_fingerprint_aura_color color, uint8_t times,
+    mgos_fingerprint_cb cb, void *cb_arg);
+int16_t mgos_fingerprint_standby_async(struct mgos_fingerprint *dev,
+                                       mgos_fingerprint_cb cb, void *cb_arg);
+int16_t mgos_fingerprint_handshake_async(struct mgos_fingerprint *dev,
+                                         mgos_fingerprint_cb cb, void *cb_arg);
+int16_t mgos_fingerprint_get_random_number_async(struct mgos_fingerprint *dev,
+                                                 mgos_fingerprint_cb cb,
+                                                 void *cb_arg);
+// The page is in res->data, MGOS_FINGERPRINT_NOTEPAD_SIZE bytes.
+int16_t mgos_fingerprint_notepad_read_async(struct mgos_fingerprint *dev,
+                                            uint8_t page,
+                                            mgos_fingerprint_cb cb,
+                                            void *cb_arg);
+int16_t mgos_fingerprint_notepad_write_async(struct mgos_fingerprint *dev,
+                                             uint8_t page, const uint8_t *buf,
+                                             mgos_fingerprint_cb cb,
+                                             void *cb_arg);
+
+// Single-command capture, feature extraction and search/store, on modules
+// that implement it (see mgos_fingerprint_auto_supported()). The callback
+// runs once per step with res->more set, and a last time for the final step
+// or the first error. Identify fills in finger_id and score on
+// MGOS_FINGERPRINT_AUTO_SEARCH; enroll captures `times` images and stores the
+// combined model at `id`.
+bool mgos_fingerprint_auto_supported(struct mgos_fingerprint *dev);
+int16_t mgos_fingerprint_auto_identify_async(struct mgos_fingerprint *dev,
+                                             mgos_fingerprint_cb cb,
+                                             void *cb_arg);
+int16_t mgos_fingerprint_auto_enroll_async(struct mgos_fingerprint *dev,
+                                           uint16_t id, uint8_t times,
+                                           mgos_fingerprint_cb cb,
+                                           void *cb_arg);
+
+// Bulk provisioning: uploads each template through a char buffer and stores
+// it in flash slot `id`, keeping the module busy with the next template while
+// one is being stored. `*next` is the index in `tpl` to start at (NULL for 0)
+// and is set to the first template not confirmed stored, so that calling
+// again after an error resumes the import. `progress` (may be NULL) is called
+// after each stored template.
+struct mgos_fingerprint_template {
+  uint16_t id;  // flash slot
+  const uint8_t *data;
+  size_t len;  // 0 for info.model_size
+};
+typedef void (*mgos_fingerprint_progress_cb)(struct mgos_fingerprint *dev,
+                                             uint16_t done, uint16_t total,
+                                             void *ud);
+int16_t mgos_fingerprint_model_import(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_template *tpl,
+    uint16_t count, uint16_t *next, mgos_fingerprint_progress_cb progress,
+    void *ud);
+
+// Bulk delete of an arbitrary set of ids, given as a bitmap (bit i of byte
+// i / 8 is id i, as in the template index) or as a list. The set is merged
+// into as few ranged DELETE commands as possible, bridging slots that are
+// empty, and sent back-to-back; if it holds every enrolled template the
+// database is emptied instead. Which slots are in use is read from the
+// module first, never taken from the cache. `ranges` receives each command
+// and its result; if more than `max_ranges` are needed nothing is deleted,
+// MGOS_FINGERPRINT_READ_ERROR is returned and `*num_ranges` says how many.
+struct mgos_fingerprint_delete_range {
+  uint16_t id;
+  uint16_t count;
+  int16_t rc;
+};
+int16_t mgos_fingerprint_model_delete_set(
+    struct mgos_fingerprint *dev, const uint8_t *bitmap, uint16_t nbits,
+    struct mgos_fingerprint_delete_range *ranges, uint16_t max_ranges,
+    uint16_t *num_ranges);
+int16_t mgos_fingerprint_model_delete_list(
+    struct mgos_fingerprint *dev, const uint16_t *ids, uint16_t num_ids,
+    struct mgos_fingerprint_delete_range *ranges, uint16_t max_ranges,
+    uint16_t *num_ranges);
+
+// Replication: keeps the flash database of one or more target modules equal
+// to that of a source module. The replica remembers a digest per slot on each
+// side, and every change made through the driver marks the slot for each
+// replica the module is in, so a sync after one new enrollment moves one
+// template per target. The first sync, and any sync after
+// mgos_fingerprint_index_refresh(), reads every used slot of the source, and
+// of a target where both sides are used, and only writes templates that
+// differ. Runs of slots that disappeared from the source are deleted with one
+// command per run. A module can be in up to 4 replicas. The replica holds
+// 4 bytes per slot per module, plus two templates.
+#define MGOS_FINGERPRINT_REPLICA_TARGETS 4
+
+struct mgos_fingerprint_replica;
+struct mgos_fingerprint_replica_stats {
+  uint16_t fetched;   // templates read from the source
+  uint16_t compared;  // templates read from targets
+  uint16_t copied;    // templates written to targets
+  uint16_t deleted;   // slots deleted on targets
+};
+struct mgos_fingerprint_replica *mgos_fingerprint_replica_create(
+    struct mgos_fingerprint *src, struct mgos_fingerprint **dst,
+    uint8_t num_dst);
+void mgos_fingerprint_replica_destroy(struct mgos_fingerprint_replica **r);
+int16_t mgos_fingerprint_replica_sync(
+    struct mgos_fingerprint_replica *r,
+    struct mgos_fingerprint_replica_stats *stats);
+
+// Sharded library: the databases of several modules, each on its own UART,
+// used as one of their combined capacity. Devices stay owned by the caller
+// and must hold templates of the same size. Global ids number the slots of
+// the shards one after the other, in the order of `devs`, so that order must
+// not change once templates are enrolled. A capture shard is the module whose
+// sensor took the finger; its char buffer 1 holds the template to enroll
+// (after model_combine) or to look up (after image_genchar). Enrollment
+// stores on the shard with the most free slots, preferring the capture shard
+// on a tie. Identification sends the probe to every other non-empty shard
+// and searches all of them at once, returning the best scoring match.
+#define MGOS_FINGERPRINT_SHARDS 8
+
+struct mgos_fingerprint_shards;
+struct mgos_fingerprint_shards *mgos_fingerprint_shards_create(
+    struct mgos_fingerprint **devs, uint8_t num_devs);
+void mgos_fingerprint_shards_destroy(struct mgos_fingerprint_shards **s);
+uint32_t mgos_fingerprint_shards_capacity(struct mgos_fingerprint_shards *s);
+uint32_t mgos_fingerprint_shards_count(struct mgos_fingerprint_shards *s);
+// Returns the device holding `global_id` and its slot there, or NULL.
+struct mgos_fingerprint *mgos_fingerprint_shards_locate(
+    struct mgos_fingerprint_shards *s, uint32_t global_id, uint16_t *id);
+int16_t mgos_fingerprint_shards_enroll(struct mgos_fingerprint_shards *s,
+                                       uint8_t capture, uint32_t *global_id);
+// Returns MGOS_FINGERPRINT_NOTFOUND if no shard matched, or the error of a
+// shard that could not be searched.
+int16_t mgos_fingerprint_shards_identify(struct mgos_fingerprint_shards *s,
+                                         uint8_t capture, uint32_t *global_id,
+                                         uint16_t *score);
+int16_t mgos_fingerprint_shards_delete(struct mgos_fingerprint_shards *s,
+                                       uint32_t global_id);
+
+// Database snapshots: a file holding a header (module model and serial,
+// template size and capacity), an occupancy bitmap and one fixed-stride
+// record per template, each with a CRC32; integers are little-endian on any
+// host, and a file with a byte-swapped magic is refused.
+// Writers add records in ascending id order and finalize the header on close;
+// readers return records in that order, MGOS_FINGERPRINT_NOFREEINDEX past the
+// last one, and MGOS_FINGERPRINT_READ_ERROR for a corrupt record.
+// mgos_fingerprint_snapshot_restore() checks the whole file first, then
+// streams the records into the module through the import pipeline and
+// deletes whatever else is enrolled.
+#define MGOS_FINGERPRINT_SNAPSHOT_MAGIC 0x50534746  // "FGSP"
+#define MGOS_FINGERPRINT_SNAPSHOT_VERSION 1
+
+struct __attribute__((packed)) mgos_fingerprint_snapshot_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  char module_model[16];
+  char module_serial[8];
+  uint16_t model_size;
+  uint16_t capacity;     // bits in the occupancy bitmap
+  uint16_t count;        // records
+  uint16_t record_size;  // stride, a multiple of 4
+  uint32_t records_offset;
+  uint32_t crc;  // of the header up to here and the bitmap
+};
+
+struct __attribute__((packed)) mgos_fingerprint_snapshot_record {
+  uint16_t id;
+  uint16_t len;
+  uint32_t crc;  // of the template bytes that follow
+};
+
+struct mgos_fingerprint_snapshot_writer;
+struct mgos_fingerprint_snapshot_reader;
+struct mgos_fingerprint_snapshot_writer *mgos_fingerprint_snapshot_writer_open(
+    const char *path, const struct mgos_fingerprint_info *info);
+int16_t mgos_fingerprint_snapshot_writer_add(
+    struct mgos_fingerprint_snapshot_writer *w, uint16_t id,
+    const uint8_t *data, size_t len);
+int16_t mgos_fingerprint_snapshot_writer_close(
+    struct mgos_fingerprint_snapshot_writer **w);
+struct mgos_fingerprint_snapshot_reader *mgos_fingerprint_snapshot_reader_open(
+    const char *path, struct mgos_fingerprint_snapshot_header *hdr);
+int16_t mgos_fingerprint_snapshot_reader_next(
+    struct mgos_fingerprint_snapshot_reader *r, uint16_t *id, uint8_t *buf,
+    size_t size, size_t *len);
+void mgos_fingerprint_snapshot_reader_close(
+    struct mgos_fingerprint_snapshot_reader **r);
+int16_t mgos_fingerprint_snapshot_save(struct mgos_fingerprint *dev,
+                                       const char *path);
+int16_t mgos_fingerprint_snapshot_restore(struct mgos_fingerprint *dev,
+                                          const char *path);
+
 // Library service
 bool mgos_fingerprint_init(void);
 bool mgos_fingerprint_svc_init(struct mgos_fingerprint *finger,
@@ -230,6 +772,32 @@ bool mgos_fingerprint_svc_init(struct mgos_fingerprint *finger,
 bool mgos_fingerprint_svc_mode_set(struct mgos_fingerprint *finger, int mode);
 bool mgos_fingerprint_svc_mode_get(struct mgos_fingerprint *finger, int *mode);
 
+// Reader manager: runs the service of several modules, each on its own UART,
+// from one timer. Every tick polls all readers and starts the service step
+// of those that are due and idle, beginning with a different reader each
+// time. Steps are asynchronous, so a search on one reader does not hold up a
+// capture on another. Events are passed on with the number of the reader
+// they came from. Readers are not to be given to mgos_fingerprint_svc_init().
+#define MGOS_FINGERPRINT_MGR_READERS 8
+
+struct mgos_fingerprint_mgr;
+typedef void (*mgos_fingerprint_mgr_handler)(struct mgos_fingerprint_mgr *mgr,
+                                             uint8_t reader, int ev,
+                                             void *ev_data, void *user_data);
+
+struct mgos_fingerprint_mgr *mgos_fingerprint_mgr_create(
+    uint16_t period_ms, mgos_fingerprint_mgr_handler handler, void *user_data);
+// Destroys the readers too.
+void mgos_fingerprint_mgr_destroy(struct mgos_fingerprint_mgr **mgr);
+// Creates a reader from `cfg`, whose handler is replaced by the manager's,
+// and starts it in match mode. Returns its number, or -1.
+int8_t mgos_fingerprint_mgr_add(struct mgos_fingerprint_mgr *mgr,
+                                const struct mgos_fingerprint_cfg *cfg);
+uint8_t mgos_fingerprint_mgr_count(struct mgos_fingerprint_mgr *mgr);
+// The reader's device, eg. for mgos_fingerprint_svc_mode_set().
+struct mgos_fingerprint *mgos_fingerprint_mgr_get(
+    struct mgos_fingerprint_mgr *mgr, uint8_t reader);
+
 #ifdef __cplusplus
 }
 #endif
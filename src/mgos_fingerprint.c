@@ -22,22 +22,156 @@
 #include "mgos.h"
 #include "mgos_fingerprint_internal.h"
 
-static void write_packet(struct mgos_fingerprint *dev, uint8_t packettype,
-                         uint16_t datalen);
-static int16_t read_packet(struct mgos_fingerprint *dev);
-static int16_t mgos_fingerprint_txn(struct mgos_fingerprint *dev);
-static int16_t mgos_fingerprint_get_free_page_id(struct mgos_fingerprint *dev,
-                                                 uint8_t page, int16_t *id);
-
 void mgos_fingerprint_config_set_defaults(struct mgos_fingerprint_cfg *cfg) {
   if (!cfg) return;
   cfg->address = MGOS_FINGERPRINT_DEFAULT_ADDRESS;
   cfg->password = MGOS_FINGERPRINT_DEFAULT_PASSWORD;
   cfg->uart_no = 2;
   cfg->uart_baud_rate = 57600;
+  cfg->uart_baud_max = 0;
+  cfg->uart_baud_autodetect = true;
   cfg->handler = NULL;
   cfg->handler_user_data = NULL;
   cfg->enroll_timeout_secs = 5;
+  cfg->search_strategy = MGOS_FINGERPRINT_SEARCH_NORMAL;
+  cfg->datapacket_length = -1;
+  cfg->cache_path = NULL;
+  cfg->cache_notepad_page = -1;
+  cfg->timeouts = NULL;
+  cfg->num_timeouts = 0;
+  cfg->adaptive_timeouts = false;
+  cfg->collect_stats = false;
+  cfg->stats_log_secs = 0;
+  cfg->trace_len = 0;
+  cfg->transport = NULL;
+}
+
+bool mgos_fingerprint_uart_baud_set(struct mgos_fingerprint *dev,
+                                    uint32_t baud) {
+  if (!dev->io.set_baud || !dev->io.set_baud(dev->io.ctx, baud)) return false;
+  dev->uart_baud = baud;
+  mgos_fingerprint_rx_flush(dev);
+  return true;
+}
+
+// Supported rates as multiples of 9600, fastest first.
+static const uint8_t mgos_fingerprint_baud_rates[] = {
+    MGOS_FINGERPRINT_BAUDRATE_115200, MGOS_FINGERPRINT_BAUDRATE_57600,
+    MGOS_FINGERPRINT_BAUDRATE_38400, MGOS_FINGERPRINT_BAUDRATE_19200,
+    MGOS_FINGERPRINT_BAUDRATE_9600};
+
+static int16_t mgos_fingerprint_probe(struct mgos_fingerprint *dev) {
+  struct mgos_fingerprint_sync s;
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_HANDSHAKE},
+      .len = 1,
+      .timeout_ms = MGOS_FINGERPRINT_PROBE_TIMEOUT,
+      .cb = mgos_fingerprint_sync_cb,
+      .cb_arg = &s};
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(dev, &s,
+                                    mgos_fingerprint_submit(dev, &cmd));
+}
+
+// Finds the rate the module listens at: the configured one first, then the
+// others fastest first, as a previous negotiation leaves the module there.
+// Each costs one handshake on a short timeout, so a full sweep stays well
+// under a second. The host UART is left at the rate that answered.
+static bool mgos_fingerprint_baud_detect(struct mgos_fingerprint *dev) {
+  uint32_t first = dev->uart_baud;
+
+  if (MGOS_FINGERPRINT_OK == mgos_fingerprint_probe(dev)) return true;
+  for (uint8_t i = 0; i < sizeof(mgos_fingerprint_baud_rates); i++) {
+    uint32_t baud = (uint32_t) mgos_fingerprint_baud_rates[i] * 9600;
+
+    if (baud == first || !mgos_fingerprint_uart_baud_set(dev, baud)) continue;
+    if (MGOS_FINGERPRINT_OK == mgos_fingerprint_probe(dev)) {
+      LOG(LL_INFO, ("UART%d found module at %u baud", dev->uart_no, baud));
+      return true;
+    }
+  }
+  mgos_fingerprint_uart_baud_set(dev, first);
+  LOG(LL_ERROR, ("UART%d no module found at any baud rate", dev->uart_no));
+  return false;
+}
+
+// Raises the link to the fastest rate the module supports up to `max`. The
+// module acknowledges SETSYSPARAM at the old rate and then switches, so the
+// host follows and checks the link with a handshake. If that fails, the
+// module is found at either rate and set back to the old one.
+static void mgos_fingerprint_baud_raise(struct mgos_fingerprint *dev,
+                                        uint32_t max) {
+  uint32_t old = dev->uart_baud, baud = 0;
+  uint8_t old_n = old / 9600, n = 0;
+
+  for (uint8_t i = 0; i < sizeof(mgos_fingerprint_baud_rates); i++) {
+    if ((uint32_t) mgos_fingerprint_baud_rates[i] * 9600 <= max) {
+      n = mgos_fingerprint_baud_rates[i];
+      baud = (uint32_t) n * 9600;
+      break;
+    }
+  }
+  if (baud <= old) return;
+
+  if (MGOS_FINGERPRINT_OK !=
+      mgos_fingerprint_set_param(dev, MGOS_FINGERPRINT_PARAM_BAUDRATE, n)) {
+    LOG(LL_WARN, ("Module refused %u baud, staying at %u", baud, old));
+    return;
+  }
+  if (mgos_fingerprint_uart_baud_set(dev, baud) &&
+      MGOS_FINGERPRINT_OK == mgos_fingerprint_verify_password(dev)) {
+    LOG(LL_INFO, ("UART%d raised to %u baud", dev->uart_no, baud));
+    return;
+  }
+
+  LOG(LL_WARN, ("No handshake at %u baud, rolling back to %u", baud, old));
+  // The module did switch but the link is unusable: ask it to go back, even
+  // though its answer may not be readable.
+  mgos_fingerprint_set_param(dev, MGOS_FINGERPRINT_PARAM_BAUDRATE, old_n);
+  mgos_fingerprint_uart_baud_set(dev, old);
+  if (MGOS_FINGERPRINT_OK == mgos_fingerprint_verify_password(dev)) {
+    dev->system_params.baudrate = old_n;
+    return;
+  }
+  LOG(LL_ERROR, ("Lost the module after the baud rate change"));
+}
+
+// Applies the link settings of the config that the module does not have yet.
+// A warm start runs this too: the descriptor cache holds the module's
+// parameters, not the config they were set from, and a change made through
+// set_param() makes the cache write them again.
+static void mgos_fingerprint_link_setup(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_cfg *cfg) {
+  if (cfg->uart_baud_max > dev->uart_baud)
+    mgos_fingerprint_baud_raise(dev, cfg->uart_baud_max);
+  if (cfg->datapacket_length >= MGOS_FINGERPRINT_DATALEN_32 &&
+      cfg->datapacket_length <= MGOS_FINGERPRINT_DATALEN_256 &&
+      cfg->datapacket_length != dev->system_params.datapacket_length) {
+    if (MGOS_FINGERPRINT_OK !=
+        mgos_fingerprint_set_param(dev,
+                                   MGOS_FINGERPRINT_PARAM_DATAPACKET_LENGTH,
+                                   cfg->datapacket_length))
+      LOG(LL_WARN, ("Could not set data packet length, keeping %u bytes",
+                    mgos_fingerprint_data_len(dev)));
+  }
+}
+
+// Asks for an AutoEnroll into a slot that no library has. Firmware that
+// implements it refuses the slot at once, without capturing; older firmware
+// rejects the instruction, or does not answer.
+static bool mgos_fingerprint_auto_probe(struct mgos_fingerprint *dev) {
+  struct mgos_fingerprint_sync s;
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_AUTOENROLL, 0xFF, 0xFF, 0x01, 0x00, 0x00},
+      .len = 6,
+      .timeout_ms = MGOS_FINGERPRINT_PROBE_TIMEOUT,
+      .cb = mgos_fingerprint_sync_cb,
+      .cb_arg = &s};
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  mgos_fingerprint_sync_wait(dev, &s, mgos_fingerprint_submit(dev, &cmd));
+  return s.res.rc == MGOS_FINGERPRINT_FAIL_PAGEID;
 }
 
 struct mgos_fingerprint *mgos_fingerprint_create(
@@ -50,9 +184,23 @@ struct mgos_fingerprint *mgos_fingerprint_create(
   dev->address = cfg->address;
   dev->password = cfg->password;
   dev->uart_no = cfg->uart_no;
+  dev->uart_baud = cfg->uart_baud_rate;
   dev->handler = cfg->handler;
   dev->handler_user_data = cfg->handler_user_data;
   dev->enroll_timeout_secs = cfg->enroll_timeout_secs;
+  dev->search_strategy = cfg->search_strategy;
+  if (cfg->transport) dev->io = *cfg->transport;
+  mgos_fingerprint_timeout_init(dev, cfg);
+  if (!mgos_fingerprint_cache_init(dev, cfg)) goto err;
+  if (!mgos_fingerprint_stats_init(dev, cfg)) goto err;
+  if (!mgos_fingerprint_trace_init(dev, cfg->trace_len)) goto err;
+
+  if (cfg->transport) {
+    if (!mgos_fingerprint_proto_init(dev)) goto err;
+    // The configured rate wins over whatever the transport was opened with.
+    if (dev->io.set_baud) dev->io.set_baud(dev->io.ctx, dev->uart_baud);
+    goto probe;
+  }
 
   // Initialize UART
   mgos_uart_config_set_defaults(dev->uart_no, &ucfg);
@@ -61,21 +209,38 @@ struct mgos_fingerprint *mgos_fingerprint_create(
   ucfg.parity = MGOS_UART_PARITY_NONE;
   ucfg.stop_bits = MGOS_UART_STOP_BITS_1;
   ucfg.rx_buf_size = 512;
-  ucfg.tx_buf_size = 128;
+  ucfg.tx_buf_size = 512;  // a full 256 byte data packet fits
   if (!mgos_uart_configure(dev->uart_no, &ucfg)) goto err;
+  if (!mgos_fingerprint_proto_init(dev)) goto err;
   mgos_uart_set_rx_enabled(dev->uart_no, true);
   LOG(LL_INFO, ("UART%d initialized %u,%d%c%d", dev->uart_no, ucfg.baud_rate,
                 ucfg.num_data_bits,
                 ucfg.parity == MGOS_UART_PARITY_NONE ? 'N' : ucfg.parity + '0',
                 ucfg.stop_bits));
 
+probe:
+  if (mgos_fingerprint_cache_load(dev)) {
+    for (int16_t id = mgos_fingerprint_model_next(dev, -1); id >= 0;
+         id = mgos_fingerprint_model_next(dev, id))
+      num_models++;
+    mgos_fingerprint_link_setup(dev, cfg);
+    goto ready;
+  }
+  if (cfg->uart_baud_autodetect && !mgos_fingerprint_baud_detect(dev))
+    goto err;
   if (MGOS_FINGERPRINT_OK != mgos_fingerprint_verify_password(dev)) goto err;
   if (MGOS_FINGERPRINT_OK != mgos_fingerprint_get_system_params(dev, NULL))
     goto err;
+  mgos_fingerprint_link_setup(dev, cfg);
   if (MGOS_FINGERPRINT_OK != mgos_fingerprint_get_info(dev, NULL)) goto err;
+  dev->auto_supported = mgos_fingerprint_auto_probe(dev);
   if (MGOS_FINGERPRINT_OK != mgos_fingerprint_model_count(dev, &num_models))
     goto err;
+  if (!mgos_fingerprint_index_init(dev)) goto err;
+  if (MGOS_FINGERPRINT_OK != mgos_fingerprint_index_refresh(dev)) goto err;
+  mgos_fingerprint_cache_save(dev);
 
+ready:
   LOG(LL_INFO, ("Initialized module='%.*s' version=%u.%u sensor='%.*s' "
                 "resolution=%ux%u capacity=%u used=%u",
                 16, (char *) &dev->info.module_model, dev->info.hwver >> 8,
@@ -89,140 +254,338 @@ struct mgos_fingerprint *mgos_fingerprint_create(
 
   return dev;
 err:
-  if (dev) free(dev);
+  if (dev) {
+    mgos_fingerprint_cache_deinit(dev);
+    mgos_fingerprint_stats_deinit(dev);
+    mgos_fingerprint_trace_deinit(dev);
+    mgos_fingerprint_proto_deinit(dev);
+    mgos_fingerprint_index_deinit(dev);
+    free(dev);
+  }
   return NULL;
 }
 
 void mgos_fingerprint_destroy(struct mgos_fingerprint **dev) {
-  if (*dev) free((*dev));
+  if (*dev) {
+    mgos_fingerprint_cache_deinit(*dev);
+    mgos_fingerprint_stats_deinit(*dev);
+    mgos_fingerprint_trace_deinit(*dev);
+    mgos_fingerprint_proto_deinit(*dev);
+    mgos_fingerprint_index_deinit(*dev);
+    free((*dev));
+  }
   *dev = NULL;
   return;
 }
 
+int16_t mgos_fingerprint_verify_password_async(struct mgos_fingerprint *dev,
+                                               mgos_fingerprint_cb cb,
+                                               void *cb_arg) {
+  if (!dev) return MGOS_FINGERPRINT_READ_ERROR;
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_VERIFYPASSWORD,
+               (dev->password >> 24) & 0xff, (dev->password >> 16) & 0xff,
+               (dev->password >> 8) & 0xff, dev->password & 0xff},
+      .len = 5,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
+}
+
 int16_t mgos_fingerprint_verify_password(struct mgos_fingerprint *dev) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_VERIFYPASSWORD;
-  dev->packet.data[1] = (dev->password >> 24) & 0xff;
-  dev->packet.data[2] = (dev->password >> 16) & 0xff;
-  dev->packet.data[3] = (dev->password >> 8) & 0xff;
-  dev->packet.data[4] = dev->password & 0xff;
-  dev->packet.len = 5;
+  struct mgos_fingerprint_sync s;
 
-  return mgos_fingerprint_txn(dev);
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_verify_password_async(dev, mgos_fingerprint_sync_cb,
+                                             &s));
+}
+
+static void mgos_fingerprint_set_password_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  dev->password = ((uint32_t) cmd->data[1] << 24) | (cmd->data[2] << 16) |
+                  (cmd->data[3] << 8) | cmd->data[4];
+}
+
+int16_t mgos_fingerprint_set_password_async(struct mgos_fingerprint *dev,
+                                            uint32_t pwd,
+                                            mgos_fingerprint_cb cb,
+                                            void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_SETPASSWORD, (pwd >> 24) & 0xff,
+               (pwd >> 16) & 0xff, (pwd >> 8) & 0xff, pwd & 0xff},
+      .len = 5,
+      .done = mgos_fingerprint_set_password_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_set_password(struct mgos_fingerprint *dev,
                                       uint32_t pwd) {
-  int16_t p;
+  struct mgos_fingerprint_sync s;
 
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_SETPASSWORD;
-  dev->packet.data[1] = (pwd >> 24) & 0xff;
-  dev->packet.data[2] = (pwd >> 16) & 0xff;
-  dev->packet.data[3] = (pwd >> 8) & 0xff;
-  dev->packet.data[4] = pwd & 0xff;
-  dev->packet.len = 5;
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_set_password_async(dev, pwd, mgos_fingerprint_sync_cb,
+                                          &s));
+}
 
-  p = mgos_fingerprint_txn(dev);
-  if (p == MGOS_FINGERPRINT_OK) dev->password = pwd;
-  return p;
+int16_t mgos_fingerprint_image_get_async(struct mgos_fingerprint *dev,
+                                         mgos_fingerprint_cb cb, void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {.data = {MGOS_FINGERPRINT_CMD_GETIMAGE},
+                                     .len = 1,
+                                     .cb = cb,
+                                     .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_image_get(struct mgos_fingerprint *dev) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_GETIMAGE;
-  dev->packet.len = 1;
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_image_get_async(dev, mgos_fingerprint_sync_cb, &s));
+}
 
-  return mgos_fingerprint_txn(dev);
+int16_t mgos_fingerprint_led_on_async(struct mgos_fingerprint *dev,
+                                      mgos_fingerprint_cb cb, void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {.data = {MGOS_FINGERPRINT_CMD_LEDON},
+                                     .len = 1,
+                                     .cb = cb,
+                                     .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_led_on(struct mgos_fingerprint *dev) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_LEDON;
-  dev->packet.len = 1;
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_led_on_async(dev, mgos_fingerprint_sync_cb, &s));
+}
 
-  return mgos_fingerprint_txn(dev);
+int16_t mgos_fingerprint_led_off_async(struct mgos_fingerprint *dev,
+                                       mgos_fingerprint_cb cb, void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {.data = {MGOS_FINGERPRINT_CMD_LEDOFF},
+                                     .len = 1,
+                                     .cb = cb,
+                                     .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_led_off(struct mgos_fingerprint *dev) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_LEDOFF;
-  dev->packet.len = 1;
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_led_off_async(dev, mgos_fingerprint_sync_cb, &s));
+}
 
-  return mgos_fingerprint_txn(dev);
+int16_t mgos_fingerprint_led_aura_async(
+    struct mgos_fingerprint *dev,
+    enum mgos_fingerprint_aura_control control_code, uint8_t speed,
+    enum mgos_fingerprint_aura_color color, uint8_t times,
+    mgos_fingerprint_cb cb, void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_LED_CONTROL, control_code, speed, color,
+               times},
+      .len = 5,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_led_aura(
     struct mgos_fingerprint *dev,
     enum mgos_fingerprint_aura_control control_code, uint8_t speed,
     enum mgos_fingerprint_aura_color color, uint8_t times) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_LED_CONTROL;
-  dev->packet.data[1] = control_code;
-  dev->packet.data[2] = speed;
-  dev->packet.data[3] = color;
-  dev->packet.data[4] = times;
-  dev->packet.len = 5;
+  struct mgos_fingerprint_sync s;
 
-  return mgos_fingerprint_txn(dev);
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_led_aura_async(dev, control_code, speed, color, times,
+                                      mgos_fingerprint_sync_cb, &s));
+}
+
+int16_t mgos_fingerprint_standby_async(struct mgos_fingerprint *dev,
+                                       mgos_fingerprint_cb cb, void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {.data = {MGOS_FINGERPRINT_CMD_STANDBY},
+                                     .len = 1,
+                                     .cb = cb,
+                                     .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_standby(struct mgos_fingerprint *dev) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_STANDBY;
-  dev->packet.len = 1;
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_standby_async(dev, mgos_fingerprint_sync_cb, &s));
+}
 
-  return mgos_fingerprint_txn(dev);
+int16_t mgos_fingerprint_image_genchar_async(struct mgos_fingerprint *dev,
+                                             uint8_t slot,
+                                             mgos_fingerprint_cb cb,
+                                             void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_IMAGE2TZ, slot},
+      .len = 2,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_image_genchar(struct mgos_fingerprint *dev,
                                        uint8_t slot) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_IMAGE2TZ;
-  dev->packet.data[1] = slot;
-  dev->packet.len = 2;
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_image_genchar_async(dev, slot, mgos_fingerprint_sync_cb,
+                                           &s));
+}
 
-  return mgos_fingerprint_txn(dev);
+int16_t mgos_fingerprint_model_combine_async(struct mgos_fingerprint *dev,
+                                             mgos_fingerprint_cb cb,
+                                             void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {.data = {MGOS_FINGERPRINT_CMD_REGMODEL},
+                                     .len = 1,
+                                     .cb = cb,
+                                     .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_model_combine(struct mgos_fingerprint *dev) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_REGMODEL;
-  dev->packet.len = 1;
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_model_combine_async(dev, mgos_fingerprint_sync_cb, &s));
+}
 
-  return mgos_fingerprint_txn(dev);
+static void mgos_fingerprint_model_store_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  mgos_fingerprint_index_set(dev, (cmd->data[2] << 8) | cmd->data[3], 1, true);
+}
+
+int16_t mgos_fingerprint_model_store_async(struct mgos_fingerprint *dev,
+                                           uint16_t id, uint8_t slot,
+                                           mgos_fingerprint_cb cb,
+                                           void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_STORE, slot, id >> 8, id & 0xFF},
+      .len = 4,
+      .done = mgos_fingerprint_model_store_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_model_store(struct mgos_fingerprint *dev, uint16_t id,
                                      uint8_t slot) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_STORE;
-  dev->packet.data[1] = slot;
-  dev->packet.data[2] = id >> 8;
-  dev->packet.data[3] = id & 0xFF;
-  dev->packet.len = 4;
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_model_store_async(dev, id, slot,
+                                         mgos_fingerprint_sync_cb, &s));
+}
 
-  return mgos_fingerprint_txn(dev);
+int16_t mgos_fingerprint_model_load_async(struct mgos_fingerprint *dev,
+                                          uint16_t id, uint8_t slot,
+                                          mgos_fingerprint_cb cb,
+                                          void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_LOAD, slot, id >> 8, id & 0xFF},
+      .len = 4,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_model_load(struct mgos_fingerprint *dev, uint16_t id,
                                     uint8_t slot) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_LOAD;
-  dev->packet.data[1] = slot;
-  dev->packet.data[2] = id >> 8;
-  dev->packet.data[3] = id & 0xFF;
-  dev->packet.len = 4;
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_model_load_async(dev, id, slot,
+                                        mgos_fingerprint_sync_cb, &s));
+}
+
+static void mgos_fingerprint_set_param_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  switch (cmd->data[1]) {
+    case MGOS_FINGERPRINT_PARAM_BAUDRATE:
+      dev->system_params.baudrate = cmd->data[2];
+      break;
+    case MGOS_FINGERPRINT_PARAM_SECURITY_LEVEL:
+      dev->system_params.security_level = cmd->data[2];
+      break;
+    case MGOS_FINGERPRINT_PARAM_DATAPACKET_LENGTH:
+      dev->system_params.datapacket_length = cmd->data[2];
+      break;
+    default:
+      // Unknown to the cache, have it re-read on next use.
+      dev->system_params_valid = false;
+  }
+  mgos_fingerprint_cache_touch(dev);
+}
 
-  return mgos_fingerprint_txn(dev);
+int16_t mgos_fingerprint_set_param_async(struct mgos_fingerprint *dev,
+                                         enum mgos_fingerprint_param param,
+                                         uint8_t value, mgos_fingerprint_cb cb,
+                                         void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_SETSYSPARAM, param, value},
+      .len = 3,
+      .done = mgos_fingerprint_set_param_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_set_param(struct mgos_fingerprint *dev,
                                    enum mgos_fingerprint_param param,
                                    uint8_t value) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_SETSYSPARAM;
-  dev->packet.data[1] = param;
-  dev->packet.data[2] = value;
-  dev->packet.len = 3;
+  struct mgos_fingerprint_sync s;
 
-  return mgos_fingerprint_txn(dev);
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_set_param_async(dev, param, value,
+                                       mgos_fingerprint_sync_cb, &s));
 }
 
 int16_t mgos_fingerprint_get_param(struct mgos_fingerprint *dev,
                                    enum mgos_fingerprint_param param,
                                    uint8_t *value) {
-  int16_t p;
-  p = mgos_fingerprint_get_system_params(dev, NULL);
-  if (p != MGOS_FINGERPRINT_OK) return p;
+  int16_t p = MGOS_FINGERPRINT_OK;
+
+  // Served from the copy read at create time, kept current by set_param().
+  if (!dev->system_params_valid) {
+    p = mgos_fingerprint_get_system_params(dev, NULL);
+    if (p != MGOS_FINGERPRINT_OK) return p;
+  }
 
   switch (param) {
     case MGOS_FINGERPRINT_PARAM_BAUDRATE:
@@ -240,21 +603,16 @@ int16_t mgos_fingerprint_get_param(struct mgos_fingerprint *dev,
   return p;
 }
 
-int16_t mgos_fingerprint_get_system_params(
-    struct mgos_fingerprint *dev,
-    struct mgos_fingerprint_system_params *params) {
-  int16_t p;
-
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_READSYSPARAM;
-  dev->packet.len = 1;
-
-  p = mgos_fingerprint_txn(dev);
-  if (p != MGOS_FINGERPRINT_OK) return p;
-
-  if (dev->packet.len != 19)  // 16 bytes data, 2 cksum, 1 confirm
-    return MGOS_FINGERPRINT_READ_ERROR;
+static void mgos_fingerprint_get_system_params_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  if (res->len != 16) {
+    res->rc = MGOS_FINGERPRINT_READ_ERROR;
+    return;
+  }
 
-  memcpy(&dev->system_params, &dev->packet.data[1], 16);
+  memcpy(&dev->system_params, res->data, 16);
   dev->system_params.status = ntohs(dev->system_params.status);
   dev->system_params.system_id = ntohs(dev->system_params.system_id);
   dev->system_params.library_size = ntohs(dev->system_params.library_size);
@@ -263,6 +621,38 @@ int16_t mgos_fingerprint_get_system_params(
   dev->system_params.datapacket_length =
       ntohs(dev->system_params.datapacket_length);
   dev->system_params.baudrate = ntohs(dev->system_params.baudrate);
+  dev->system_params_valid = true;
+  (void) cmd;
+}
+
+int16_t mgos_fingerprint_get_system_params_async(struct mgos_fingerprint *dev,
+                                                 mgos_fingerprint_cb cb,
+                                                 void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_READSYSPARAM},
+      .len = 1,
+      .done = mgos_fingerprint_get_system_params_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
+}
+
+void mgos_fingerprint_system_params_invalidate(struct mgos_fingerprint *dev) {
+  if (dev) dev->system_params_valid = false;
+}
+
+int16_t mgos_fingerprint_get_system_params(
+    struct mgos_fingerprint *dev,
+    struct mgos_fingerprint_system_params *params) {
+  struct mgos_fingerprint_sync s;
+  int16_t p;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  p = mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_get_system_params_async(dev, mgos_fingerprint_sync_cb,
+                                               &s));
+  if (p != MGOS_FINGERPRINT_OK) return p;
 
   if (params)
     memcpy(params, &dev->system_params,
@@ -270,283 +660,805 @@ int16_t mgos_fingerprint_get_system_params(
   return MGOS_FINGERPRINT_OK;
 }
 
-int16_t mgos_fingerprint_get_info(struct mgos_fingerprint *dev,
-                                  struct mgos_fingerprint_info *info) {
-  int16_t p;
-
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_READPRODINFO;
-  dev->packet.len = 1;
-
-  p = mgos_fingerprint_txn(dev);
-  if (p != MGOS_FINGERPRINT_OK) return p;
-  if (dev->packet.len != 49) return MGOS_FINGERPRINT_READ_ERROR;
+static void mgos_fingerprint_get_info_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  if (res->len != 46) {
+    res->rc = MGOS_FINGERPRINT_READ_ERROR;
+    return;
+  }
 
-  memcpy(&dev->info, &dev->packet.data[1], 46);
+  memcpy(&dev->info, res->data, 46);
   dev->info.hwver = ntohs(dev->info.hwver);
   dev->info.sensor_width = ntohs(dev->info.sensor_width);
   dev->info.sensor_height = ntohs(dev->info.sensor_height);
   dev->info.model_size = ntohs(dev->info.model_size);
   dev->info.model_capacity = ntohs(dev->info.model_capacity);
+  (void) cmd;
+}
+
+int16_t mgos_fingerprint_get_info_async(struct mgos_fingerprint *dev,
+                                        mgos_fingerprint_cb cb, void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_READPRODINFO},
+      .len = 1,
+      .done = mgos_fingerprint_get_info_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
+}
+
+int16_t mgos_fingerprint_get_info(struct mgos_fingerprint *dev,
+                                  struct mgos_fingerprint_info *info) {
+  struct mgos_fingerprint_sync s;
+  int16_t p;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  p = mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_get_info_async(dev, mgos_fingerprint_sync_cb, &s));
+  if (p != MGOS_FINGERPRINT_OK) return p;
 
   if (info) memcpy(info, &dev->info, sizeof(struct mgos_fingerprint_info));
 
   return MGOS_FINGERPRINT_OK;
 }
 
+static bool mgos_fingerprint_discard_sink(const uint8_t *chunk, size_t len,
+                                          void *ud) {
+  (void) chunk;
+  (void) len;
+  (void) ud;
+  return true;
+}
+
+int16_t mgos_fingerprint_image_download_stream_async(
+    struct mgos_fingerprint *dev, mgos_fingerprint_data_sink sink, void *ud,
+    mgos_fingerprint_cb cb, void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_IMGUPLOAD},
+      .len = 1,
+      .cb = cb,
+      .cb_arg = cb_arg,
+      .sink = sink ? sink : mgos_fingerprint_discard_sink,
+      .stream_arg = ud};
+  return mgos_fingerprint_submit(dev, &cmd);
+}
+
+int16_t mgos_fingerprint_image_download_stream(struct mgos_fingerprint *dev,
+                                               mgos_fingerprint_data_sink sink,
+                                               void *ud) {
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_image_download_stream_async(
+          dev, sink, ud, mgos_fingerprint_sync_cb, &s));
+}
+
+static bool mgos_fingerprint_file_sink(const uint8_t *chunk, size_t len,
+                                       void *ud) {
+  return fwrite(chunk, 1, len, (FILE *) ud) == len;
+}
+
+int16_t mgos_fingerprint_image_download_file(struct mgos_fingerprint *dev,
+                                             const char *path) {
+  FILE *fp;
+  int16_t p;
+
+  if (!dev || !path) return MGOS_FINGERPRINT_READ_ERROR;
+  if (!(fp = fopen(path, "wb"))) {
+    LOG(LL_ERROR, ("Could not open %s", path));
+    return MGOS_FINGERPRINT_READ_ERROR;
+  }
+  p = mgos_fingerprint_image_download_stream(dev, mgos_fingerprint_file_sink,
+                                             fp);
+  if (fclose(fp) != 0 && p == MGOS_FINGERPRINT_OK)
+    p = MGOS_FINGERPRINT_ABORTED;
+  return p;
+}
+
+// Without a sink the image is read and dropped, which leaves the UART clean.
+int16_t mgos_fingerprint_image_download_async(struct mgos_fingerprint *dev,
+                                              mgos_fingerprint_cb cb,
+                                              void *cb_arg) {
+  return mgos_fingerprint_image_download_stream_async(dev, NULL, NULL, cb,
+                                                      cb_arg);
+}
+
 int16_t mgos_fingerprint_image_download(struct mgos_fingerprint *dev) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_IMGUPLOAD;
-  dev->packet.len = 1;
+  return mgos_fingerprint_image_download_stream(dev, NULL, NULL);
+}
+
+int16_t mgos_fingerprint_model_download_stream_async(
+    struct mgos_fingerprint *dev, uint8_t slot, mgos_fingerprint_data_sink sink,
+    void *ud, mgos_fingerprint_cb cb, void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_UPCHAR, slot},
+      .len = 2,
+      .cb = cb,
+      .cb_arg = cb_arg,
+      .sink = sink ? sink : mgos_fingerprint_discard_sink,
+      .stream_arg = ud};
+  return mgos_fingerprint_submit(dev, &cmd);
+}
+
+int16_t mgos_fingerprint_model_download_stream(struct mgos_fingerprint *dev,
+                                               uint8_t slot,
+                                               mgos_fingerprint_data_sink sink,
+                                               void *ud) {
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_model_download_stream_async(
+          dev, slot, sink, ud, mgos_fingerprint_sync_cb, &s));
+}
+
+struct mgos_fingerprint_buf {
+  uint8_t *data;
+  size_t size;
+  size_t len;
+};
+
+static bool mgos_fingerprint_buf_sink(const uint8_t *chunk, size_t len,
+                                      void *ud) {
+  struct mgos_fingerprint_buf *b = (struct mgos_fingerprint_buf *) ud;
+
+  if (b->len + len > b->size) return false;
+  memcpy(b->data + b->len, chunk, len);
+  b->len += len;
+  return true;
+}
 
-  return mgos_fingerprint_txn(dev);
+static bool mgos_fingerprint_buf_source(uint8_t *chunk, size_t len, void *ud) {
+  struct mgos_fingerprint_buf *b = (struct mgos_fingerprint_buf *) ud;
+
+  if (b->len + len > b->size) return false;
+  memcpy(chunk, b->data + b->len, len);
+  b->len += len;
+  return true;
+}
+
+int16_t mgos_fingerprint_model_download_buf(struct mgos_fingerprint *dev,
+                                            uint8_t slot, uint8_t *buf,
+                                            size_t size, size_t *len) {
+  struct mgos_fingerprint_buf b = {.data = buf, .size = size, .len = 0};
+  int16_t p;
+
+  if (!buf) return MGOS_FINGERPRINT_READ_ERROR;
+  p = mgos_fingerprint_model_download_stream(dev, slot,
+                                             mgos_fingerprint_buf_sink, &b);
+  if (len) *len = b.len;
+  return p;
+}
+
+// Without a sink the template is read and dropped.
+int16_t mgos_fingerprint_model_download_async(struct mgos_fingerprint *dev,
+                                              uint8_t slot,
+                                              mgos_fingerprint_cb cb,
+                                              void *cb_arg) {
+  return mgos_fingerprint_model_download_stream_async(dev, slot, NULL, NULL, cb,
+                                                      cb_arg);
 }
 
 int16_t mgos_fingerprint_model_download(struct mgos_fingerprint *dev,
                                         uint8_t slot) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_UPCHAR;
-  dev->packet.data[1] = slot;
-  dev->packet.len = 2;
+  return mgos_fingerprint_model_download_stream(dev, slot, NULL, NULL);
+}
+
+int16_t mgos_fingerprint_model_upload_stream_async(
+    struct mgos_fingerprint *dev, uint8_t slot,
+    mgos_fingerprint_data_source source, void *ud, size_t len,
+    mgos_fingerprint_cb cb, void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_DOWNCHAR, slot},
+      .len = 2,
+      .cb = cb,
+      .cb_arg = cb_arg,
+      .source = source,
+      .stream_arg = ud,
+      .stream_len = len};
+  if (!dev) return MGOS_FINGERPRINT_READ_ERROR;
+  if (source && len == 0) cmd.stream_len = dev->info.model_size;
+  return mgos_fingerprint_submit(dev, &cmd);
+}
+
+int16_t mgos_fingerprint_model_upload_stream(
+    struct mgos_fingerprint *dev, uint8_t slot,
+    mgos_fingerprint_data_source source, void *ud, size_t len) {
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_model_upload_stream_async(
+          dev, slot, source, ud, len, mgos_fingerprint_sync_cb, &s));
+}
+
+int16_t mgos_fingerprint_model_upload_buf(struct mgos_fingerprint *dev,
+                                          uint8_t slot, const uint8_t *buf,
+                                          size_t len) {
+  struct mgos_fingerprint_buf b = {
+      .data = (uint8_t *) buf, .size = len, .len = 0};
 
-  return mgos_fingerprint_txn(dev);
+  if (!buf || len == 0) return MGOS_FINGERPRINT_READ_ERROR;
+  return mgos_fingerprint_model_upload_stream(
+      dev, slot, mgos_fingerprint_buf_source, &b, len);
+}
+
+int16_t mgos_fingerprint_model_upload_async(struct mgos_fingerprint *dev,
+                                            uint8_t slot,
+                                            mgos_fingerprint_cb cb,
+                                            void *cb_arg) {
+  return mgos_fingerprint_model_upload_stream_async(dev, slot, NULL, NULL, 0,
+                                                    cb, cb_arg);
 }
 
 int16_t mgos_fingerprint_model_upload(struct mgos_fingerprint *dev,
                                       uint8_t slot) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_DOWNCHAR;
-  dev->packet.data[1] = slot;
-  dev->packet.len = 2;
+  return mgos_fingerprint_model_upload_stream(dev, slot, NULL, NULL, 0);
+}
+
+static void mgos_fingerprint_model_delete_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  mgos_fingerprint_index_set(dev, (cmd->data[1] << 8) | cmd->data[2],
+                             (cmd->data[3] << 8) | cmd->data[4], false);
+}
 
-  return mgos_fingerprint_txn(dev);
+int16_t mgos_fingerprint_model_delete_async(struct mgos_fingerprint *dev,
+                                            uint16_t id, uint16_t how_many,
+                                            mgos_fingerprint_cb cb,
+                                            void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_DELETE, id >> 8, id & 0xFF, how_many >> 8,
+               how_many & 0xFF},
+      .len = 5,
+      .done = mgos_fingerprint_model_delete_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_model_delete(struct mgos_fingerprint *dev, uint16_t id,
                                       uint16_t how_many) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_DELETE;
-  dev->packet.data[1] = id >> 8;
-  dev->packet.data[2] = id & 0xFF;
-  dev->packet.data[3] = how_many >> 8;
-  dev->packet.data[4] = how_many & 0xFF;
-  dev->packet.len = 5;
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_model_delete_async(dev, id, how_many,
+                                          mgos_fingerprint_sync_cb, &s));
+}
+
+static void mgos_fingerprint_database_erase_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  mgos_fingerprint_index_clear(dev);
+  (void) cmd;
+}
 
-  return mgos_fingerprint_txn(dev);
+int16_t mgos_fingerprint_database_erase_async(struct mgos_fingerprint *dev,
+                                              mgos_fingerprint_cb cb,
+                                              void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_EMPTYDATABASE},
+      .len = 1,
+      .done = mgos_fingerprint_database_erase_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_database_erase(struct mgos_fingerprint *dev) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_EMPTYDATABASE;
-  dev->packet.len = 1;
+  struct mgos_fingerprint_sync s;
 
-  return mgos_fingerprint_txn(dev);
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_database_erase_async(dev, mgos_fingerprint_sync_cb,
+                                            &s));
+}
+
+static void mgos_fingerprint_database_search_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  int flavour = cmd->data[0] == MGOS_FINGERPRINT_CMD_HISPEEDSEARCH;
+
+  // A module without high speed search answers with an error; in auto mode
+  // retry as a normal search and keep the caller none the wiser. The retry
+  // goes ahead of the queue: commands submitted after the search, say a
+  // delete of the slot it finds, must still run after it. A receive error
+  // can also be one noisy frame, so only a run of them gives up on the
+  // instruction.
+  if (flavour && (res->rc == MGOS_FINGERPRINT_PACKETRECIEVEERR ||
+                  res->rc == MGOS_FINGERPRINT_FAIL_INVALIDREG)) {
+    struct mgos_fingerprint_cmd retry = *cmd;
+
+    if (res->rc == MGOS_FINGERPRINT_FAIL_INVALIDREG ||
+        ++dev->hispeed_errors >= MGOS_FINGERPRINT_HISPEED_ERRORS) {
+      LOG(LL_WARN, ("Module rejected high speed search, falling back"));
+      dev->hispeed_unsupported = true;
+    }
+    retry.data[0] = MGOS_FINGERPRINT_CMD_SEARCH;
+    if (dev->search_strategy == MGOS_FINGERPRINT_SEARCH_AUTO &&
+        MGOS_FINGERPRINT_OK == mgos_fingerprint_submit_next(dev, &retry))
+      cmd->cb = NULL;
+    return;
+  }
+
+  // Both a hit and a miss searched the whole library: that is the latency
+  // we are interested in.
+  if (res->rc == MGOS_FINGERPRINT_OK || res->rc == MGOS_FINGERPRINT_NOTFOUND) {
+    if (flavour) dev->hispeed_errors = 0;
+    uint32_t us = (uint32_t)(mgos_uptime_micros() - dev->cmd_sent_us);
+    if (dev->search_samples[flavour]++ == 0)
+      dev->search_avg_us[flavour] = us;
+    else
+      dev->search_avg_us[flavour] +=
+          ((int32_t) us - (int32_t) dev->search_avg_us[flavour]) / 4;
+    if (dev->search_samples[flavour] > MGOS_FINGERPRINT_SEARCH_PROBES)
+      dev->search_samples[flavour] = MGOS_FINGERPRINT_SEARCH_PROBES;
+  }
+
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  if (res->len != 4) {
+    res->rc = MGOS_FINGERPRINT_READ_ERROR;
+    return;
+  }
+
+  res->finger_id = (res->data[0] << 8) | res->data[1];
+  res->score = (res->data[2] << 8) | res->data[3];
+}
+
+static int16_t mgos_fingerprint_search_submit(struct mgos_fingerprint *dev,
+                                              uint8_t instruction, uint8_t slot,
+                                              mgos_fingerprint_cb cb,
+                                              void *cb_arg) {
+  if (!dev) return MGOS_FINGERPRINT_READ_ERROR;
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {instruction, slot, 0x00, 0x00,
+               (uint8_t)(dev->system_params.library_size >> 8),
+               (uint8_t)(dev->system_params.library_size & 0xFF)},
+      .len = 6,
+      .done = mgos_fingerprint_database_search_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
+}
+
+// Auto mode samples each flavour a few times, then sticks with the one that
+// has the lower running average on this module.
+static uint8_t mgos_fingerprint_search_instruction(
+    struct mgos_fingerprint *dev) {
+  switch (dev->search_strategy) {
+    case MGOS_FINGERPRINT_SEARCH_HISPEED:
+      return MGOS_FINGERPRINT_CMD_HISPEEDSEARCH;
+    case MGOS_FINGERPRINT_SEARCH_AUTO:
+      if (dev->hispeed_unsupported) return MGOS_FINGERPRINT_CMD_SEARCH;
+      if (dev->search_samples[1] < MGOS_FINGERPRINT_SEARCH_PROBES ||
+          dev->search_samples[0] < MGOS_FINGERPRINT_SEARCH_PROBES)
+        return dev->search_samples[1] <= dev->search_samples[0]
+                   ? MGOS_FINGERPRINT_CMD_HISPEEDSEARCH
+                   : MGOS_FINGERPRINT_CMD_SEARCH;
+      return dev->search_avg_us[1] < dev->search_avg_us[0]
+                 ? MGOS_FINGERPRINT_CMD_HISPEEDSEARCH
+                 : MGOS_FINGERPRINT_CMD_SEARCH;
+    default:
+      return MGOS_FINGERPRINT_CMD_SEARCH;
+  }
+}
+
+int16_t mgos_fingerprint_database_search_async(struct mgos_fingerprint *dev,
+                                               uint8_t slot,
+                                               mgos_fingerprint_cb cb,
+                                               void *cb_arg) {
+  if (!dev) return MGOS_FINGERPRINT_READ_ERROR;
+  return mgos_fingerprint_search_submit(
+      dev, mgos_fingerprint_search_instruction(dev), slot, cb, cb_arg);
+}
+
+int16_t mgos_fingerprint_database_search_hispeed_async(
+    struct mgos_fingerprint *dev, uint8_t slot, mgos_fingerprint_cb cb,
+    void *cb_arg) {
+  return mgos_fingerprint_search_submit(
+      dev, MGOS_FINGERPRINT_CMD_HISPEEDSEARCH, slot, cb, cb_arg);
 }
 
 int16_t mgos_fingerprint_database_search(struct mgos_fingerprint *dev,
                                          uint16_t *finger_id, uint16_t *score,
                                          uint8_t slot) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_SEARCH;
-  dev->packet.data[1] = slot;
-  dev->packet.data[2] = 0x00;
-  dev->packet.data[3] = 0x00;
-  dev->packet.data[4] = (uint8_t)(dev->system_params.library_size >> 8);
-  dev->packet.data[5] = (uint8_t)(dev->system_params.library_size & 0xFF);
-  dev->packet.len = 6;
+  struct mgos_fingerprint_sync s;
+  int16_t p;
 
-  int16_t p = mgos_fingerprint_txn(dev);
+  mgos_fingerprint_sync_begin(dev, &s);
+  p = mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_database_search_async(dev, slot,
+                                             mgos_fingerprint_sync_cb, &s));
+  if (p != MGOS_FINGERPRINT_OK) return p;
 
-  if (p != MGOS_FINGERPRINT_OK) return dev->packet.data[0];
+  *finger_id = s.res.finger_id;
+  *score = s.res.score;
+  return p;
+}
+
+int16_t mgos_fingerprint_database_search_hispeed(struct mgos_fingerprint *dev,
+                                                 uint16_t *finger_id,
+                                                 uint16_t *score,
+                                                 uint8_t slot) {
+  struct mgos_fingerprint_sync s;
+  int16_t p;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  p = mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_database_search_hispeed_async(
+          dev, slot, mgos_fingerprint_sync_cb, &s));
+  if (p != MGOS_FINGERPRINT_OK) return p;
 
-  if (dev->packet.len != 7) return MGOS_FINGERPRINT_READ_ERROR;
+  *finger_id = s.res.finger_id;
+  *score = s.res.score;
+  return p;
+}
 
-  *finger_id = dev->packet.data[1];
-  *finger_id <<= 8;
-  *finger_id |= dev->packet.data[2];
+static void mgos_fingerprint_model_matchpair_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  if (res->len != 2) {
+    res->rc = MGOS_FINGERPRINT_READ_ERROR;
+    return;
+  }
 
-  *score = dev->packet.data[3];
-  *score <<= 8;
-  *score |= dev->packet.data[4];
+  res->score = (res->data[0] << 8) | res->data[1];
+  (void) dev;
+  (void) cmd;
+}
 
-  return dev->packet.data[0];
+int16_t mgos_fingerprint_model_matchpair_async(struct mgos_fingerprint *dev,
+                                               mgos_fingerprint_cb cb,
+                                               void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_PAIRMATCH},
+      .len = 1,
+      .done = mgos_fingerprint_model_matchpair_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_model_matchpair(struct mgos_fingerprint *dev,
                                          uint16_t *score) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_PAIRMATCH;
-  dev->packet.len = 1;
-
-  if (MGOS_FINGERPRINT_OK != mgos_fingerprint_txn(dev))
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  if (MGOS_FINGERPRINT_OK !=
+      mgos_fingerprint_sync_wait(
+          dev, &s,
+          mgos_fingerprint_model_matchpair_async(dev, mgos_fingerprint_sync_cb,
+                                                 &s)))
     return MGOS_FINGERPRINT_READ_ERROR;
 
-  if (dev->packet.len != 5) return MGOS_FINGERPRINT_READ_ERROR;
+  *score = s.res.score;
+  return s.res.rc;
+}
+
+static void mgos_fingerprint_model_count_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  if (res->len != 2) {
+    res->rc = MGOS_FINGERPRINT_READ_ERROR;
+    return;
+  }
+
+  res->count = (res->data[0] << 8) | res->data[1];
+  (void) dev;
+  (void) cmd;
+}
 
-  *score = dev->packet.data[1];
-  *score <<= 8;
-  *score |= dev->packet.data[2];
-  return dev->packet.data[0];
+int16_t mgos_fingerprint_model_count_async(struct mgos_fingerprint *dev,
+                                           mgos_fingerprint_cb cb,
+                                           void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_TEMPLATECOUNT},
+      .len = 1,
+      .done = mgos_fingerprint_model_count_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_model_count(struct mgos_fingerprint *dev,
                                      uint16_t *model_count) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_TEMPLATECOUNT;
-  dev->packet.len = 1;
-
-  if (MGOS_FINGERPRINT_OK != mgos_fingerprint_txn(dev))
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  if (MGOS_FINGERPRINT_OK !=
+      mgos_fingerprint_sync_wait(
+          dev, &s,
+          mgos_fingerprint_model_count_async(dev, mgos_fingerprint_sync_cb,
+                                             &s)))
     return MGOS_FINGERPRINT_READ_ERROR;
 
-  if (dev->packet.len != 5) return MGOS_FINGERPRINT_READ_ERROR;
-  *model_count = dev->packet.data[1];
-  *model_count <<= 8;
-  *model_count |= dev->packet.data[2];
-
-  return dev->packet.data[0];
+  *model_count = s.res.count;
+  return s.res.rc;
 }
 
-int16_t mgos_fingerprint_get_free_id(struct mgos_fingerprint *dev,
-                                     int16_t *id) {
-  int16_t p = -1;
-
-  for (int page = 0; page < (dev->system_params.library_size /
-                             MGOS_FINGERPRINT_TEMPLATES_PER_PAGE) +
-                                1;
-       page++) {
-    p = mgos_fingerprint_get_free_page_id(dev, page, id);
-    if (p != MGOS_FINGERPRINT_OK) return MGOS_FINGERPRINT_READ_ERROR;
-    if (*id != MGOS_FINGERPRINT_NOFREEINDEX) return MGOS_FINGERPRINT_OK;
-  }
-  return MGOS_FINGERPRINT_NOFREEINDEX;
+static void mgos_fingerprint_model_index_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  mgos_fingerprint_index_load_page(dev, cmd->data[1], res->data, res->len);
 }
 
-static int16_t mgos_fingerprint_get_free_page_id(struct mgos_fingerprint *dev,
-                                                 uint8_t page, int16_t *id) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_READTEMPLATEINDEX;
-  dev->packet.data[1] = page;
-  dev->packet.len = 2;
+int16_t mgos_fingerprint_model_index_async(struct mgos_fingerprint *dev,
+                                           uint8_t page, mgos_fingerprint_cb cb,
+                                           void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_READTEMPLATEINDEX, page},
+      .len = 2,
+      .done = mgos_fingerprint_model_index_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
+}
 
-  if (MGOS_FINGERPRINT_OK != mgos_fingerprint_txn(dev))
+int16_t mgos_fingerprint_get_free_id(struct mgos_fingerprint *dev,
+                                     int16_t *id) {
+  if (!dev->index_valid &&
+      MGOS_FINGERPRINT_OK != mgos_fingerprint_index_refresh(dev))
     return MGOS_FINGERPRINT_READ_ERROR;
 
-  for (int group_idx = 0; group_idx < dev->packet.len - 3; group_idx++) {
-    uint8_t group = dev->packet.data[1 + group_idx];
+  *id = mgos_fingerprint_index_first_free(dev);
+  if (*id == MGOS_FINGERPRINT_NOFREEINDEX) return MGOS_FINGERPRINT_NOFREEINDEX;
+  return MGOS_FINGERPRINT_OK;
+}
+
+// Returns the first free template id in an index page bitmap as read by
+// mgos_fingerprint_model_index_async(), or MGOS_FINGERPRINT_NOFREEINDEX.
+int16_t mgos_fingerprint_index_page_free_id(uint8_t page, const uint8_t *bitmap,
+                                            uint16_t len) {
+  for (int group_idx = 0; group_idx < len; group_idx++) {
+    uint8_t group = bitmap[group_idx];
     if (group == 0xff) /* if group is all occupied */
       continue;
 
     for (uint8_t bit_mask = 0x01, fid = 0; bit_mask != 0;
          bit_mask <<= 1, fid++) {
       if ((bit_mask & group) == 0) {
-        *id = (MGOS_FINGERPRINT_TEMPLATES_PER_PAGE * page) + (group_idx * 8) +
-              fid;
-        return dev->packet.data[0];
+        return (MGOS_FINGERPRINT_TEMPLATES_PER_PAGE * page) + (group_idx * 8) +
+               fid;
       }
     }
   }
 
-  *id = MGOS_FINGERPRINT_NOFREEINDEX;  // no free space found
-  return dev->packet.data[0];
+  return MGOS_FINGERPRINT_NOFREEINDEX;  // no free space found
+}
+
+static void mgos_fingerprint_get_random_number_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) return;
+  if (res->len != 4) {
+    res->rc = MGOS_FINGERPRINT_READ_ERROR;
+    return;
+  }
+
+  res->number = ((uint32_t) res->data[0] << 24) | (res->data[1] << 16) |
+                (res->data[2] << 8) | res->data[3];
+  (void) dev;
+  (void) cmd;
+}
+
+int16_t mgos_fingerprint_get_random_number_async(struct mgos_fingerprint *dev,
+                                                 mgos_fingerprint_cb cb,
+                                                 void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_GETRANDOM},
+      .len = 1,
+      .done = mgos_fingerprint_get_random_number_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_get_random_number(struct mgos_fingerprint *dev,
                                            uint32_t *number) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_GETRANDOM;
-  dev->packet.len = 1;
+  struct mgos_fingerprint_sync s;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  if (MGOS_FINGERPRINT_OK !=
+      mgos_fingerprint_sync_wait(
+          dev, &s,
+          mgos_fingerprint_get_random_number_async(
+              dev, mgos_fingerprint_sync_cb, &s)))
+    return MGOS_FINGERPRINT_READ_ERROR;
+
+  *number = s.res.number;
+  return s.res.rc;
+}
+
+static void mgos_fingerprint_notepad_read_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc == MGOS_FINGERPRINT_OK &&
+      res->len < MGOS_FINGERPRINT_NOTEPAD_SIZE)
+    res->rc = MGOS_FINGERPRINT_READ_ERROR;
+  (void) dev;
+  (void) cmd;
+}
+
+int16_t mgos_fingerprint_notepad_read_async(struct mgos_fingerprint *dev,
+                                            uint8_t page,
+                                            mgos_fingerprint_cb cb,
+                                            void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_READNOTEPAD, page},
+      .len = 2,
+      .done = mgos_fingerprint_notepad_read_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  if (page >= MGOS_FINGERPRINT_NOTEPAD_PAGES)
+    return MGOS_FINGERPRINT_READ_ERROR;
+  return mgos_fingerprint_submit(dev, &cmd);
+}
+
+int16_t mgos_fingerprint_notepad_read(struct mgos_fingerprint *dev,
+                                      uint8_t page, uint8_t *buf) {
+  struct mgos_fingerprint_sync s;
+  int16_t p;
+
+  mgos_fingerprint_sync_begin(dev, &s);
+  p = mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_notepad_read_async(dev, page, mgos_fingerprint_sync_cb,
+                                          &s));
+  if (p == MGOS_FINGERPRINT_OK)
+    memcpy(buf, s.res.data, MGOS_FINGERPRINT_NOTEPAD_SIZE);
+  return p;
+}
 
-  if (MGOS_FINGERPRINT_OK != mgos_fingerprint_txn(dev))
+int16_t mgos_fingerprint_notepad_write_async(struct mgos_fingerprint *dev,
+                                             uint8_t page, const uint8_t *buf,
+                                             mgos_fingerprint_cb cb,
+                                             void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_WRITENOTEPAD, page},
+      .len = 2 + MGOS_FINGERPRINT_NOTEPAD_SIZE,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  if (page >= MGOS_FINGERPRINT_NOTEPAD_PAGES || !buf)
     return MGOS_FINGERPRINT_READ_ERROR;
+  memcpy(&cmd.data[2], buf, MGOS_FINGERPRINT_NOTEPAD_SIZE);
+  return mgos_fingerprint_submit(dev, &cmd);
+}
 
-  if (dev->packet.len != 7) return MGOS_FINGERPRINT_READ_ERROR;
+int16_t mgos_fingerprint_notepad_write(struct mgos_fingerprint *dev,
+                                       uint8_t page, const uint8_t *buf) {
+  struct mgos_fingerprint_sync s;
 
-  *number = dev->packet.data[1];
-  *number <<= 8;
-  *number |= dev->packet.data[2];
-  *number <<= 8;
-  *number |= dev->packet.data[3];
-  *number <<= 8;
-  *number |= dev->packet.data[4];
+  mgos_fingerprint_sync_begin(dev, &s);
+  return mgos_fingerprint_sync_wait(
+      dev, &s,
+      mgos_fingerprint_notepad_write_async(dev, page, buf,
+                                           mgos_fingerprint_sync_cb, &s));
+}
 
-  return dev->packet.data[0];
+int16_t mgos_fingerprint_handshake_async(struct mgos_fingerprint *dev,
+                                         mgos_fingerprint_cb cb, void *cb_arg) {
+  struct mgos_fingerprint_cmd cmd = {.data = {MGOS_FINGERPRINT_CMD_HANDSHAKE},
+                                     .len = 1,
+                                     .cb = cb,
+                                     .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 int16_t mgos_fingerprint_handshake(struct mgos_fingerprint *dev) {
-  dev->packet.data[0] = MGOS_FINGERPRINT_CMD_HANDSHAKE;
-  dev->packet.len = 1;
+  struct mgos_fingerprint_sync s;
 
-  if (MGOS_FINGERPRINT_OK != mgos_fingerprint_txn(dev))
+  mgos_fingerprint_sync_begin(dev, &s);
+  if (MGOS_FINGERPRINT_OK !=
+      mgos_fingerprint_sync_wait(
+          dev, &s,
+          mgos_fingerprint_handshake_async(dev, mgos_fingerprint_sync_cb, &s)))
     return MGOS_FINGERPRINT_READ_ERROR;
-  return dev->packet.data[0] == MGOS_FINGERPRINT_HANDSHAKE_OK;
+  return s.res.rc == MGOS_FINGERPRINT_HANDSHAKE_OK;
 }
 
-static void write_packet(struct mgos_fingerprint *dev, uint8_t packettype,
-                         uint16_t datalen) {
-  if (datalen > sizeof(dev->packet.data) - 2) return;
+bool mgos_fingerprint_auto_supported(struct mgos_fingerprint *dev) {
+  return dev && dev->auto_supported;
+}
 
-  dev->packet.startcode = htons(MGOS_FINGERPRINT_STARTCODE);
-  dev->packet.address = htonl(dev->address);
-  dev->packet.packettype = packettype;
-  dev->packet.len = htons(datalen + 2);  // 2 bytes checksum
+// Older firmware of the same module family answers an unknown instruction
+// with this; remember it so that callers fall back for good. A receive error
+// is left alone: it is more likely a noisy frame than a module that create()
+// found to know the instruction.
+static void mgos_fingerprint_auto_check_rc(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_result *res) {
+  if (res->rc == MGOS_FINGERPRINT_FAIL_INVALIDREG) {
+    LOG(LL_WARN, ("Module rejected auto command 0x%02x, falling back",
+                  res->cmd));
+    dev->auto_supported = false;
+  }
+}
 
-  uint16_t sum = (datalen + 2) + packettype;
-  for (uint8_t i = 0; i < datalen; i++) {
-    sum += dev->packet.data[i];
+static void mgos_fingerprint_auto_identify_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  if (res->rc != MGOS_FINGERPRINT_OK) {
+    mgos_fingerprint_auto_check_rc(dev, res);
+    return;
   }
-  dev->packet.data[datalen] = sum >> 8;
-  dev->packet.data[datalen + 1] = sum & 0xFF;
-  mgos_uart_write(dev->uart_no, (uint8_t *) &dev->packet, 9 + datalen + 2);
-  mgos_uart_flush(dev->uart_no);
-}
-
-static int16_t read_packet(struct mgos_fingerprint *dev) {
-  uint16_t want_bytes = 9;
-  uint16_t have_bytes = 0;
-  struct timeval start, now;
-
-  gettimeofday(&start, NULL);
-  gettimeofday(&now, NULL);
-
-  while (((now.tv_sec - start.tv_sec) * 1e3 +
-          (now.tv_usec - start.tv_usec) / 1e3) <
-         MGOS_FINGERPRINT_DEFAULT_TIMEOUT) {
-    ssize_t n;
-
-    gettimeofday(&now, NULL);
-    n = mgos_uart_read(dev->uart_no, ((uint8_t *) &dev->packet) + have_bytes,
-                       want_bytes - have_bytes);
-    if (n < 0) return MGOS_FINGERPRINT_PACKETRECIEVEERR;
-    have_bytes += n;
-    if (have_bytes < 9) {
-      // Header not yet fully received.
-      continue;
-    }
-    if (have_bytes - n < 9 && have_bytes >= 9) {
-      dev->packet.startcode = ntohs(dev->packet.startcode);
-      dev->packet.address = ntohl(dev->packet.address);
-      dev->packet.len = ntohs(dev->packet.len);
-      want_bytes = dev->packet.len + 9;
-    }
-    if (have_bytes == dev->packet.len + 9) {
-      uint16_t sum = dev->packet.len + dev->packet.packettype;
-      for (uint16_t i = 0; i < dev->packet.len - 2; i++)
-        sum += dev->packet.data[i];
-      if (dev->packet.data[dev->packet.len - 2] != sum >> 8 ||
-          dev->packet.data[dev->packet.len - 1] != (sum & 0xFF)) {
-        // Checksum error
-        return MGOS_FINGERPRINT_PACKETRECIEVEERR;
-      }
-      // Packet complete, ship it!
-      return dev->packet.len - 2;
-    }
+  if (res->len < 5) {
+    res->rc = MGOS_FINGERPRINT_READ_ERROR;
+    return;
   }
 
-  return MGOS_FINGERPRINT_TIMEOUT;
+  res->step = res->data[0];
+  res->finger_id = (res->data[1] << 8) | res->data[2];
+  res->score = (res->data[3] << 8) | res->data[4];
+  res->more = res->step != MGOS_FINGERPRINT_AUTO_SEARCH;
+  (void) cmd;
 }
 
-static int16_t mgos_fingerprint_txn(struct mgos_fingerprint *dev) {
-  int16_t rc;
-
-  write_packet(dev, MGOS_FINGERPRINT_COMMANDPACKET, dev->packet.len);
-
-  rc = read_packet(dev);
-  if (rc < 0) return rc;
+int16_t mgos_fingerprint_auto_identify_async(struct mgos_fingerprint *dev,
+                                             mgos_fingerprint_cb cb,
+                                             void *cb_arg) {
+  if (!dev) return MGOS_FINGERPRINT_READ_ERROR;
+  // Security level, start id, number of ids, flags (report every step), and
+  // number of capture attempts.
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_AUTOIDENTIFY,
+               (uint8_t) dev->system_params.security_level, 0x00, 0x00,
+               (uint8_t)(dev->system_params.library_size >> 8),
+               (uint8_t)(dev->system_params.library_size & 0xFF), 0x00, 0x00,
+               0x01},
+      .len = 9,
+      .done = mgos_fingerprint_auto_identify_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
+}
 
-  if (dev->packet.packettype != MGOS_FINGERPRINT_ACKPACKET) {
-    return MGOS_FINGERPRINT_READ_ERROR;
+static void mgos_fingerprint_auto_enroll_done(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  res->finger_id = (cmd->data[1] << 8) | cmd->data[2];
+  if (res->rc != MGOS_FINGERPRINT_OK) {
+    mgos_fingerprint_auto_check_rc(dev, res);
+    return;
   }
+  if (res->len < 2) {
+    res->rc = MGOS_FINGERPRINT_READ_ERROR;
+    return;
+  }
+
+  res->step = res->data[0];
+  res->more = res->step != MGOS_FINGERPRINT_AUTO_STORE;
+  if (!res->more) mgos_fingerprint_index_set(dev, res->finger_id, 1, true);
+}
 
-  return dev->packet.data[0];  // confirmation code
+int16_t mgos_fingerprint_auto_enroll_async(struct mgos_fingerprint *dev,
+                                           uint16_t id, uint8_t times,
+                                           mgos_fingerprint_cb cb,
+                                           void *cb_arg) {
+  // Id, number of captures, and flags (report every step, no overwrite).
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_AUTOENROLL, id >> 8, id & 0xFF, times,
+               0x00, 0x00},
+      .len = 6,
+      .done = mgos_fingerprint_auto_enroll_done,
+      .cb = cb,
+      .cb_arg = cb_arg};
+  return mgos_fingerprint_submit(dev, &cmd);
 }
 
 bool mgos_fingerprint_init(void) {
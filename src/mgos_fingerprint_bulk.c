@@ -0,0 +1,355 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+// Bulk import keeps two templates in flight, one per char buffer of the
+// module: while template k is being stored from one buffer, template k + 1 is
+// already queued for upload into the other. The store of a template is only
+// queued once its upload was acknowledged, and an upload into a buffer only
+// once the template that last used it is stored, so a failure never stores a
+// stale buffer.
+struct mgos_fingerprint_import {
+  const struct mgos_fingerprint_template *tpl;
+  uint16_t base;  // index of tpl[0] in the caller's list, when resuming
+  uint16_t count;
+  uint16_t next_upload;  // next template to queue for upload
+  uint16_t xfer;         // template whose data the source is sending
+  size_t xfer_off;
+  uint16_t stored;  // templates confirmed in flash, in order
+  uint16_t failed;  // first template that failed, or count
+  uint8_t in_flight;
+  int16_t rc;
+  bool done;
+  mgos_fingerprint_progress_cb progress;
+  void *progress_ud;
+  mgos_fingerprint_data_source source;  // NULL: copy from tpl[].data
+  void *source_ud;
+};
+
+static size_t mgos_fingerprint_import_len(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_template *t) {
+  return t->len ? t->len : dev->info.model_size;
+}
+
+static uint8_t mgos_fingerprint_import_slot(uint16_t k) {
+  return 1 + (k & 1);
+}
+
+static void mgos_fingerprint_import_pump(struct mgos_fingerprint *dev,
+                                         struct mgos_fingerprint_import *imp);
+
+static void mgos_fingerprint_import_fail(struct mgos_fingerprint_import *imp,
+                                         uint16_t k, int16_t rc) {
+  if (k < imp->failed) {
+    imp->failed = k;
+    imp->rc = rc;
+  }
+}
+
+static void mgos_fingerprint_import_finish(
+    struct mgos_fingerprint_import *imp) {
+  if (--imp->in_flight == 0 &&
+      (imp->failed < imp->count || imp->next_upload == imp->count))
+    imp->done = true;
+}
+
+// Templates are uploaded strictly in order, so the source only needs to know
+// which one is on the wire and how far it got. A caller's source sees the
+// same sequence of chunks, template after template.
+static bool mgos_fingerprint_import_source(uint8_t *chunk, size_t len,
+                                           void *ud) {
+  struct mgos_fingerprint_import *imp = (struct mgos_fingerprint_import *) ud;
+  const struct mgos_fingerprint_template *t = &imp->tpl[imp->xfer];
+
+  if (imp->source) {
+    if (!imp->source(chunk, len, imp->source_ud)) return false;
+  } else {
+    memcpy(chunk, t->data + imp->xfer_off, len);
+  }
+  imp->xfer_off += len;
+  return true;
+}
+
+static void mgos_fingerprint_import_store_cb(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  struct mgos_fingerprint_import *imp =
+      (struct mgos_fingerprint_import *) cb_arg;
+  uint16_t k = imp->stored;
+
+  if (res->rc != MGOS_FINGERPRINT_OK) {
+    LOG(LL_ERROR, ("Could not store template %u in flash slot %u: %d", k,
+                   imp->tpl[k].id, res->rc));
+    mgos_fingerprint_import_fail(imp, k, res->rc);
+  } else if (k < imp->failed) {
+    imp->stored++;
+    if (imp->progress)
+      imp->progress(dev, imp->base + imp->stored, imp->base + imp->count,
+                    imp->progress_ud);
+  }
+  mgos_fingerprint_import_finish(imp);
+  mgos_fingerprint_import_pump(dev, imp);
+}
+
+static void mgos_fingerprint_import_upload_cb(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  struct mgos_fingerprint_import *imp =
+      (struct mgos_fingerprint_import *) cb_arg;
+  uint16_t k = imp->xfer;
+
+  imp->xfer++;
+  imp->xfer_off = 0;
+  if (res->rc != MGOS_FINGERPRINT_OK) {
+    LOG(LL_ERROR, ("Could not upload template %u: %d", k, res->rc));
+    mgos_fingerprint_import_fail(imp, k, res->rc);
+  } else if (k < imp->failed) {
+    int16_t p = mgos_fingerprint_model_store_async(
+        dev, imp->tpl[k].id, mgos_fingerprint_import_slot(k),
+        mgos_fingerprint_import_store_cb, imp);
+    if (p == MGOS_FINGERPRINT_OK) return;  // still in flight
+    mgos_fingerprint_import_fail(imp, k, p);
+  }
+  mgos_fingerprint_import_finish(imp);
+}
+
+// Queues uploads while there is room in the pipeline: at most two templates,
+// one per char buffer, and never past a failure.
+static void mgos_fingerprint_import_pump(struct mgos_fingerprint *dev,
+                                         struct mgos_fingerprint_import *imp) {
+  while (imp->in_flight < 2 && imp->next_upload < imp->count &&
+         imp->failed == imp->count) {
+    uint16_t k = imp->next_upload;
+    int16_t p = mgos_fingerprint_model_upload_stream_async(
+        dev, mgos_fingerprint_import_slot(k), mgos_fingerprint_import_source,
+        imp, mgos_fingerprint_import_len(dev, &imp->tpl[k]),
+        mgos_fingerprint_import_upload_cb, imp);
+    // A full queue is retried on the next completion, if there is one.
+    if (p == MGOS_FINGERPRINT_BUSY && imp->in_flight > 0) return;
+    if (p != MGOS_FINGERPRINT_OK) {
+      mgos_fingerprint_import_fail(imp, k, p);
+      if (imp->in_flight == 0) imp->done = true;
+      return;
+    }
+    imp->next_upload++;
+    imp->in_flight++;
+  }
+}
+
+int16_t mgos_fingerprint_import_run(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_template *tpl,
+    uint16_t count, uint16_t *next, mgos_fingerprint_progress_cb progress,
+    void *ud, mgos_fingerprint_data_source source, void *source_ud) {
+  struct mgos_fingerprint_import imp;
+  uint16_t start = next ? *next : 0;
+  double started = mg_time();
+
+  if (!dev || !tpl) return MGOS_FINGERPRINT_READ_ERROR;
+  if (start >= count) return MGOS_FINGERPRINT_OK;
+
+  // Indexes below are relative to `start`, so a resumed import looks like a
+  // fresh one over the remaining templates.
+  memset(&imp, 0, sizeof(imp));
+  imp.tpl = tpl + start;
+  imp.base = start;
+  imp.count = count - start;
+  imp.failed = imp.count;
+  imp.rc = MGOS_FINGERPRINT_OK;
+  imp.progress = progress;
+  imp.progress_ud = ud;
+  imp.source = source;
+  imp.source_ud = source_ud;
+
+  mgos_fingerprint_import_pump(dev, &imp);
+  if (imp.in_flight == 0 && imp.failed == imp.count) imp.done = true;
+  mgos_fingerprint_wait(dev, &imp.done);
+
+  if (next) *next = start + imp.stored;
+  LOG(LL_INFO, ("Imported %u of %u templates in %.2fs", imp.stored, imp.count,
+                mg_time() - started));
+  return imp.rc;
+}
+
+int16_t mgos_fingerprint_model_import(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_template *tpl,
+    uint16_t count, uint16_t *next, mgos_fingerprint_progress_cb progress,
+    void *ud) {
+  return mgos_fingerprint_import_run(dev, tpl, count, next, progress, ud, NULL,
+                                     NULL);
+}
+
+struct mgos_fingerprint_revoke {
+  struct mgos_fingerprint_delete_range *ranges;
+  uint16_t completed;  // commands complete in submission order
+  uint16_t pending;
+  bool progress;
+};
+
+static void mgos_fingerprint_revoke_cb(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  struct mgos_fingerprint_revoke *rv =
+      (struct mgos_fingerprint_revoke *) cb_arg;
+
+  rv->ranges[rv->completed++].rc = res->rc;
+  rv->pending--;
+  rv->progress = true;
+  (void) dev;
+}
+
+static bool mgos_fingerprint_bit(const uint8_t *bitmap, uint16_t id) {
+  return bitmap[id / 8] & (1 << (id % 8));
+}
+
+// Splits the set into ranges for DELETE. A slot that is known to be empty
+// does not end a range: deleting it is harmless and saves a command. The
+// index must have been reloaded from the module, or another host's
+// enrollment in such a slot would be deleted with it. Returns the number of
+// ranges, also when more than `max_ranges`, so that a caller can size the list.
+uint16_t mgos_fingerprint_revoke_plan(
+    struct mgos_fingerprint *dev, const uint8_t *bitmap, uint16_t nbits,
+    struct mgos_fingerprint_delete_range *ranges, uint16_t max_ranges) {
+  uint16_t n = 0;
+  int32_t first = -1, last = -1;
+
+  for (uint16_t id = 0; id < nbits; id++) {
+    if (mgos_fingerprint_bit(bitmap, id)) {
+      if (first < 0) first = id;
+      last = id;
+      continue;
+    }
+    if (first < 0) continue;
+    if (dev->index_valid && !mgos_fingerprint_index_used(dev, id)) continue;
+    if (n < max_ranges) {
+      ranges[n].id = first;
+      ranges[n].count = last - first + 1;
+      ranges[n].rc = MGOS_FINGERPRINT_OK;
+    }
+    n++;
+    first = -1;
+  }
+  if (first >= 0) {
+    if (n < max_ranges) {
+      ranges[n].id = first;
+      ranges[n].count = last - first + 1;
+      ranges[n].rc = MGOS_FINGERPRINT_OK;
+    }
+    n++;
+  }
+  return n;
+}
+
+// True if every enrolled template is in the set, so that emptying the whole
+// database does the same job in one command. As for the plan, the index must
+// have been reloaded from the module.
+static bool mgos_fingerprint_revoke_covers(struct mgos_fingerprint *dev,
+                                           const uint8_t *bitmap,
+                                           uint16_t nbits) {
+  if (!dev->index_valid) return false;
+  for (int16_t id = mgos_fingerprint_model_next(dev, -1); id >= 0;
+       id = mgos_fingerprint_model_next(dev, id)) {
+    if (id >= nbits || !mgos_fingerprint_bit(bitmap, id)) return false;
+  }
+  return true;
+}
+
+int16_t mgos_fingerprint_model_delete_set(
+    struct mgos_fingerprint *dev, const uint8_t *bitmap, uint16_t nbits,
+    struct mgos_fingerprint_delete_range *ranges, uint16_t max_ranges,
+    uint16_t *num_ranges) {
+  struct mgos_fingerprint_revoke rv;
+  uint16_t n;
+  int16_t p = MGOS_FINGERPRINT_OK;
+
+  if (!dev || !bitmap || !num_ranges) return MGOS_FINGERPRINT_READ_ERROR;
+  if (nbits > dev->system_params.library_size)
+    nbits = dev->system_params.library_size;
+
+  if (!ranges) max_ranges = 0;
+  // Erasing what the module holds cannot be undone, so the plan is made from
+  // its own index rather than from the cache.
+  *num_ranges = 0;
+  if (dev->index &&
+      MGOS_FINGERPRINT_OK != (p = mgos_fingerprint_index_reload(dev)))
+    return p;
+  n = mgos_fingerprint_revoke_plan(dev, bitmap, nbits, ranges, max_ranges);
+  if (n > 1 && max_ranges > 0 &&
+      mgos_fingerprint_revoke_covers(dev, bitmap, nbits)) {
+    ranges[0].id = 0;
+    ranges[0].count = dev->system_params.library_size;
+    *num_ranges = 1;
+    return ranges[0].rc = mgos_fingerprint_database_erase(dev);
+  }
+  *num_ranges = n;
+  if (n > max_ranges) return MGOS_FINGERPRINT_READ_ERROR;
+
+  // All ranges are queued back-to-back; a full queue waits for a completion.
+  memset(&rv, 0, sizeof(rv));
+  rv.ranges = ranges;
+  for (uint16_t i = 0; i < n; i++) {
+    int16_t s;
+
+    while ((s = mgos_fingerprint_model_delete_async(
+                dev, ranges[i].id, ranges[i].count,
+                mgos_fingerprint_revoke_cb, &rv)) == MGOS_FINGERPRINT_BUSY) {
+      rv.progress = false;
+      mgos_fingerprint_wait(dev, &rv.progress);
+    }
+    if (s != MGOS_FINGERPRINT_OK) {
+      for (uint16_t j = i; j < n; j++) ranges[j].rc = s;
+      break;
+    }
+    rv.pending++;
+  }
+  while (rv.pending > 0) {
+    rv.progress = false;
+    mgos_fingerprint_wait(dev, &rv.progress);
+  }
+
+  for (uint16_t i = 0; i < n; i++) {
+    if (ranges[i].rc != MGOS_FINGERPRINT_OK) {
+      p = ranges[i].rc;
+      break;
+    }
+  }
+  return p;
+}
+
+int16_t mgos_fingerprint_model_delete_list(
+    struct mgos_fingerprint *dev, const uint16_t *ids, uint16_t num_ids,
+    struct mgos_fingerprint_delete_range *ranges, uint16_t max_ranges,
+    uint16_t *num_ranges) {
+  uint8_t *bitmap;
+  uint16_t nbits;
+  int16_t p;
+
+  if (!dev || !ids) return MGOS_FINGERPRINT_READ_ERROR;
+  nbits = dev->system_params.library_size;
+  if (!(bitmap = calloc((nbits + 7) / 8 + 1, 1)))
+    return MGOS_FINGERPRINT_READ_ERROR;
+  for (uint16_t i = 0; i < num_ids; i++)
+    if (ids[i] < nbits) bitmap[ids[i] / 8] |= 1 << (ids[i] % 8);
+  p = mgos_fingerprint_model_delete_set(dev, bitmap, nbits, ranges,
+                                        max_ranges, num_ranges);
+  free(bitmap);
+  return p;
+}
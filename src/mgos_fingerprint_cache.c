@@ -0,0 +1,299 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Descriptor cache: the system parameters, product info and template index
+// are kept in a file, so that create() does not have to read them from the
+// module on every boot. The file is tied to the module by its serial number
+// and by a generation counter that lives in a notepad page of the module.
+// A warm start sends the password, which a module with one wants before any
+// other command, and reads that page.
+//
+// The generation is bumped in the notepad on the first change of the flash
+// database after the file was written, before the file is rewritten, so a
+// file never outlives a change made by this or any other host that runs the
+// driver. The file is removed as soon as it is stale and written again once
+// changes have settled.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_crc32.h"
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+#define CACHE_MAGIC 0x43504746  // "FGPC"
+#define CACHE_VERSION 2
+#define CACHE_DELAY_MS 1000  // quiet time before a changed cache is written
+
+enum mgos_fingerprint_cache_state {
+  CACHE_OFF = 0,  // not in use, or create() is still running
+  CACHE_CLEAN,    // file matches the module
+  CACHE_BUMPING,  // generation update in flight, file removed
+  CACHE_DIRTY,    // generation updated, file written after CACHE_DELAY_MS
+};
+
+struct __attribute__((packed)) mgos_fingerprint_cache_file {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t index_words;
+  uint32_t generation;
+  uint32_t baud;
+  char module_serial[8];
+  struct mgos_fingerprint_system_params system_params;
+  struct mgos_fingerprint_info info;
+  uint8_t auto_supported;
+  uint32_t crc;  // of the above and the index words that follow
+};
+
+struct __attribute__((packed)) mgos_fingerprint_cache_note {
+  uint32_t magic;
+  uint32_t generation;
+  char module_serial[8];
+};
+
+static uint32_t mgos_fingerprint_cache_crc(
+    const struct mgos_fingerprint_cache_file *f, const uint32_t *index) {
+  uint32_t crc =
+      cs_crc32(0, f, offsetof(struct mgos_fingerprint_cache_file, crc));
+
+  return cs_crc32(crc, index, f->index_words * sizeof(uint32_t));
+}
+
+static void mgos_fingerprint_cache_note_build(
+    struct mgos_fingerprint *dev,
+    uint8_t page[MGOS_FINGERPRINT_NOTEPAD_SIZE]) {
+  struct mgos_fingerprint_cache_note note;
+
+  memset(page, 0, MGOS_FINGERPRINT_NOTEPAD_SIZE);
+  note.magic = CACHE_MAGIC;
+  note.generation = dev->cache_gen;
+  memcpy(note.module_serial, dev->info.module_serial,
+         sizeof(note.module_serial));
+  memcpy(page, &note, sizeof(note));
+}
+
+// Writes the file from the driver's state. The file is only valid once the
+// notepad holds dev->cache_gen.
+static bool mgos_fingerprint_cache_write(struct mgos_fingerprint *dev) {
+  struct mgos_fingerprint_cache_file f;
+  FILE *fp;
+  bool ok;
+
+  if (!dev->index || !dev->index_valid) return false;
+  memset(&f, 0, sizeof(f));
+  f.magic = CACHE_MAGIC;
+  f.version = CACHE_VERSION;
+  f.index_words = dev->index_words;
+  f.generation = dev->cache_gen;
+  f.baud = dev->uart_baud;
+  memcpy(f.module_serial, dev->info.module_serial, sizeof(f.module_serial));
+  f.system_params = dev->system_params;
+  f.info = dev->info;
+  f.auto_supported = dev->auto_supported;
+  f.crc = mgos_fingerprint_cache_crc(&f, dev->index);
+
+  if (!(fp = fopen(dev->cache_path, "wb"))) {
+    LOG(LL_ERROR, ("Could not open %s", dev->cache_path));
+    return false;
+  }
+  ok = fwrite(&f, sizeof(f), 1, fp) == 1 &&
+       fwrite(dev->index, sizeof(uint32_t), f.index_words, fp) ==
+           f.index_words;
+  if (fclose(fp) != 0) ok = false;
+  if (!ok) remove(dev->cache_path);
+  return ok;
+}
+
+static void mgos_fingerprint_cache_timer_cb(void *arg) {
+  struct mgos_fingerprint *dev = (struct mgos_fingerprint *) arg;
+
+  dev->cache_timer_id = 0;
+  if (dev->cache_state != CACHE_DIRTY) return;
+  if (mgos_fingerprint_cache_write(dev)) dev->cache_state = CACHE_CLEAN;
+}
+
+static void mgos_fingerprint_cache_arm(struct mgos_fingerprint *dev) {
+  if (dev->cache_timer_id) mgos_clear_timer(dev->cache_timer_id);
+  dev->cache_timer_id = mgos_set_timer(CACHE_DELAY_MS, 0,
+                                       mgos_fingerprint_cache_timer_cb, dev);
+}
+
+static void mgos_fingerprint_cache_bump_cb(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  if (dev->cache_state != CACHE_BUMPING) return;
+  if (res->rc != MGOS_FINGERPRINT_OK) {
+    // Without the file a cold start follows, which is always correct. The
+    // next change tries again.
+    LOG(LL_WARN, ("Could not update cache generation: %d", res->rc));
+    dev->cache_state = CACHE_CLEAN;
+    return;
+  }
+  dev->cache_state = CACHE_DIRTY;
+  mgos_fingerprint_cache_arm(dev);
+  (void) cb_arg;
+}
+
+void mgos_fingerprint_cache_touch(struct mgos_fingerprint *dev) {
+  uint8_t page[MGOS_FINGERPRINT_NOTEPAD_SIZE];
+
+  switch (dev->cache_state) {
+    case CACHE_CLEAN:
+      remove(dev->cache_path);
+      dev->cache_gen++;
+      mgos_fingerprint_cache_note_build(dev, page);
+      dev->cache_state = CACHE_BUMPING;
+      if (MGOS_FINGERPRINT_OK !=
+          mgos_fingerprint_notepad_write_async(
+              dev, dev->cache_page, page, mgos_fingerprint_cache_bump_cb, NULL))
+        dev->cache_state = CACHE_CLEAN;
+      break;
+    case CACHE_DIRTY:
+      mgos_fingerprint_cache_arm(dev);
+      break;
+    default:
+      break;
+  }
+}
+
+bool mgos_fingerprint_cache_init(struct mgos_fingerprint *dev,
+                                 const struct mgos_fingerprint_cfg *cfg) {
+  dev->cache_state = CACHE_OFF;
+  if (!cfg->cache_path) return true;
+  // The notepad belongs to the application unless it gives a page away.
+  if (cfg->cache_notepad_page < 0 ||
+      cfg->cache_notepad_page >= MGOS_FINGERPRINT_NOTEPAD_PAGES) {
+    LOG(LL_WARN, ("No notepad page for the cache, not using %s",
+                  cfg->cache_path));
+    return true;
+  }
+  dev->cache_page = cfg->cache_notepad_page;
+  return (dev->cache_path = strdup(cfg->cache_path)) != NULL;
+}
+
+// Warm start: loads the file, verifies the password and checks the file
+// against the notepad. On success the driver is ready without any further
+// command.
+bool mgos_fingerprint_cache_load(struct mgos_fingerprint *dev) {
+  struct mgos_fingerprint_cache_file f;
+  struct mgos_fingerprint_cache_note note;
+  struct mgos_fingerprint_sync s;
+  // Both on a short timeout: a module that has moved to another rate is
+  // given up on quickly, for the cold start to find it.
+  struct mgos_fingerprint_cmd vfy = {
+      .data = {MGOS_FINGERPRINT_CMD_VERIFYPASSWORD,
+               (dev->password >> 24) & 0xff, (dev->password >> 16) & 0xff,
+               (dev->password >> 8) & 0xff, dev->password & 0xff},
+      .len = 5,
+      .timeout_ms = MGOS_FINGERPRINT_PROBE_TIMEOUT,
+      .cb = mgos_fingerprint_sync_cb,
+      .cb_arg = &s};
+  struct mgos_fingerprint_cmd cmd = {
+      .data = {MGOS_FINGERPRINT_CMD_READNOTEPAD, dev->cache_page},
+      .len = 2,
+      .timeout_ms = MGOS_FINGERPRINT_PROBE_TIMEOUT,
+      .cb = mgos_fingerprint_sync_cb,
+      .cb_arg = &s};
+  uint32_t baud = dev->uart_baud;
+  uint32_t *index = NULL;
+  FILE *fp;
+
+  if (!dev->cache_path || !(fp = fopen(dev->cache_path, "rb"))) return false;
+  if (fread(&f, sizeof(f), 1, fp) != 1 || f.magic != CACHE_MAGIC ||
+      f.version != CACHE_VERSION || f.index_words == 0 ||
+      !(index = calloc(f.index_words, sizeof(uint32_t))) ||
+      fread(index, sizeof(uint32_t), f.index_words, fp) != f.index_words ||
+      mgos_fingerprint_cache_crc(&f, index) != f.crc) {
+    fclose(fp);
+    goto out;
+  }
+  fclose(fp);
+
+  // The module is asked at the rate it was last left at.
+  if (f.baud != dev->uart_baud) mgos_fingerprint_uart_baud_set(dev, f.baud);
+  mgos_fingerprint_sync_begin(dev, &s);
+  if (MGOS_FINGERPRINT_OK !=
+      mgos_fingerprint_sync_wait(dev, &s, mgos_fingerprint_submit(dev, &vfy)))
+    goto out;
+  mgos_fingerprint_sync_begin(dev, &s);
+  if (MGOS_FINGERPRINT_OK !=
+          mgos_fingerprint_sync_wait(dev, &s,
+                                     mgos_fingerprint_submit(dev, &cmd)) ||
+      s.res.len < sizeof(note))
+    goto out;
+  memcpy(&note, s.res.data, sizeof(note));
+  if (note.magic != CACHE_MAGIC || note.generation != f.generation ||
+      memcmp(note.module_serial, f.module_serial, sizeof(f.module_serial)))
+    goto out;
+
+  dev->system_params = f.system_params;
+  dev->system_params_valid = true;
+  dev->info = f.info;
+  dev->auto_supported = f.auto_supported;
+  if (!mgos_fingerprint_index_init(dev) ||
+      dev->index_words != f.index_words)
+    goto out;
+  memcpy(dev->index, index, f.index_words * sizeof(uint32_t));
+  dev->index_valid = true;
+  dev->cache_gen = f.generation;
+  dev->cache_state = CACHE_CLEAN;
+  free(index);
+  LOG(LL_INFO, ("Loaded module descriptor from %s, generation %u",
+                dev->cache_path, f.generation));
+  return true;
+
+out:
+  if (dev->uart_baud != baud) mgos_fingerprint_uart_baud_set(dev, baud);
+  free(index);
+  return false;
+}
+
+// Cold start done: adopts the module's generation, or starts one on a module
+// that has none, and writes the file.
+void mgos_fingerprint_cache_save(struct mgos_fingerprint *dev) {
+  uint8_t page[MGOS_FINGERPRINT_NOTEPAD_SIZE];
+  struct mgos_fingerprint_cache_note note;
+
+  if (!dev->cache_path) return;
+  if (MGOS_FINGERPRINT_OK !=
+      mgos_fingerprint_notepad_read(dev, dev->cache_page, page))
+    return;
+  memcpy(&note, page, sizeof(note));
+  if (note.magic == CACHE_MAGIC &&
+      !memcmp(note.module_serial, dev->info.module_serial,
+              sizeof(note.module_serial))) {
+    dev->cache_gen = note.generation;
+  } else {
+    dev->cache_gen = 1;
+    mgos_fingerprint_cache_note_build(dev, page);
+    if (MGOS_FINGERPRINT_OK !=
+        mgos_fingerprint_notepad_write(dev, dev->cache_page, page))
+      return;
+  }
+  if (mgos_fingerprint_cache_write(dev)) dev->cache_state = CACHE_CLEAN;
+}
+
+void mgos_fingerprint_cache_deinit(struct mgos_fingerprint *dev) {
+  if (dev->cache_timer_id) mgos_clear_timer(dev->cache_timer_id);
+  dev->cache_timer_id = 0;
+  // Settled changes are not lost to a clean shutdown.
+  if (dev->cache_state == CACHE_DIRTY) mgos_fingerprint_cache_write(dev);
+  dev->cache_state = CACHE_OFF;
+  free(dev->cache_path);
+  dev->cache_path = NULL;
+}
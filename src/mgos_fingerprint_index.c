@@ -0,0 +1,235 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host side copy of the template index: one bit per flash slot, set when a
+// model is stored there. It is read from the module once, and then kept up to
+// date by the done hooks of the commands that change the flash database, so
+// free slots and enrolled ids are found without a UART round trip.
+//
+// Watchers (mgos_fingerprint_replica.c) register bitmaps of their own that
+// mark slots which may have changed since they last looked at them. Every
+// change made through the driver sets the slot in all of them, and so does
+// re-reading the index from the module; each watcher clears its own.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+#define INDEX_WORD_BITS 32
+
+// Marks the slots of `mask` in word `word` as changed for every watcher.
+static void mgos_fingerprint_index_touch(struct mgos_fingerprint *dev,
+                                         uint16_t word, uint32_t mask) {
+  for (uint8_t i = 0; i < MGOS_FINGERPRINT_INDEX_WATCHERS; i++)
+    if (dev->index_watch[i]) dev->index_watch[i][word] |= mask;
+}
+
+static void mgos_fingerprint_index_touch_all(struct mgos_fingerprint *dev) {
+  for (uint8_t i = 0; i < MGOS_FINGERPRINT_INDEX_WATCHERS; i++)
+    if (dev->index_watch[i])
+      memset(dev->index_watch[i], 0xFF, dev->index_words * sizeof(uint32_t));
+}
+
+bool mgos_fingerprint_index_init(struct mgos_fingerprint *dev) {
+  uint16_t words = (dev->system_params.library_size + INDEX_WORD_BITS - 1) /
+                   INDEX_WORD_BITS;
+
+  mgos_fingerprint_index_deinit(dev);
+  dev->index = calloc(words ? words : 1, sizeof(uint32_t));
+  dev->index_words = words;
+  return dev->index != NULL;
+}
+
+void mgos_fingerprint_index_deinit(struct mgos_fingerprint *dev) {
+  free(dev->index);
+  dev->index = NULL;
+  dev->index_words = 0;
+  dev->index_valid = false;
+}
+
+// Registers a bitmap of dev->index_words words, which the caller owns and
+// must unregister before freeing it. All its slots start out as changed.
+bool mgos_fingerprint_index_watch(struct mgos_fingerprint *dev,
+                                  uint32_t *watch) {
+  if (!dev->index) return false;
+  for (uint8_t i = 0; i < MGOS_FINGERPRINT_INDEX_WATCHERS; i++) {
+    if (dev->index_watch[i]) continue;
+    memset(watch, 0xFF, dev->index_words * sizeof(uint32_t));
+    dev->index_watch[i] = watch;
+    return true;
+  }
+  return false;
+}
+
+void mgos_fingerprint_index_unwatch(struct mgos_fingerprint *dev,
+                                    uint32_t *watch) {
+  for (uint8_t i = 0; i < MGOS_FINGERPRINT_INDEX_WATCHERS; i++)
+    if (dev->index_watch[i] == watch) dev->index_watch[i] = NULL;
+}
+
+// Copies a page as returned by READTEMPLATEINDEX: byte i, bit b describes
+// slot page * 256 + i * 8 + b. Slots that were filled or emptied since the
+// cache last saw them are marked as changed.
+void mgos_fingerprint_index_load_page(struct mgos_fingerprint *dev,
+                                      uint8_t page, const uint8_t *bitmap,
+                                      uint16_t len) {
+  uint32_t base = page * MGOS_FINGERPRINT_TEMPLATES_PER_PAGE;
+
+  if (!dev->index) return;
+  for (uint16_t i = 0; i < len; i++) {
+    uint32_t id = base + i * 8;
+    uint32_t word = id / INDEX_WORD_BITS;
+    uint8_t shift = id % INDEX_WORD_BITS;
+
+    if (word >= dev->index_words) break;
+    mgos_fingerprint_index_touch(
+        dev, word,
+        (dev->index[word] ^ ((uint32_t) bitmap[i] << shift)) &
+            ((uint32_t) 0xFF << shift));
+    dev->index[word] &= ~((uint32_t) 0xFF << shift);
+    dev->index[word] |= (uint32_t) bitmap[i] << shift;
+  }
+}
+
+void mgos_fingerprint_index_set(struct mgos_fingerprint *dev, uint16_t id,
+                                uint16_t count, bool used) {
+  if (!dev->index) return;
+  for (uint32_t i = id; i < (uint32_t) id + count; i++) {
+    if (i >= dev->system_params.library_size) break;
+    if (used)
+      dev->index[i / INDEX_WORD_BITS] |= 1UL << (i % INDEX_WORD_BITS);
+    else
+      dev->index[i / INDEX_WORD_BITS] &= ~(1UL << (i % INDEX_WORD_BITS));
+    mgos_fingerprint_index_touch(dev, i / INDEX_WORD_BITS,
+                                 1UL << (i % INDEX_WORD_BITS));
+  }
+  mgos_fingerprint_cache_touch(dev);
+}
+
+void mgos_fingerprint_index_clear(struct mgos_fingerprint *dev) {
+  if (!dev->index) return;
+  memset(dev->index, 0, dev->index_words * sizeof(uint32_t));
+  mgos_fingerprint_index_touch_all(dev);
+  mgos_fingerprint_cache_touch(dev);
+}
+
+bool mgos_fingerprint_index_used(struct mgos_fingerprint *dev, uint16_t id) {
+  if (!dev->index || id >= dev->system_params.library_size) return false;
+  return dev->index[id / INDEX_WORD_BITS] & (1UL << (id % INDEX_WORD_BITS));
+}
+
+bool mgos_fingerprint_index_dirty(struct mgos_fingerprint *dev,
+                                  const uint32_t *watch, uint16_t id) {
+  if (!watch || id >= dev->system_params.library_size) return true;
+  return watch[id / INDEX_WORD_BITS] & (1UL << (id % INDEX_WORD_BITS));
+}
+
+void mgos_fingerprint_index_clean(struct mgos_fingerprint *dev,
+                                  uint32_t *watch, uint16_t id) {
+  if (!watch || id >= dev->system_params.library_size) return;
+  watch[id / INDEX_WORD_BITS] &= ~(1UL << (id % INDEX_WORD_BITS));
+}
+
+// Returns the lowest free slot, or MGOS_FINGERPRINT_NOFREEINDEX if the
+// library is full or the cache has not been loaded.
+int16_t mgos_fingerprint_index_first_free(struct mgos_fingerprint *dev) {
+  if (!dev->index || !dev->index_valid) return MGOS_FINGERPRINT_NOFREEINDEX;
+  for (uint16_t w = 0; w < dev->index_words; w++) {
+    uint32_t id;
+
+    if (dev->index[w] == 0xFFFFFFFF) continue;
+    id = w * INDEX_WORD_BITS + __builtin_ctz(~dev->index[w]);
+    if (id >= dev->system_params.library_size) break;
+    return id;
+  }
+  return MGOS_FINGERPRINT_NOFREEINDEX;
+}
+
+// Returns the number of used slots, or 0 if the cache has not been loaded.
+uint16_t mgos_fingerprint_index_count(struct mgos_fingerprint *dev) {
+  uint16_t size = dev->system_params.library_size;
+  uint16_t count = 0;
+
+  if (!dev->index || !dev->index_valid) return 0;
+  for (uint16_t w = 0; w < dev->index_words; w++) {
+    uint32_t bits = dev->index[w];
+
+    if (w * INDEX_WORD_BITS >= size) break;
+    if (size - w * INDEX_WORD_BITS < INDEX_WORD_BITS)
+      bits &= (1UL << (size - w * INDEX_WORD_BITS)) - 1;
+    count += __builtin_popcount(bits);
+  }
+  return count;
+}
+
+static int16_t mgos_fingerprint_index_read(struct mgos_fingerprint *dev) {
+  uint16_t pages;
+
+  dev->index_valid = false;
+  pages = (dev->system_params.library_size +
+           MGOS_FINGERPRINT_TEMPLATES_PER_PAGE - 1) /
+          MGOS_FINGERPRINT_TEMPLATES_PER_PAGE;
+  for (uint16_t page = 0; page < pages; page++) {
+    struct mgos_fingerprint_sync s;
+    int16_t p;
+
+    // The done hook of the index command loads the page into the cache.
+    mgos_fingerprint_sync_begin(dev, &s);
+    p = mgos_fingerprint_sync_wait(
+        dev, &s,
+        mgos_fingerprint_model_index_async(dev, page, mgos_fingerprint_sync_cb,
+                                           &s));
+    if (p != MGOS_FINGERPRINT_OK) return p;
+  }
+  dev->index_valid = true;
+  return MGOS_FINGERPRINT_OK;
+}
+
+int16_t mgos_fingerprint_index_refresh(struct mgos_fingerprint *dev) {
+  if (!dev || !dev->index) return MGOS_FINGERPRINT_READ_ERROR;
+  mgos_fingerprint_index_touch_all(dev);
+  return mgos_fingerprint_index_read(dev);
+}
+
+// Re-reads which slots are in use, for decisions that must not rest on a
+// stale cache. Unlike a refresh, templates that are still in place are taken
+// to be unchanged, so a replica only looks again at slots that were filled
+// or emptied behind the driver's back.
+int16_t mgos_fingerprint_index_reload(struct mgos_fingerprint *dev) {
+  if (!dev || !dev->index) return MGOS_FINGERPRINT_READ_ERROR;
+  return mgos_fingerprint_index_read(dev);
+}
+
+int16_t mgos_fingerprint_model_next(struct mgos_fingerprint *dev,
+                                    int16_t after) {
+  uint32_t id = after < 0 ? 0 : (uint32_t) after + 1;
+
+  if (!dev || !dev->index || !dev->index_valid)
+    return MGOS_FINGERPRINT_NOFREEINDEX;
+  while (id < dev->system_params.library_size) {
+    uint32_t w = dev->index[id / INDEX_WORD_BITS] >> (id % INDEX_WORD_BITS);
+
+    if (w) {
+      id += __builtin_ctz(w);
+      if (id >= dev->system_params.library_size) break;
+      return id;
+    }
+    id = (id / INDEX_WORD_BITS + 1) * INDEX_WORD_BITS;
+  }
+  return MGOS_FINGERPRINT_NOFREEINDEX;
+}
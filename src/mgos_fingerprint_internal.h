@@ -23,6 +23,8 @@ extern "C" {
 #include <arpa/inet.h>
 
 #include "mgos_fingerprint.h"
+#include "mgos_system.h"
+#include "mgos_timers.h"
 
 // signature and packet ids
 #define MGOS_FINGERPRINT_STARTCODE 0xEF01
@@ -51,9 +53,13 @@ extern "C" {
 #define MGOS_FINGERPRINT_CMD_SETPASSWORD 0x12
 #define MGOS_FINGERPRINT_CMD_VERIFYPASSWORD 0x13
 #define MGOS_FINGERPRINT_CMD_GETRANDOM 0x14
+#define MGOS_FINGERPRINT_CMD_WRITENOTEPAD 0x18
+#define MGOS_FINGERPRINT_CMD_READNOTEPAD 0x19
 #define MGOS_FINGERPRINT_CMD_HISPEEDSEARCH 0x1B
 #define MGOS_FINGERPRINT_CMD_TEMPLATECOUNT 0x1D
 #define MGOS_FINGERPRINT_CMD_READTEMPLATEINDEX 0x1F
+#define MGOS_FINGERPRINT_CMD_AUTOENROLL 0x31
+#define MGOS_FINGERPRINT_CMD_AUTOIDENTIFY 0x32
 #define MGOS_FINGERPRINT_CMD_STANDBY 0x33
 #define MGOS_FINGERPRINT_CMD_LED_CONTROL 0x35
 #define MGOS_FINGERPRINT_CMD_READPRODINFO 0x3C
@@ -61,43 +67,289 @@ extern "C" {
 #define MGOS_FINGERPRINT_CMD_LEDON 0x50
 #define MGOS_FINGERPRINT_CMD_LEDOFF 0x51
 
-#define MGOS_FINGERPRINT_DEFAULT_TIMEOUT 2000
+#define MGOS_FINGERPRINT_DEFAULT_TIMEOUT 2000  // ms, commands not in the table
+#define MGOS_FINGERPRINT_TIMEOUT_SLOTS 30      // commands in the table
+#define MGOS_FINGERPRINT_PROBE_TIMEOUT 100  // ms, baud rate autodetection
+#define MGOS_FINGERPRINT_POLL_INTERVAL 5  // ms to yield while awaiting a frame
+#define MGOS_FINGERPRINT_RX_GUARD 100     // ms of silence after a failed frame
+#define MGOS_FINGERPRINT_HEADER_LEN 9     // startcode, address, type, len
 #define MGOS_FINGERPRINT_TEMPLATES_PER_PAGE 256
+#define MGOS_FINGERPRINT_AUTO_TIMEOUT 10000  // ms, includes finger wait
+#define MGOS_FINGERPRINT_SEARCH_PROBES 3     // samples of each search to pick
+#define MGOS_FINGERPRINT_HISPEED_ERRORS 3    // receive errors to give up on it
 
 // Service
 #define MGOS_FINGERPRINT_STATE_NONE 0x00
 #define MGOS_FINGERPRINT_STATE_MATCH 0x01    // Search/DB mode
 #define MGOS_FINGERPRINT_STATE_ENROLL1 0x02  // Enroll mode: First fingerprint
 #define MGOS_FINGERPRINT_STATE_ENROLL2 0x03  // Enroll mode: Second fingerprint
+#define MGOS_FINGERPRINT_STATE_ENROLL_LIFT 0x04  // Enroll mode: Remove finger
+
+#define MGOS_FINGERPRINT_CMD_MAXLEN 34    // code and parameters, eg. notepad
+#define MGOS_FINGERPRINT_DATA_MAXLEN 256  // largest negotiable data packet
+#define MGOS_FINGERPRINT_ACK_MAXLEN 64    // acknowledge payload kept by waiters
+#define MGOS_FINGERPRINT_QUEUE_LEN 8      // commands behind the one in flight
+#define MGOS_FINGERPRINT_INDEX_WATCHERS 4  // change bitmaps per module
 
 struct mgos_fingerprint_packet {
   uint16_t startcode __attribute__((packed));
   uint32_t address __attribute__((packed));
   uint8_t packettype;
   uint16_t len __attribute__((packed));
-  uint8_t data[66];  // 64 + 2 for checksum
+  uint8_t data[MGOS_FINGERPRINT_DATA_MAXLEN + 2];  // + 2 for checksum
+};
+
+struct mgos_fingerprint_cmd {
+  uint8_t data[MGOS_FINGERPRINT_CMD_MAXLEN];
+  uint8_t len;
+  uint16_t timeout_ms;  // per acknowledge, 0 for the default
+
+  // Decodes the acknowledge into `res` before the user callback runs. It sets
+  // res->more for intermediate acknowledges of multi-step commands.
+  // It may also clear cmd->cb to swallow the result, eg. after resubmitting.
+  void (*done)(struct mgos_fingerprint *dev, struct mgos_fingerprint_cmd *cmd,
+               struct mgos_fingerprint_result *res);
+  mgos_fingerprint_cb cb;
+  void *cb_arg;
+
+  // Data phase, entered after a successful acknowledge: the module's data
+  // packets go to `sink` up to and including the end-of-data packet, or
+  // `stream_len` bytes from `source` are sent to the module.
+  mgos_fingerprint_data_sink sink;
+  mgos_fingerprint_data_source source;
+  void *stream_arg;
+  uint32_t stream_len;
+};
+
+// Latency estimate of one command, in microseconds.
+struct mgos_fingerprint_latency {
+  uint32_t srtt_us;
+  uint32_t rttvar_us;
+  uint8_t samples;
+};
+
+// Waiter used by the synchronous API to block on an asynchronous command.
+struct mgos_fingerprint_sync {
+  bool done;
+  struct mgos_fingerprint_result res;
+  uint8_t data[MGOS_FINGERPRINT_ACK_MAXLEN];
 };
 
 struct mgos_fingerprint {
   uint32_t password;
   uint32_t address;
   uint8_t uart_no;
+  uint32_t uart_baud;
+
+  // Byte transport to the module: the UART, unless cfg.transport is set.
+  struct mgos_fingerprint_transport io;
+  bool io_uart;
+  mgos_timer_id io_timer_id;  // polls a transport without a dispatcher
 
   struct mgos_fingerprint_system_params system_params;
+  bool system_params_valid;  // cleared to have get_param() re-read them
   struct mgos_fingerprint_info info;
-  struct mgos_fingerprint_packet packet;
+  bool auto_supported;  // module knows AutoEnroll/AutoIdentify
+
+  // Search strategy: running average of the round trip of each search
+  // flavour (0: SEARCH, 1: HISPEEDSEARCH), used to pick one in auto mode.
+  enum mgos_fingerprint_search_strategy search_strategy;
+  bool hispeed_unsupported;
+  uint8_t hispeed_errors;  // receive errors of high speed search in a row
+  uint32_t search_avg_us[2];
+  uint8_t search_samples[2];
+
+  // Template index cache (mgos_fingerprint_index.c), one bit per slot.
+  uint32_t *index;
+  // Bitmaps of slots changed since their owner last looked, one per replica
+  // the module takes part in.
+  uint32_t *index_watch[MGOS_FINGERPRINT_INDEX_WATCHERS];
+  uint16_t index_words;
+  bool index_valid;
+
+  // Descriptor cache (mgos_fingerprint_cache.c).
+  char *cache_path;
+  uint8_t cache_page;  // notepad page of the generation
+  uint32_t cache_gen;
+  uint8_t cache_state;
+  mgos_timer_id cache_timer_id;
+
+  struct mgos_fingerprint_packet packet;  // receive buffer
+  struct mgos_fingerprint_packet tx;      // next command frame, prebuilt
+  uint16_t tx_len;
+  bool tx_ready;
+
+  // Receive parser: bytes land in `packet` as the UART dispatcher delivers
+  // them, rx_want grows from the header to the full frame once len is known.
+  bool rx_busy;
+  bool rx_hunting;  // dropping bytes until the next start code
+  uint16_t rx_have;
+  uint16_t rx_want;
+  struct mgos_fingerprint_link_stats link_stats;
+
+  // Timeouts per command (mgos_fingerprint_timeout.c).
+  uint16_t timeout_ms[MGOS_FINGERPRINT_TIMEOUT_SLOTS];
+  struct mgos_fingerprint_latency latency[MGOS_FINGERPRINT_TIMEOUT_SLOTS];
+  bool timeout_adaptive;
+
+  // Statistics per command (mgos_fingerprint_stats.c), NULL unless enabled.
+  struct mgos_fingerprint_stats *stats;
+
+  // Ring of the last trace_len frames (mgos_fingerprint_trace.c), if any.
+  struct mgos_fingerprint_trace_entry *trace;
+  uint16_t trace_len;
+  uint16_t trace_head;   // next entry to write
+  uint16_t trace_count;  // entries in use
+
+  // Command in flight, and the bounded queue of commands behind it. The lock
+  // guards both, so any task may submit.
+  struct mgos_rlock_type *lock;
+  struct mgos_fingerprint_cmd cmd;
+  bool cmd_busy;
+  int64_t cmd_sent_us;
+  // After a timeout or a broken frame the next command waits until the line
+  // has been quiet until this time, or 0.
+  int64_t rx_guard_us;
+  double cmd_deadline;
+  mgos_timer_id cmd_timer_id;
+  struct mgos_fingerprint_cmd queue[MGOS_FINGERPRINT_QUEUE_LEN];
+  uint8_t queue_head;
+  uint8_t queue_len;
+
+  // Data phase of the command in flight, see mgos_fingerprint_cmd.sink.
+  bool stream_rx;
+  bool stream_abort;
+  struct mgos_fingerprint_result stream_res;
 
   mgos_fingerprint_ev_handler handler;
   void *handler_user_data;
 
   // Service
   uint8_t svc_state;
+  bool svc_busy;   // a chain is running, and owns the char buffers
+  bool svc_event;  // the handler is called from the middle of the chain
+  uint8_t svc_page;
   int svc_timer_id;
   uint16_t svc_period_ms;
   float svc_state_ts;
   int enroll_timeout_secs;
 };
 
+// Protocol engine (mgos_fingerprint_proto.c)
+uint16_t mgos_fingerprint_frame_build(struct mgos_fingerprint *dev,
+                                      struct mgos_fingerprint_packet *pkt,
+                                      uint8_t packettype, uint16_t datalen);
+uint16_t mgos_fingerprint_data_len(struct mgos_fingerprint *dev);
+bool mgos_fingerprint_proto_init(struct mgos_fingerprint *dev);
+void mgos_fingerprint_proto_deinit(struct mgos_fingerprint *dev);
+int16_t mgos_fingerprint_submit(struct mgos_fingerprint *dev,
+                                const struct mgos_fingerprint_cmd *cmd);
+int16_t mgos_fingerprint_submit_next(struct mgos_fingerprint *dev,
+                                     const struct mgos_fingerprint_cmd *cmd);
+void mgos_fingerprint_sync_begin(struct mgos_fingerprint *dev,
+                                 struct mgos_fingerprint_sync *s);
+void mgos_fingerprint_sync_cb(struct mgos_fingerprint *dev,
+                              const struct mgos_fingerprint_result *res,
+                              void *cb_arg);
+int16_t mgos_fingerprint_sync_wait(struct mgos_fingerprint *dev,
+                                   struct mgos_fingerprint_sync *s,
+                                   int16_t submitted);
+void mgos_fingerprint_wait(struct mgos_fingerprint *dev, const bool *done);
+void mgos_fingerprint_poll(struct mgos_fingerprint *dev);
+uint32_t mgos_fingerprint_rx_feed(struct mgos_fingerprint *dev,
+                                  const uint8_t *buf, size_t len);
+void mgos_fingerprint_rx_flush(struct mgos_fingerprint *dev);
+
+int16_t mgos_fingerprint_index_page_free_id(uint8_t page, const uint8_t *bitmap,
+                                            uint16_t len);
+
+// Template index cache (mgos_fingerprint_index.c)
+bool mgos_fingerprint_index_init(struct mgos_fingerprint *dev);
+void mgos_fingerprint_index_deinit(struct mgos_fingerprint *dev);
+void mgos_fingerprint_index_load_page(struct mgos_fingerprint *dev,
+                                      uint8_t page, const uint8_t *bitmap,
+                                      uint16_t len);
+void mgos_fingerprint_index_set(struct mgos_fingerprint *dev, uint16_t id,
+                                uint16_t count, bool used);
+void mgos_fingerprint_index_clear(struct mgos_fingerprint *dev);
+bool mgos_fingerprint_index_used(struct mgos_fingerprint *dev, uint16_t id);
+bool mgos_fingerprint_index_watch(struct mgos_fingerprint *dev,
+                                  uint32_t *watch);
+void mgos_fingerprint_index_unwatch(struct mgos_fingerprint *dev,
+                                    uint32_t *watch);
+bool mgos_fingerprint_index_dirty(struct mgos_fingerprint *dev,
+                                  const uint32_t *watch, uint16_t id);
+void mgos_fingerprint_index_clean(struct mgos_fingerprint *dev,
+                                  uint32_t *watch, uint16_t id);
+int16_t mgos_fingerprint_index_first_free(struct mgos_fingerprint *dev);
+int16_t mgos_fingerprint_index_reload(struct mgos_fingerprint *dev);
+uint16_t mgos_fingerprint_index_count(struct mgos_fingerprint *dev);
+
+// Timeouts per command (mgos_fingerprint_timeout.c)
+int8_t mgos_fingerprint_timeout_slot(uint8_t cmd);
+uint8_t mgos_fingerprint_timeout_cmd(int8_t slot);
+void mgos_fingerprint_timeout_init(struct mgos_fingerprint *dev,
+                                   const struct mgos_fingerprint_cfg *cfg);
+uint16_t mgos_fingerprint_timeout_get(struct mgos_fingerprint *dev,
+                                      uint8_t cmd, bool data_phase);
+void mgos_fingerprint_timeout_sample(struct mgos_fingerprint *dev, uint8_t cmd,
+                                     uint32_t us);
+void mgos_fingerprint_timeout_expired(struct mgos_fingerprint *dev,
+                                      uint8_t cmd);
+
+// Statistics per command (mgos_fingerprint_stats.c)
+bool mgos_fingerprint_stats_init(struct mgos_fingerprint *dev,
+                                 const struct mgos_fingerprint_cfg *cfg);
+void mgos_fingerprint_stats_deinit(struct mgos_fingerprint *dev);
+void mgos_fingerprint_stats_sent(struct mgos_fingerprint *dev, uint8_t cmd,
+                                 uint32_t write_us);
+void mgos_fingerprint_stats_rx(struct mgos_fingerprint *dev);
+void mgos_fingerprint_stats_checksum_error(struct mgos_fingerprint *dev);
+void mgos_fingerprint_stats_bad_packet(struct mgos_fingerprint *dev);
+void mgos_fingerprint_stats_done(struct mgos_fingerprint *dev, uint8_t cmd,
+                                 int16_t rc);
+
+// Transports (mgos_fingerprint_transport.c)
+void mgos_fingerprint_uart_transport(struct mgos_fingerprint *dev,
+                                     struct mgos_fingerprint_transport *t);
+
+// Frame trace (mgos_fingerprint_trace.c)
+bool mgos_fingerprint_trace_init(struct mgos_fingerprint *dev, uint16_t len);
+void mgos_fingerprint_trace_deinit(struct mgos_fingerprint *dev);
+void mgos_fingerprint_trace_tx(struct mgos_fingerprint *dev,
+                               const struct mgos_fingerprint_packet *pkt,
+                               size_t written);
+void mgos_fingerprint_trace_rx(struct mgos_fingerprint *dev, int16_t rc);
+
+// Descriptor cache (mgos_fingerprint_cache.c)
+bool mgos_fingerprint_cache_init(struct mgos_fingerprint *dev,
+                                 const struct mgos_fingerprint_cfg *cfg);
+void mgos_fingerprint_cache_deinit(struct mgos_fingerprint *dev);
+bool mgos_fingerprint_cache_load(struct mgos_fingerprint *dev);
+void mgos_fingerprint_cache_save(struct mgos_fingerprint *dev);
+void mgos_fingerprint_cache_touch(struct mgos_fingerprint *dev);
+
+bool mgos_fingerprint_uart_baud_set(struct mgos_fingerprint *dev,
+                                    uint32_t baud);
+
+// Service (mgos_fingerprint_svc.c): one tick of the capture loop.
+void mgos_fingerprint_svc_timer(void *arg);
+
+// Reader manager (mgos_fingerprint_mgr.c): one tick of the shared scheduler.
+void mgos_fingerprint_mgr_tick(void *arg);
+
+// Bulk import pipeline (mgos_fingerprint_bulk.c). With a `source`, template
+// bytes are pulled from it in order instead of from tpl[].data.
+int16_t mgos_fingerprint_import_run(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_template *tpl,
+    uint16_t count, uint16_t *next, mgos_fingerprint_progress_cb progress,
+    void *ud, mgos_fingerprint_data_source source, void *source_ud);
+// Ranges of DELETE for the ids set in `bitmap`, planned from the index as it
+// is; `ranges` may be NULL to only count them.
+uint16_t mgos_fingerprint_revoke_plan(
+    struct mgos_fingerprint *dev, const uint8_t *bitmap, uint16_t nbits,
+    struct mgos_fingerprint_delete_range *ranges, uint16_t max_ranges);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Reader manager: one scheduler for the service of several modules. The
+// per-device service timers of mgos_fingerprint_svc_init() are replaced by a
+// single timer at the poll interval, which polls every reader and runs the
+// service step of each one whose period has passed. Readers start out
+// spread over the period, so their captures do not line up.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+struct mgos_fingerprint_mgr_reader {
+  struct mgos_fingerprint_mgr *mgr;
+  struct mgos_fingerprint *dev;
+  uint8_t num;
+  int64_t due_us;  // next service step
+};
+
+struct mgos_fingerprint_mgr {
+  struct mgos_fingerprint_mgr_reader *readers[MGOS_FINGERPRINT_MGR_READERS];
+  uint8_t num_readers;
+  uint8_t first;  // reader to serve first on the next tick
+  uint32_t period_us;
+  mgos_timer_id timer_id;
+  mgos_fingerprint_mgr_handler handler;
+  void *handler_user_data;
+};
+
+static void mgos_fingerprint_mgr_ev(struct mgos_fingerprint *dev, int ev,
+                                    void *ev_data, void *user_data) {
+  struct mgos_fingerprint_mgr_reader *r =
+      (struct mgos_fingerprint_mgr_reader *) user_data;
+
+  if (r->mgr->handler)
+    r->mgr->handler(r->mgr, r->num, ev, ev_data, r->mgr->handler_user_data);
+  (void) dev;
+}
+
+void mgos_fingerprint_mgr_tick(void *arg) {
+  struct mgos_fingerprint_mgr *mgr = (struct mgos_fingerprint_mgr *) arg;
+  int64_t now = mgos_uptime_micros();
+
+  if (mgr->num_readers == 0) return;
+  for (uint8_t i = 0; i < mgr->num_readers; i++) {
+    struct mgos_fingerprint_mgr_reader *r =
+        mgr->readers[(mgr->first + i) % mgr->num_readers];
+
+    mgos_fingerprint_poll(r->dev);
+    if (r->dev->svc_busy || now < r->due_us) continue;
+    r->due_us = now + mgr->period_us;
+    mgos_fingerprint_svc_timer(r->dev);
+  }
+  mgr->first = (mgr->first + 1) % mgr->num_readers;
+}
+
+struct mgos_fingerprint_mgr *mgos_fingerprint_mgr_create(
+    uint16_t period_ms, mgos_fingerprint_mgr_handler handler, void *user_data) {
+  struct mgos_fingerprint_mgr *mgr = calloc(1, sizeof(*mgr));
+
+  if (!mgr) return NULL;
+  mgr->period_us = period_ms * 1000UL;
+  mgr->handler = handler;
+  mgr->handler_user_data = user_data;
+  mgr->timer_id =
+      mgos_set_timer(MGOS_FINGERPRINT_POLL_INTERVAL, MGOS_TIMER_REPEAT,
+                     mgos_fingerprint_mgr_tick, mgr);
+  LOG(LL_INFO, ("Reader manager initialized, period=%ums", period_ms));
+  return mgr;
+}
+
+void mgos_fingerprint_mgr_destroy(struct mgos_fingerprint_mgr **mgr) {
+  if (!mgr || !*mgr) return;
+  if ((*mgr)->timer_id) mgos_clear_timer((*mgr)->timer_id);
+  for (uint8_t i = 0; i < (*mgr)->num_readers; i++) {
+    mgos_fingerprint_destroy(&(*mgr)->readers[i]->dev);
+    free((*mgr)->readers[i]);
+  }
+  free(*mgr);
+  *mgr = NULL;
+}
+
+int8_t mgos_fingerprint_mgr_add(struct mgos_fingerprint_mgr *mgr,
+                                const struct mgos_fingerprint_cfg *cfg) {
+  struct mgos_fingerprint_mgr_reader *r;
+  struct mgos_fingerprint_cfg rcfg;
+
+  if (!mgr || !cfg || mgr->num_readers == MGOS_FINGERPRINT_MGR_READERS)
+    return -1;
+  if (!(r = calloc(1, sizeof(*r)))) return -1;
+  r->mgr = mgr;
+  r->num = mgr->num_readers;
+  rcfg = *cfg;
+  rcfg.handler = mgos_fingerprint_mgr_ev;
+  rcfg.handler_user_data = r;
+  if (!(r->dev = mgos_fingerprint_create(&rcfg))) {
+    LOG(LL_ERROR, ("Could not add reader %u", r->num));
+    free(r);
+    return -1;
+  }
+  r->due_us = mgos_uptime_micros() + mgr->period_us * r->num /
+                                         MGOS_FINGERPRINT_MGR_READERS;
+  mgr->readers[mgr->num_readers++] = r;
+  mgos_fingerprint_svc_mode_set(r->dev, MGOS_FINGERPRINT_MODE_MATCH);
+  LOG(LL_INFO, ("Reader %u on UART%d", r->num, r->dev->uart_no));
+  return r->num;
+}
+
+uint8_t mgos_fingerprint_mgr_count(struct mgos_fingerprint_mgr *mgr) {
+  return mgr ? mgr->num_readers : 0;
+}
+
+struct mgos_fingerprint *mgos_fingerprint_mgr_get(
+    struct mgos_fingerprint_mgr *mgr, uint8_t reader) {
+  if (!mgr || reader >= mgr->num_readers) return NULL;
+  return mgr->readers[reader]->dev;
+}
@@ -0,0 +1,588 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+// Frames `datalen` bytes already placed in pkt->data: fills in the header and
+// appends the checksum. Returns the number of bytes to put on the wire.
+uint16_t mgos_fingerprint_frame_build(struct mgos_fingerprint *dev,
+                                      struct mgos_fingerprint_packet *pkt,
+                                      uint8_t packettype, uint16_t datalen) {
+  if (datalen > sizeof(pkt->data) - 2) return 0;
+
+  pkt->startcode = htons(MGOS_FINGERPRINT_STARTCODE);
+  pkt->address = htonl(dev->address);
+  pkt->packettype = packettype;
+  pkt->len = htons(datalen + 2);  // 2 bytes checksum
+
+  uint16_t sum = (datalen + 2) + packettype;
+  for (uint16_t i = 0; i < datalen; i++) {
+    sum += pkt->data[i];
+  }
+  pkt->data[datalen] = sum >> 8;
+  pkt->data[datalen + 1] = sum & 0xFF;
+  return MGOS_FINGERPRINT_HEADER_LEN + datalen + 2;
+}
+
+// Payload bytes per data packet, as negotiated in the system parameters.
+uint16_t mgos_fingerprint_data_len(struct mgos_fingerprint *dev) {
+  return 32 << (dev->system_params.datapacket_length & 0x03);
+}
+
+static void mgos_fingerprint_tx_prepare(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_cmd *cmd) {
+  memcpy(dev->tx.data, cmd->data, cmd->len);
+  dev->tx_len = mgos_fingerprint_frame_build(
+      dev, &dev->tx, MGOS_FINGERPRINT_COMMANDPACKET, cmd->len);
+  dev->tx_ready = true;
+}
+
+static void mgos_fingerprint_cmd_timer_cb(void *arg);
+static void mgos_fingerprint_rx_start(struct mgos_fingerprint *dev);
+
+static void mgos_fingerprint_cmd_arm(struct mgos_fingerprint *dev) {
+  uint16_t timeout_ms =
+      dev->cmd.timeout_ms
+          ? dev->cmd.timeout_ms
+          : mgos_fingerprint_timeout_get(dev, dev->cmd.data[0], dev->stream_rx);
+
+  if (dev->cmd_timer_id) mgos_clear_timer(dev->cmd_timer_id);
+  dev->cmd_deadline = mgos_uptime() + timeout_ms / 1e3;
+  dev->cmd_timer_id =
+      mgos_set_timer(timeout_ms, 0, mgos_fingerprint_cmd_timer_cb, dev);
+}
+
+// Moves the head of the queue onto the wire. Its frame is usually prebuilt
+// while the previous acknowledge was in flight, and the frame behind it is
+// built right after sending, so back-to-back commands leave no host-side gap.
+static void mgos_fingerprint_cmd_start(struct mgos_fingerprint *dev) {
+  if (dev->cmd_busy || dev->queue_len == 0 || dev->rx_guard_us) return;
+
+  dev->cmd = dev->queue[dev->queue_head];
+  dev->queue_head = (dev->queue_head + 1) % MGOS_FINGERPRINT_QUEUE_LEN;
+  dev->queue_len--;
+  if (!dev->tx_ready) mgos_fingerprint_tx_prepare(dev, &dev->cmd);
+  dev->tx_ready = false;
+  dev->cmd_busy = true;
+  dev->cmd_sent_us = mgos_uptime_micros();
+
+  mgos_fingerprint_rx_start(dev);
+  mgos_fingerprint_trace_tx(
+      dev, &dev->tx, dev->io.write(dev->io.ctx, &dev->tx, dev->tx_len));
+  if (dev->io.flush) dev->io.flush(dev->io.ctx);
+  mgos_fingerprint_stats_sent(
+      dev, dev->cmd.data[0],
+      (uint32_t)(mgos_uptime_micros() - dev->cmd_sent_us));
+
+  mgos_fingerprint_cmd_arm(dev);
+
+  if (dev->queue_len > 0)
+    mgos_fingerprint_tx_prepare(dev, &dev->queue[dev->queue_head]);
+}
+
+// Retires the command in flight: sends the next queued command and then hands
+// the result to the caller. Callbacks can chain further commands straight away.
+static void mgos_fingerprint_cmd_finish(struct mgos_fingerprint *dev,
+                                        struct mgos_fingerprint_cmd *cmd,
+                                        struct mgos_fingerprint_result *res) {
+  mgos_fingerprint_stats_done(dev, cmd->data[0], res->rc);
+  dev->cmd_busy = false;
+  dev->stream_rx = false;
+  if (dev->cmd_timer_id) {
+    mgos_clear_timer(dev->cmd_timer_id);
+    dev->cmd_timer_id = 0;
+  }
+  mgos_fingerprint_cmd_start(dev);
+
+  if (cmd->cb) cmd->cb(dev, res, cmd->cb_arg);
+}
+
+// Sends cmd->stream_len bytes from the source, in data packets of the
+// negotiated length, the last one marked end-of-data. The module does not
+// acknowledge them.
+static int16_t mgos_fingerprint_stream_tx(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_cmd *cmd,
+    struct mgos_fingerprint_result *res) {
+  struct mgos_fingerprint_packet pkt;
+  uint16_t chunk = mgos_fingerprint_data_len(dev);
+
+  while (res->transferred < cmd->stream_len) {
+    uint32_t left = cmd->stream_len - res->transferred;
+    uint16_t n = left < chunk ? left : chunk;
+    uint16_t len;
+
+    if (!cmd->source(pkt.data, n, cmd->stream_arg))
+      return MGOS_FINGERPRINT_ABORTED;
+    res->transferred += n;
+    len = mgos_fingerprint_frame_build(dev, &pkt,
+                                       res->transferred < cmd->stream_len
+                                           ? MGOS_FINGERPRINT_DATAPACKET
+                                           : MGOS_FINGERPRINT_ENDDATAPACKET,
+                                       n);
+    mgos_fingerprint_trace_tx(dev, &pkt,
+                              dev->io.write(dev->io.ctx, &pkt, len));
+  }
+  if (dev->io.flush) dev->io.flush(dev->io.ctx);
+  return MGOS_FINGERPRINT_OK;
+}
+
+// Handles a data packet (or an error) while receiving the data phase. Each
+// payload goes straight from the receive buffer to the sink.
+static void mgos_fingerprint_stream_rx(struct mgos_fingerprint *dev,
+                                       int16_t rc) {
+  struct mgos_fingerprint_cmd cmd = dev->cmd;
+  struct mgos_fingerprint_result *res = &dev->stream_res, final;
+  uint8_t type = dev->packet.packettype;
+
+  if (rc < 0 || (type != MGOS_FINGERPRINT_DATAPACKET &&
+                 type != MGOS_FINGERPRINT_ENDDATAPACKET)) {
+    res->rc = rc < 0 ? rc : MGOS_FINGERPRINT_READ_ERROR;
+    goto out;
+  }
+
+  // After an abort the remaining packets are still read, so that the next
+  // command does not trip over them.
+  if (!dev->stream_abort) {
+    if (cmd.sink(dev->packet.data, rc, cmd.stream_arg))
+      res->transferred += rc;
+    else
+      dev->stream_abort = true;
+  }
+  if (type == MGOS_FINGERPRINT_DATAPACKET) {
+    mgos_fingerprint_rx_start(dev);
+    mgos_fingerprint_cmd_arm(dev);
+    return;
+  }
+  if (dev->stream_abort) res->rc = MGOS_FINGERPRINT_ABORTED;
+
+out:
+  final = *res;
+  mgos_fingerprint_cmd_finish(dev, &cmd, &final);
+}
+
+// Finishes the command in flight: decodes the acknowledge (if any), runs the
+// data phase if the command has one, and retires it.
+static void mgos_fingerprint_cmd_complete(struct mgos_fingerprint *dev,
+                                          int16_t rc) {
+  struct mgos_fingerprint_cmd cmd = dev->cmd;
+  struct mgos_fingerprint_result res;
+
+  memset(&res, 0, sizeof(res));
+  res.cmd = cmd.data[0];
+  res.rc = rc;
+  if (rc >= 0) {
+    if (dev->packet.packettype != MGOS_FINGERPRINT_ACKPACKET ||
+        dev->packet.len < 3) {
+      mgos_fingerprint_stats_bad_packet(dev);
+      res.rc = MGOS_FINGERPRINT_READ_ERROR;
+    } else {
+      res.rc = dev->packet.data[0];  // confirmation code
+      res.data = &dev->packet.data[1];
+      res.len = dev->packet.len - 3;
+    }
+    // Commands with a timeout of their own, like the multi-step ones, do not
+    // teach the estimate, and neither do failures, which the module may
+    // report before doing the work.
+    if (cmd.timeout_ms == 0 && res.rc == MGOS_FINGERPRINT_OK)
+      mgos_fingerprint_timeout_sample(
+          dev, cmd.data[0],
+          (uint32_t)(mgos_uptime_micros() - dev->cmd_sent_us));
+  }
+
+  if (cmd.done) cmd.done(dev, &cmd, &res);
+
+  if (res.more) {
+    // Intermediate acknowledge of a multi-step command: the command stays in
+    // flight, with a fresh deadline, until its final acknowledge arrives.
+    mgos_fingerprint_rx_start(dev);
+    mgos_fingerprint_cmd_arm(dev);
+    if (cmd.cb) cmd.cb(dev, &res, cmd.cb_arg);
+    return;
+  }
+
+  if (res.rc == MGOS_FINGERPRINT_OK && cmd.sink) {
+    // The acknowledge of an upload command carries no payload; data packets
+    // follow it, each with a fresh deadline.
+    res.data = NULL;
+    res.len = 0;
+    dev->stream_res = res;
+    dev->stream_rx = true;
+    dev->stream_abort = false;
+    mgos_fingerprint_rx_start(dev);
+    mgos_fingerprint_cmd_arm(dev);
+    return;
+  }
+  if (res.rc == MGOS_FINGERPRINT_OK && cmd.source)
+    res.rc = mgos_fingerprint_stream_tx(dev, &cmd, &res);
+
+  mgos_fingerprint_cmd_finish(dev, &cmd, &res);
+}
+
+static void mgos_fingerprint_rx_start(struct mgos_fingerprint *dev) {
+  dev->rx_have = 0;
+  dev->rx_want = MGOS_FINGERPRINT_HEADER_LEN;
+  dev->rx_busy = true;
+  dev->rx_hunting = false;
+}
+
+static void mgos_fingerprint_rx_done(struct mgos_fingerprint *dev,
+                                     int16_t rc) {
+  mgos_fingerprint_trace_rx(dev, rc);
+  dev->rx_busy = false;
+  // The module may still be sending the rest of this transaction: a late
+  // acknowledge, or the data packets behind a lost one. Left in the line,
+  // they would be taken for the reply to the next command.
+  if (rc < 0)
+    dev->rx_guard_us = mgos_uptime_micros() + MGOS_FINGERPRINT_RX_GUARD * 1000;
+  if (!dev->cmd_busy) return;
+  if (dev->stream_rx)
+    mgos_fingerprint_stream_rx(dev, rc);
+  else
+    mgos_fingerprint_cmd_complete(dev, rc);
+}
+
+// A header is only taken if it starts with the start code, is addressed to
+// us, has a type the module sends and a payload that fits.
+static bool mgos_fingerprint_rx_header_ok(struct mgos_fingerprint *dev) {
+  const uint8_t *h = (const uint8_t *) &dev->packet;
+  uint32_t address = ((uint32_t) h[2] << 24) | ((uint32_t) h[3] << 16) |
+                     ((uint32_t) h[4] << 8) | h[5];
+  uint16_t len = (h[7] << 8) | h[8];
+
+  if (h[0] != (MGOS_FINGERPRINT_STARTCODE >> 8) ||
+      h[1] != (MGOS_FINGERPRINT_STARTCODE & 0xFF) || address != dev->address)
+    return false;
+  if (h[6] != MGOS_FINGERPRINT_ACKPACKET &&
+      h[6] != MGOS_FINGERPRINT_DATAPACKET &&
+      h[6] != MGOS_FINGERPRINT_ENDDATAPACKET)
+    return false;
+  return len >= 2 && len <= sizeof(dev->packet.data);
+}
+
+// Drops the partial header up to the next byte that may begin a start code,
+// keeping what follows, so that noise costs a few bytes of the stream rather
+// than the transaction.
+static void mgos_fingerprint_rx_resync(struct mgos_fingerprint *dev) {
+  uint8_t *h = (uint8_t *) &dev->packet;
+  uint16_t skip = 1;
+
+  while (skip < dev->rx_have && h[skip] != (MGOS_FINGERPRINT_STARTCODE >> 8))
+    skip++;
+  memmove(h, h + skip, dev->rx_have - skip);
+  dev->rx_have -= skip;
+  dev->link_stats.discarded += skip;
+  if (!dev->rx_hunting) {
+    dev->rx_hunting = true;
+    dev->link_stats.resyncs++;
+    LOG(LL_DEBUG, ("UART%d lost frame sync", dev->uart_no));
+  }
+}
+
+// Accounts for `n` bytes that were just appended to the partial frame in
+// dev->packet. Once the header is in, the payload length is known and the
+// frame is completed when its checksum has arrived.
+static void mgos_fingerprint_rx_advance(struct mgos_fingerprint *dev,
+                                        size_t n) {
+  dev->rx_have += n;
+  if (dev->rx_have < dev->rx_want) return;
+
+  if (dev->rx_want == MGOS_FINGERPRINT_HEADER_LEN) {
+    if (!mgos_fingerprint_rx_header_ok(dev)) {
+      mgos_fingerprint_rx_resync(dev);
+      return;
+    }
+    dev->rx_hunting = false;
+    dev->packet.startcode = ntohs(dev->packet.startcode);
+    dev->packet.address = ntohl(dev->packet.address);
+    dev->packet.len = ntohs(dev->packet.len);
+    dev->rx_want += dev->packet.len;
+    return;
+  }
+
+  uint16_t sum = dev->packet.len + dev->packet.packettype;
+  for (uint16_t i = 0; i < dev->packet.len - 2; i++) sum += dev->packet.data[i];
+  if (dev->packet.data[dev->packet.len - 2] != sum >> 8 ||
+      dev->packet.data[dev->packet.len - 1] != (sum & 0xFF)) {
+    // Checksum error: the frame is dropped, not decoded.
+    dev->link_stats.checksum_errors++;
+    mgos_fingerprint_stats_checksum_error(dev);
+    mgos_fingerprint_rx_done(dev, MGOS_FINGERPRINT_READ_ERROR);
+    return;
+  }
+  // Packet complete, ship it!
+  mgos_fingerprint_rx_done(dev, dev->packet.len - 2);
+}
+
+// Drains whatever the UART has buffered into the frame parser. Reads are sized
+// to the remainder of the current header or payload, so bytes go straight
+// into dev->packet without an intermediate copy.
+static void mgos_fingerprint_rx_poll(struct mgos_fingerprint *dev) {
+  uint8_t discard[16];
+  size_t n;
+
+  while (dev->rx_busy) {
+    n = dev->io.read(dev->io.ctx, ((uint8_t *) &dev->packet) + dev->rx_have,
+                     dev->rx_want - dev->rx_have);
+    if (n == 0) return;
+    mgos_fingerprint_stats_rx(dev);
+    mgos_fingerprint_rx_advance(dev, n);
+  }
+
+  // Nobody is waiting for a frame: drop stray bytes (eg. the power-on 0x55).
+  // Each one pushes the end of a guard further out.
+  while ((n = dev->io.read(dev->io.ctx, discard, sizeof(discard))) > 0) {
+    dev->link_stats.discarded += n;
+    if (dev->rx_guard_us)
+      dev->rx_guard_us =
+          mgos_uptime_micros() + MGOS_FINGERPRINT_RX_GUARD * 1000;
+  }
+}
+
+// Starts the next command once the line has been quiet for the guard time,
+// and until then wakes up to look again.
+static void mgos_fingerprint_check_guard(struct mgos_fingerprint *dev) {
+  int64_t left;
+
+  if (!dev->rx_guard_us || dev->cmd_busy) return;
+  left = dev->rx_guard_us - mgos_uptime_micros();
+  if (left > 0) {
+    if (!dev->cmd_timer_id)
+      dev->cmd_timer_id = mgos_set_timer(left / 1000 + 1, 0,
+                                         mgos_fingerprint_cmd_timer_cb, dev);
+    return;
+  }
+  dev->rx_guard_us = 0;
+  mgos_fingerprint_cmd_start(dev);
+}
+
+// Drops whatever is buffered and ends a guard, eg. after a change of baud
+// rate, which leaves nothing of the old transaction worth waiting for.
+void mgos_fingerprint_rx_flush(struct mgos_fingerprint *dev) {
+  uint8_t discard[16];
+  size_t n;
+
+  mgos_rlock(dev->lock);
+  while ((n = dev->io.read(dev->io.ctx, discard, sizeof(discard))) > 0)
+    dev->link_stats.discarded += n;
+  dev->rx_guard_us = 0;
+  if (dev->cmd_timer_id && !dev->cmd_busy) {
+    mgos_clear_timer(dev->cmd_timer_id);
+    dev->cmd_timer_id = 0;
+  }
+  mgos_fingerprint_cmd_start(dev);
+  mgos_runlock(dev->lock);
+}
+
+// Runs the receive parser over frames held in memory rather than read from
+// the transport, the way mgos_fingerprint_rx_poll() would take them. Returns
+// the number of frames completed. Used to measure the cost of parsing.
+uint32_t mgos_fingerprint_rx_feed(struct mgos_fingerprint *dev,
+                                  const uint8_t *buf, size_t len) {
+  uint32_t frames = 0;
+
+  while (len > 0) {
+    size_t n;
+
+    if (!dev->rx_busy) mgos_fingerprint_rx_start(dev);
+    n = dev->rx_want - dev->rx_have;
+    if (n > len) n = len;
+    memcpy(((uint8_t *) &dev->packet) + dev->rx_have, buf, n);
+    buf += n;
+    len -= n;
+    mgos_fingerprint_rx_advance(dev, n);
+    if (!dev->rx_busy) frames++;
+  }
+  return frames;
+}
+
+static void mgos_fingerprint_check_timeout(struct mgos_fingerprint *dev) {
+  if (!dev->cmd_busy || mgos_uptime() < dev->cmd_deadline) return;
+  dev->link_stats.timeouts++;
+  mgos_fingerprint_timeout_expired(dev, dev->cmd.data[0]);
+  mgos_fingerprint_rx_done(dev, MGOS_FINGERPRINT_TIMEOUT);
+}
+
+// Polls the UART and expires the command in flight. Runs under the device
+// lock, so the dispatcher and a waiter in another task never race.
+void mgos_fingerprint_poll(struct mgos_fingerprint *dev) {
+  mgos_rlock(dev->lock);
+  mgos_fingerprint_rx_poll(dev);
+  mgos_fingerprint_check_timeout(dev);
+  mgos_fingerprint_check_guard(dev);
+  mgos_runlock(dev->lock);
+}
+
+static void mgos_fingerprint_uart_dispatcher(int uart_no, void *arg) {
+  struct mgos_fingerprint *dev = (struct mgos_fingerprint *) arg;
+
+  if (!dev || mgos_uart_read_avail(uart_no) == 0) return;
+  mgos_fingerprint_poll(dev);
+}
+
+static void mgos_fingerprint_cmd_timer_cb(void *arg) {
+  struct mgos_fingerprint *dev = (struct mgos_fingerprint *) arg;
+
+  dev->cmd_timer_id = 0;
+  mgos_fingerprint_poll(dev);
+}
+
+void mgos_fingerprint_get_link_stats(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_link_stats *stats) {
+  if (!dev || !stats) return;
+  mgos_rlock(dev->lock);
+  *stats = dev->link_stats;
+  mgos_runlock(dev->lock);
+}
+
+// Another transport has no dispatcher to tell us that bytes arrived, so it is
+// polled instead.
+static void mgos_fingerprint_io_timer_cb(void *arg) {
+  struct mgos_fingerprint *dev = (struct mgos_fingerprint *) arg;
+
+  if (dev->cmd_busy || dev->rx_guard_us) mgos_fingerprint_poll(dev);
+}
+
+bool mgos_fingerprint_proto_init(struct mgos_fingerprint *dev) {
+  dev->lock = mgos_rlock_create();
+  if (!dev->lock) return false;
+  if (dev->io.read) {
+    dev->io_timer_id =
+        mgos_set_timer(MGOS_FINGERPRINT_POLL_INTERVAL, MGOS_TIMER_REPEAT,
+                       mgos_fingerprint_io_timer_cb, dev);
+    return true;
+  }
+  mgos_fingerprint_uart_transport(dev, &dev->io);
+  dev->io_uart = true;
+  mgos_uart_set_dispatcher(dev->uart_no, mgos_fingerprint_uart_dispatcher,
+                           dev);
+  return true;
+}
+
+void mgos_fingerprint_proto_deinit(struct mgos_fingerprint *dev) {
+  if (dev->io_uart) mgos_uart_set_dispatcher(dev->uart_no, NULL, NULL);
+  if (dev->io_timer_id) mgos_clear_timer(dev->io_timer_id);
+  dev->io_timer_id = 0;
+  if (dev->io.close) dev->io.close(dev->io.ctx);
+  memset(&dev->io, 0, sizeof(dev->io));
+  if (dev->cmd_timer_id) mgos_clear_timer(dev->cmd_timer_id);
+  dev->cmd_timer_id = 0;
+  if (dev->lock) mgos_rlock_destroy(dev->lock);
+  dev->lock = NULL;
+}
+
+static int16_t mgos_fingerprint_enqueue(struct mgos_fingerprint *dev,
+                                        const struct mgos_fingerprint_cmd *cmd,
+                                        bool front) {
+  uint8_t slot;
+
+  if (!dev || !cmd || cmd->len == 0) return MGOS_FINGERPRINT_READ_ERROR;
+
+  mgos_rlock(dev->lock);
+  if (dev->queue_len == MGOS_FINGERPRINT_QUEUE_LEN) {
+    mgos_runlock(dev->lock);
+    return MGOS_FINGERPRINT_BUSY;
+  }
+  if (front) {
+    dev->queue_head = (dev->queue_head + MGOS_FINGERPRINT_QUEUE_LEN - 1) %
+                      MGOS_FINGERPRINT_QUEUE_LEN;
+    slot = dev->queue_head;
+  } else {
+    slot = (dev->queue_head + dev->queue_len) % MGOS_FINGERPRINT_QUEUE_LEN;
+  }
+  dev->queue[slot] = *cmd;
+  dev->queue_len++;
+
+  if (!dev->cmd_busy) {
+    mgos_fingerprint_cmd_start(dev);
+  } else if (front || dev->queue_len == 1) {
+    // Next in line: build its frame while the module is still working. This
+    // replaces a frame prebuilt for the command it jumped ahead of.
+    mgos_fingerprint_tx_prepare(dev, &dev->queue[slot]);
+  }
+  mgos_runlock(dev->lock);
+  return MGOS_FINGERPRINT_OK;
+}
+
+int16_t mgos_fingerprint_submit(struct mgos_fingerprint *dev,
+                                const struct mgos_fingerprint_cmd *cmd) {
+  return mgos_fingerprint_enqueue(dev, cmd, false);
+}
+
+// Puts cmd ahead of everything queued. A done hook uses it to retry its
+// command before the ones that were submitted behind it run.
+int16_t mgos_fingerprint_submit_next(struct mgos_fingerprint *dev,
+                                     const struct mgos_fingerprint_cmd *cmd) {
+  return mgos_fingerprint_enqueue(dev, cmd, true);
+}
+
+// Synchronous callers wait for room in the queue, so that they never see
+// MGOS_FINGERPRINT_BUSY from their own submission. They also wait for a
+// service chain to finish: its steps are queued one at a time, and a command
+// slipped in between would run on the char buffers the chain is using. The
+// handler it calls on the way may still use the synchronous API.
+static bool mgos_fingerprint_sync_blocked(struct mgos_fingerprint *dev) {
+  return dev->queue_len == MGOS_FINGERPRINT_QUEUE_LEN ||
+         (dev->svc_busy && !dev->svc_event);
+}
+
+void mgos_fingerprint_sync_begin(struct mgos_fingerprint *dev,
+                                 struct mgos_fingerprint_sync *s) {
+  memset(s, 0, sizeof(*s));
+  while (dev && mgos_fingerprint_sync_blocked(dev)) {
+    mgos_fingerprint_poll(dev);
+    if (mgos_fingerprint_sync_blocked(dev))
+      mgos_msleep(MGOS_FINGERPRINT_POLL_INTERVAL);
+  }
+}
+
+// Keeps a copy of the acknowledge payload: by the time the waiter looks at
+// it, the receive buffer may already hold the reply to a queued command.
+void mgos_fingerprint_sync_cb(struct mgos_fingerprint *dev,
+                              const struct mgos_fingerprint_result *res,
+                              void *cb_arg) {
+  struct mgos_fingerprint_sync *s = (struct mgos_fingerprint_sync *) cb_arg;
+
+  s->res = *res;
+  s->res.len = res->len < sizeof(s->data) ? res->len : sizeof(s->data);
+  if (res->data) memcpy(s->data, res->data, s->res.len);
+  s->res.data = s->data;
+  s->done = true;
+  (void) dev;
+}
+
+// Drives the device until `*done` is set by a callback, yielding the CPU in
+// between polls rather than spinning on the UART while the module is busy.
+void mgos_fingerprint_wait(struct mgos_fingerprint *dev, const bool *done) {
+  while (!*done) {
+    mgos_fingerprint_poll(dev);
+    if (!*done) mgos_msleep(MGOS_FINGERPRINT_POLL_INTERVAL);
+  }
+}
+
+int16_t mgos_fingerprint_sync_wait(struct mgos_fingerprint *dev,
+                                   struct mgos_fingerprint_sync *s,
+                                   int16_t submitted) {
+  if (submitted != MGOS_FINGERPRINT_OK) return submitted;
+
+  mgos_fingerprint_wait(dev, &s->done);
+  return s->res.rc;
+}
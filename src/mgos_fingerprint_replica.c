@@ -0,0 +1,265 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replication of the flash database of one module onto others. The replica
+// remembers a CRC32 digest for every slot of the source and of each target.
+// A digest is trusted for as long as the replica's own change bitmap of that
+// module says the slot was not touched, so a resync only moves templates that
+// were stored, overwritten or deleted since the previous one, whatever other
+// replicas the module takes part in. A slot used on both sides whose target
+// digest is unknown, as on the first sync, is read back from the target and
+// only written when it differs.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_crc32.h"
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+// Digest of an empty or unknown slot. A template whose CRC happens to be 0 is
+// merely copied again on every sync.
+#define REPLICA_NONE 0
+
+struct mgos_fingerprint_replica_dev {
+  struct mgos_fingerprint *dev;
+  uint32_t *digest;
+  uint32_t *dirty;  // slots changed since this replica last looked
+};
+
+struct mgos_fingerprint_replica {
+  struct mgos_fingerprint_replica_dev src;
+  struct mgos_fingerprint_replica_dev dst[MGOS_FINGERPRINT_REPLICA_TARGETS];
+  uint8_t num_dst;
+  uint16_t slots;  // smallest library size of the set
+  uint8_t *buf;    // one template, source to targets
+  uint8_t *cmp;    // one template, read back from a target
+  size_t buf_size;
+};
+
+static bool mgos_fingerprint_replica_dev_init(
+    struct mgos_fingerprint_replica_dev *t, struct mgos_fingerprint *dev,
+    uint16_t slots) {
+  t->dev = dev;
+  t->digest = calloc(slots ? slots : 1, sizeof(uint32_t));
+  t->dirty = calloc(dev->index_words ? dev->index_words : 1, sizeof(uint32_t));
+  if (!t->digest || !t->dirty) return false;
+  if (!mgos_fingerprint_index_watch(dev, t->dirty)) {
+    LOG(LL_ERROR, ("UART%d is in too many replicas", dev->uart_no));
+    free(t->dirty);
+    t->dirty = NULL;
+    return false;
+  }
+  return true;
+}
+
+static void mgos_fingerprint_replica_dev_deinit(
+    struct mgos_fingerprint_replica_dev *t) {
+  if (t->dirty) mgos_fingerprint_index_unwatch(t->dev, t->dirty);
+  free(t->dirty);
+  free(t->digest);
+}
+
+struct mgos_fingerprint_replica *mgos_fingerprint_replica_create(
+    struct mgos_fingerprint *src, struct mgos_fingerprint **dst,
+    uint8_t num_dst) {
+  struct mgos_fingerprint_replica *r;
+
+  if (!src || !dst || num_dst == 0 ||
+      num_dst > MGOS_FINGERPRINT_REPLICA_TARGETS)
+    return NULL;
+  if (!(r = calloc(1, sizeof(*r)))) return NULL;
+
+  r->slots = src->system_params.library_size;
+  r->buf_size = src->info.model_size;
+  for (uint8_t i = 0; i < num_dst; i++) {
+    if (dst[i]->system_params.library_size < r->slots)
+      r->slots = dst[i]->system_params.library_size;
+  }
+  r->buf = malloc(r->buf_size ? r->buf_size : 1);
+  r->cmp = malloc(r->buf_size ? r->buf_size : 1);
+  if (!r->buf || !r->cmp) goto err;
+  if (!mgos_fingerprint_replica_dev_init(&r->src, src, r->slots)) goto err;
+  for (uint8_t i = 0; i < num_dst; i++) {
+    r->num_dst++;
+    if (!mgos_fingerprint_replica_dev_init(&r->dst[i], dst[i], r->slots))
+      goto err;
+  }
+  return r;
+
+err:
+  mgos_fingerprint_replica_destroy(&r);
+  return NULL;
+}
+
+void mgos_fingerprint_replica_destroy(struct mgos_fingerprint_replica **r) {
+  if (!*r) return;
+  free((*r)->buf);
+  free((*r)->cmp);
+  if ((*r)->src.dev) mgos_fingerprint_replica_dev_deinit(&(*r)->src);
+  for (uint8_t i = 0; i < (*r)->num_dst; i++)
+    mgos_fingerprint_replica_dev_deinit(&(*r)->dst[i]);
+  free(*r);
+  *r = NULL;
+}
+
+// Reads template `id` of `t` into `buf` and records its digest.
+static int16_t mgos_fingerprint_replica_read(
+    struct mgos_fingerprint_replica *r, struct mgos_fingerprint_replica_dev *t,
+    uint16_t id, uint8_t *buf) {
+  size_t len = 0;
+  int16_t p;
+
+  p = mgos_fingerprint_model_load(t->dev, id, 1);
+  if (p != MGOS_FINGERPRINT_OK) return p;
+  p = mgos_fingerprint_model_download_buf(t->dev, 1, buf, r->buf_size, &len);
+  if (p != MGOS_FINGERPRINT_OK) return p;
+  if (len != r->buf_size) return MGOS_FINGERPRINT_READ_ERROR;
+
+  t->digest[id] = cs_crc32(0, buf, len);
+  mgos_fingerprint_index_clean(t->dev, t->dirty, id);
+  return MGOS_FINGERPRINT_OK;
+}
+
+// Reads template `id` of the source into r->buf.
+static int16_t mgos_fingerprint_replica_fetch(
+    struct mgos_fingerprint_replica *r, uint16_t id,
+    struct mgos_fingerprint_replica_stats *stats) {
+  int16_t p = mgos_fingerprint_replica_read(r, &r->src, id, r->buf);
+
+  if (p == MGOS_FINGERPRINT_OK && stats) stats->fetched++;
+  return p;
+}
+
+static int16_t mgos_fingerprint_replica_put(
+    struct mgos_fingerprint_replica_dev *t, uint16_t id, const uint8_t *buf,
+    size_t len, uint32_t digest) {
+  int16_t p;
+
+  p = mgos_fingerprint_model_upload_buf(t->dev, 1, buf, len);
+  if (p != MGOS_FINGERPRINT_OK) return p;
+  p = mgos_fingerprint_model_store(t->dev, id, 1);
+  if (p != MGOS_FINGERPRINT_OK) return p;
+  t->digest[id] = digest;
+  mgos_fingerprint_index_clean(t->dev, t->dirty, id);
+  return MGOS_FINGERPRINT_OK;
+}
+
+// Deletes the run of slots [first, id) on a target in one command.
+static int16_t mgos_fingerprint_replica_drop(
+    struct mgos_fingerprint_replica_dev *t, uint16_t first, uint16_t id,
+    struct mgos_fingerprint_replica_stats *stats) {
+  int16_t p = mgos_fingerprint_model_delete(t->dev, first, id - first);
+
+  if (p != MGOS_FINGERPRINT_OK) return p;
+  for (uint16_t i = first; i < id; i++) {
+    t->digest[i] = REPLICA_NONE;
+    mgos_fingerprint_index_clean(t->dev, t->dirty, i);
+  }
+  if (stats) stats->deleted += id - first;
+  return MGOS_FINGERPRINT_OK;
+}
+
+int16_t mgos_fingerprint_replica_sync(
+    struct mgos_fingerprint_replica *r,
+    struct mgos_fingerprint_replica_stats *stats) {
+  int32_t drop_from[MGOS_FINGERPRINT_REPLICA_TARGETS];
+  int16_t p = MGOS_FINGERPRINT_OK;
+
+  if (!r) return MGOS_FINGERPRINT_READ_ERROR;
+  if (stats) memset(stats, 0, sizeof(*stats));
+  if (!r->src.dev->index_valid &&
+      MGOS_FINGERPRINT_OK != (p = mgos_fingerprint_index_refresh(r->src.dev)))
+    return p;
+  for (uint8_t i = 0; i < r->num_dst; i++) {
+    drop_from[i] = -1;
+    if (!r->dst[i].dev->index_valid &&
+        MGOS_FINGERPRINT_OK !=
+            (p = mgos_fingerprint_index_refresh(r->dst[i].dev)))
+      return p;
+  }
+
+  // One pass over the slots, plus one to close runs of deletes at the end.
+  for (uint16_t id = 0; id <= r->slots; id++) {
+    bool src_used =
+        id < r->slots && mgos_fingerprint_index_used(r->src.dev, id);
+    bool fetched = false;
+
+    // A slot that changed on the source has an unknown digest.
+    if (id < r->slots &&
+        mgos_fingerprint_index_dirty(r->src.dev, r->src.dirty, id)) {
+      r->src.digest[id] = REPLICA_NONE;
+      if (!src_used)
+        mgos_fingerprint_index_clean(r->src.dev, r->src.dirty, id);
+    }
+
+    for (uint8_t i = 0; i < r->num_dst; i++) {
+      struct mgos_fingerprint_replica_dev *t = &r->dst[i];
+      bool dst_used =
+          id < r->slots && mgos_fingerprint_index_used(t->dev, id);
+
+      if (id < r->slots && mgos_fingerprint_index_dirty(t->dev, t->dirty, id))
+        t->digest[id] = REPLICA_NONE;
+
+      // Slots to clear on a target are collected into runs, and each run is
+      // deleted with a single command once it ends.
+      if (!src_used && dst_used) {
+        if (drop_from[i] < 0) drop_from[i] = id;
+        continue;
+      }
+      if (drop_from[i] >= 0) {
+        p = mgos_fingerprint_replica_drop(t, drop_from[i], id, stats);
+        if (p != MGOS_FINGERPRINT_OK) goto err;
+        drop_from[i] = -1;
+      }
+      if (!src_used) {
+        if (id < r->slots) mgos_fingerprint_index_clean(t->dev, t->dirty, id);
+        continue;
+      }
+
+      // An unknown source digest costs one fetch, which then serves every
+      // target that needs the template.
+      if (r->src.digest[id] == REPLICA_NONE && !fetched) {
+        p = mgos_fingerprint_replica_fetch(r, id, stats);
+        if (p != MGOS_FINGERPRINT_OK) goto err;
+        fetched = true;
+      }
+      // A target slot not looked at yet may hold the same template already,
+      // and reading it back spares the target's flash a write.
+      if (dst_used && t->digest[id] == REPLICA_NONE) {
+        p = mgos_fingerprint_replica_read(r, t, id, r->cmp);
+        if (p != MGOS_FINGERPRINT_OK) goto err;
+        if (stats) stats->compared++;
+      }
+      if (dst_used && t->digest[id] == r->src.digest[id]) continue;
+
+      if (!fetched) {
+        p = mgos_fingerprint_replica_fetch(r, id, stats);
+        if (p != MGOS_FINGERPRINT_OK) goto err;
+        fetched = true;
+      }
+      p = mgos_fingerprint_replica_put(t, id, r->buf, r->buf_size,
+                                       r->src.digest[id]);
+      if (p != MGOS_FINGERPRINT_OK) goto err;
+      if (stats) stats->copied++;
+    }
+  }
+  return MGOS_FINGERPRINT_OK;
+
+err:
+  LOG(LL_ERROR, ("Replication failed: %d", p));
+  return p;
+}
@@ -0,0 +1,293 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Sharded template library: the flash databases of several modules, each on
+// its own UART, used as one. Global ids run through the shards in the order
+// they were given, each shard starting where the previous one ends. A new
+// template goes to the shard with the most free slots, counted from the
+// host side index. A search moves the probe template from the module that
+// captured it to the other shards once, and then runs on all of them at the
+// same time, so it takes about one transfer and one search however many
+// shards there are.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+struct mgos_fingerprint_shard {
+  struct mgos_fingerprint_shards *s;
+  struct mgos_fingerprint *dev;
+  uint32_t base;  // global id of local slot 0
+  // State of the search in progress.
+  size_t off;  // bytes of the probe sent
+  bool done;
+  int16_t rc;
+  uint16_t finger_id;
+  uint16_t score;
+};
+
+struct mgos_fingerprint_shards {
+  struct mgos_fingerprint_shard shard[MGOS_FINGERPRINT_SHARDS];
+  uint8_t num_shards;
+  uint32_t capacity;
+  uint8_t *buf;  // one template, capture shard to the others
+  size_t buf_size;
+};
+
+struct mgos_fingerprint_shards *mgos_fingerprint_shards_create(
+    struct mgos_fingerprint **devs, uint8_t num_devs) {
+  struct mgos_fingerprint_shards *s;
+
+  if (!devs || num_devs == 0 || num_devs > MGOS_FINGERPRINT_SHARDS)
+    return NULL;
+  for (uint8_t i = 0; i < num_devs; i++) {
+    if (!devs[i] || devs[i]->info.model_size != devs[0]->info.model_size) {
+      LOG(LL_ERROR, ("Shard %u does not hold the same templates", i));
+      return NULL;
+    }
+    if (!devs[i]->index_valid &&
+        MGOS_FINGERPRINT_OK != mgos_fingerprint_index_refresh(devs[i])) {
+      LOG(LL_ERROR, ("Shard %u could not read its index", i));
+      return NULL;
+    }
+  }
+  if (!(s = calloc(1, sizeof(*s)))) return NULL;
+
+  s->num_shards = num_devs;
+  s->buf_size = devs[0]->info.model_size;
+  for (uint8_t i = 0; i < num_devs; i++) {
+    s->shard[i].s = s;
+    s->shard[i].dev = devs[i];
+    s->shard[i].base = s->capacity;
+    s->capacity += devs[i]->system_params.library_size;
+  }
+  if (!(s->buf = malloc(s->buf_size ? s->buf_size : 1))) {
+    mgos_fingerprint_shards_destroy(&s);
+    return NULL;
+  }
+  LOG(LL_INFO, ("Sharded library of %u modules, capacity=%u", num_devs,
+                s->capacity));
+  return s;
+}
+
+void mgos_fingerprint_shards_destroy(struct mgos_fingerprint_shards **s) {
+  if (!s || !*s) return;
+  free((*s)->buf);
+  free(*s);
+  *s = NULL;
+}
+
+uint32_t mgos_fingerprint_shards_capacity(struct mgos_fingerprint_shards *s) {
+  return s ? s->capacity : 0;
+}
+
+uint32_t mgos_fingerprint_shards_count(struct mgos_fingerprint_shards *s) {
+  uint32_t count = 0;
+
+  if (!s) return 0;
+  for (uint8_t i = 0; i < s->num_shards; i++)
+    count += mgos_fingerprint_index_count(s->shard[i].dev);
+  return count;
+}
+
+struct mgos_fingerprint *mgos_fingerprint_shards_locate(
+    struct mgos_fingerprint_shards *s, uint32_t global_id, uint16_t *id) {
+  if (!s) return NULL;
+  for (uint8_t i = 0; i < s->num_shards; i++) {
+    struct mgos_fingerprint_shard *sh = &s->shard[i];
+
+    if (global_id < sh->base ||
+        global_id - sh->base >= sh->dev->system_params.library_size)
+      continue;
+    if (id) *id = global_id - sh->base;
+    return sh->dev;
+  }
+  return NULL;
+}
+
+// Reads the template in char buffer 1 of the capture shard into s->buf.
+static int16_t mgos_fingerprint_shards_fetch(
+    struct mgos_fingerprint_shards *s, struct mgos_fingerprint *dev) {
+  size_t len = 0;
+  int16_t p;
+
+  p = mgos_fingerprint_model_download_buf(dev, 1, s->buf, s->buf_size, &len);
+  if (p != MGOS_FINGERPRINT_OK) return p;
+  if (len != s->buf_size) return MGOS_FINGERPRINT_READ_ERROR;
+  return MGOS_FINGERPRINT_OK;
+}
+
+int16_t mgos_fingerprint_shards_enroll(struct mgos_fingerprint_shards *s,
+                                       uint8_t capture, uint32_t *global_id) {
+  struct mgos_fingerprint_shard *src, *dst;
+  uint16_t free_slots;
+  int16_t id, p;
+
+  if (!s || capture >= s->num_shards) return MGOS_FINGERPRINT_READ_ERROR;
+  src = dst = &s->shard[capture];
+  free_slots = src->dev->system_params.library_size -
+               mgos_fingerprint_index_count(src->dev);
+  for (uint8_t i = 0; i < s->num_shards; i++) {
+    struct mgos_fingerprint *dev = s->shard[i].dev;
+    uint16_t n =
+        dev->system_params.library_size - mgos_fingerprint_index_count(dev);
+
+    if (n <= free_slots) continue;
+    dst = &s->shard[i];
+    free_slots = n;
+  }
+  if ((id = mgos_fingerprint_index_first_free(dst->dev)) < 0) return id;
+
+  if (dst != src) {
+    if (MGOS_FINGERPRINT_OK != (p = mgos_fingerprint_shards_fetch(s, src->dev)))
+      return p;
+    p = mgos_fingerprint_model_upload_buf(dst->dev, 1, s->buf, s->buf_size);
+    if (p != MGOS_FINGERPRINT_OK) return p;
+  }
+  p = mgos_fingerprint_model_store(dst->dev, id, 1);
+  if (p != MGOS_FINGERPRINT_OK) return p;
+  if (global_id) *global_id = dst->base + id;
+  LOG(LL_INFO, ("Enrolled global id %u on UART%d slot %d", dst->base + id,
+                dst->dev->uart_no, id));
+  return MGOS_FINGERPRINT_OK;
+}
+
+static void mgos_fingerprint_shards_search_cb(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  struct mgos_fingerprint_shard *sh = (struct mgos_fingerprint_shard *) cb_arg;
+
+  sh->rc = res->rc;
+  sh->finger_id = res->finger_id;
+  sh->score = res->score;
+  sh->done = true;
+  (void) dev;
+}
+
+static void mgos_fingerprint_shards_search(struct mgos_fingerprint_shard *sh) {
+  int16_t p = mgos_fingerprint_database_search_async(
+      sh->dev, 1, mgos_fingerprint_shards_search_cb, sh);
+
+  if (p == MGOS_FINGERPRINT_OK) return;
+  sh->rc = p;
+  sh->done = true;
+}
+
+static bool mgos_fingerprint_shards_source(uint8_t *chunk, size_t len,
+                                           void *ud) {
+  struct mgos_fingerprint_shard *sh = (struct mgos_fingerprint_shard *) ud;
+
+  if (sh->off + len > sh->s->buf_size) return false;
+  memcpy(chunk, sh->s->buf + sh->off, len);
+  sh->off += len;
+  return true;
+}
+
+// The probe is in char buffer 1 of this shard now: search it.
+static void mgos_fingerprint_shards_upload_cb(
+    struct mgos_fingerprint *dev, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  struct mgos_fingerprint_shard *sh = (struct mgos_fingerprint_shard *) cb_arg;
+
+  if (res->rc == MGOS_FINGERPRINT_OK) {
+    mgos_fingerprint_shards_search(sh);
+  } else {
+    sh->rc = res->rc;
+    sh->done = true;
+  }
+  (void) dev;
+}
+
+int16_t mgos_fingerprint_shards_identify(struct mgos_fingerprint_shards *s,
+                                         uint8_t capture, uint32_t *global_id,
+                                         uint16_t *score) {
+  struct mgos_fingerprint_shard *best = NULL;
+  int16_t err = MGOS_FINGERPRINT_NOTFOUND;
+  bool others = false, pending = true;
+
+  if (!s || capture >= s->num_shards) return MGOS_FINGERPRINT_READ_ERROR;
+  for (uint8_t i = 0; i < s->num_shards; i++) {
+    struct mgos_fingerprint_shard *sh = &s->shard[i];
+
+    sh->off = 0;
+    sh->rc = MGOS_FINGERPRINT_NOTFOUND;
+    // Empty shards cannot match, and are left out of the search.
+    sh->done = mgos_fingerprint_index_count(sh->dev) == 0;
+    if (i != capture && !sh->done) others = true;
+  }
+  if (others) {
+    int16_t p = mgos_fingerprint_shards_fetch(s, s->shard[capture].dev);
+
+    if (p != MGOS_FINGERPRINT_OK) return p;
+  }
+
+  for (uint8_t i = 0; i < s->num_shards; i++) {
+    struct mgos_fingerprint_shard *sh = &s->shard[i];
+    int16_t p;
+
+    if (sh->done) continue;
+    if (i == capture) {
+      mgos_fingerprint_shards_search(sh);
+      continue;
+    }
+    p = mgos_fingerprint_model_upload_stream_async(
+        sh->dev, 1, mgos_fingerprint_shards_source, sh, s->buf_size,
+        mgos_fingerprint_shards_upload_cb, sh);
+    if (p == MGOS_FINGERPRINT_OK) continue;
+    sh->rc = p;
+    sh->done = true;
+  }
+
+  // Every shard has its own UART, so their commands run side by side.
+  while (pending) {
+    pending = false;
+    for (uint8_t i = 0; i < s->num_shards; i++) {
+      if (s->shard[i].done) continue;
+      mgos_fingerprint_poll(s->shard[i].dev);
+      if (!s->shard[i].done) pending = true;
+    }
+    if (pending) mgos_msleep(MGOS_FINGERPRINT_POLL_INTERVAL);
+  }
+
+  for (uint8_t i = 0; i < s->num_shards; i++) {
+    struct mgos_fingerprint_shard *sh = &s->shard[i];
+
+    if (sh->rc == MGOS_FINGERPRINT_OK) {
+      if (!best || sh->score > best->score) best = sh;
+    } else if (sh->rc != MGOS_FINGERPRINT_NOTFOUND) {
+      LOG(LL_ERROR, ("Shard %u search failed: %d", i, sh->rc));
+      err = sh->rc;
+    }
+  }
+  // A shard that could not be searched may have held a better match, but a
+  // match elsewhere is still a match.
+  if (!best) return err;
+  if (global_id) *global_id = best->base + best->finger_id;
+  if (score) *score = best->score;
+  return MGOS_FINGERPRINT_OK;
+}
+
+int16_t mgos_fingerprint_shards_delete(struct mgos_fingerprint_shards *s,
+                                       uint32_t global_id) {
+  uint16_t id;
+  struct mgos_fingerprint *dev =
+      mgos_fingerprint_shards_locate(s, global_id, &id);
+
+  if (!dev) return MGOS_FINGERPRINT_FAIL_PAGEID;
+  return mgos_fingerprint_model_delete(dev, id, 1);
+}
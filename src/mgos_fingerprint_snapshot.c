@@ -0,0 +1,441 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Snapshot files of the flash database. Layout:
+//
+//   struct mgos_fingerprint_snapshot_header
+//   occupancy bitmap, `capacity` bits, padded to a multiple of 4 bytes
+//   `count` records of `record_size` bytes, in ascending id order, each a
+//   struct mgos_fingerprint_snapshot_record followed by the template bytes
+//
+// Records have a fixed stride, so record i is at records_offset +
+// i * record_size and can be read in place. The header CRC covers the header
+// and the bitmap as they are in the file, and each record carries the CRC of
+// its template. Integers are little-endian in the file, whatever the host.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_crc32.h"
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+#define SNAPSHOT_ALIGN(n) (((n) + 3) & ~3)
+#define SNAPSHOT_MAGIC_SWAPPED 0x46475350  // read from a big-endian writer
+
+struct mgos_fingerprint_snapshot_writer {
+  FILE *fp;
+  struct mgos_fingerprint_snapshot_header hdr;
+  uint8_t *bitmap;
+  int32_t last_id;
+  int16_t rc;
+};
+
+struct mgos_fingerprint_snapshot_reader {
+  FILE *fp;
+  struct mgos_fingerprint_snapshot_header hdr;
+  uint8_t *bitmap;
+  uint16_t next;  // index of the next record
+  uint16_t off;   // bytes of it consumed by the restore source
+  uint16_t len;   // template length of that record
+};
+
+static uint16_t mgos_fingerprint_snapshot_bitmap_size(uint16_t capacity) {
+  return SNAPSHOT_ALIGN((capacity + 7) / 8);
+}
+
+// Converts between host and file byte order; the same call goes both ways.
+static uint16_t mgos_fingerprint_snapshot_le16(uint16_t v) {
+  const uint8_t b[2] = {v & 0xFF, v >> 8};
+
+  memcpy(&v, b, sizeof(v));
+  return v;
+}
+
+static uint32_t mgos_fingerprint_snapshot_le32(uint32_t v) {
+  const uint8_t b[4] = {v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, v >> 24};
+
+  memcpy(&v, b, sizeof(v));
+  return v;
+}
+
+static void mgos_fingerprint_snapshot_hdr_order(
+    struct mgos_fingerprint_snapshot_header *hdr) {
+  hdr->magic = mgos_fingerprint_snapshot_le32(hdr->magic);
+  hdr->version = mgos_fingerprint_snapshot_le16(hdr->version);
+  hdr->header_size = mgos_fingerprint_snapshot_le16(hdr->header_size);
+  hdr->model_size = mgos_fingerprint_snapshot_le16(hdr->model_size);
+  hdr->capacity = mgos_fingerprint_snapshot_le16(hdr->capacity);
+  hdr->count = mgos_fingerprint_snapshot_le16(hdr->count);
+  hdr->record_size = mgos_fingerprint_snapshot_le16(hdr->record_size);
+  hdr->records_offset = mgos_fingerprint_snapshot_le32(hdr->records_offset);
+  hdr->crc = mgos_fingerprint_snapshot_le32(hdr->crc);
+}
+
+static void mgos_fingerprint_snapshot_rec_order(
+    struct mgos_fingerprint_snapshot_record *rec) {
+  rec->id = mgos_fingerprint_snapshot_le16(rec->id);
+  rec->len = mgos_fingerprint_snapshot_le16(rec->len);
+  rec->crc = mgos_fingerprint_snapshot_le32(rec->crc);
+}
+
+// `hdr` is in file byte order.
+static uint32_t mgos_fingerprint_snapshot_crc(
+    const struct mgos_fingerprint_snapshot_header *hdr, const uint8_t *bitmap,
+    uint16_t bitmap_size) {
+  uint32_t crc =
+      cs_crc32(0, hdr, offsetof(struct mgos_fingerprint_snapshot_header, crc));
+
+  return cs_crc32(crc, bitmap, bitmap_size);
+}
+
+struct mgos_fingerprint_snapshot_writer *mgos_fingerprint_snapshot_writer_open(
+    const char *path, const struct mgos_fingerprint_info *info) {
+  struct mgos_fingerprint_snapshot_writer *w;
+  struct mgos_fingerprint_snapshot_header *hdr;
+  uint16_t bitmap_size;
+
+  if (!path || !info || info->model_size == 0 || info->model_capacity == 0)
+    return NULL;
+  if (!(w = calloc(1, sizeof(*w)))) return NULL;
+  hdr = &w->hdr;
+  hdr->magic = MGOS_FINGERPRINT_SNAPSHOT_MAGIC;
+  hdr->version = MGOS_FINGERPRINT_SNAPSHOT_VERSION;
+  hdr->header_size = sizeof(*hdr);
+  memcpy(hdr->module_model, info->module_model, sizeof(hdr->module_model));
+  memcpy(hdr->module_serial, info->module_serial, sizeof(hdr->module_serial));
+  hdr->model_size = info->model_size;
+  hdr->capacity = info->model_capacity;
+  hdr->record_size = SNAPSHOT_ALIGN(
+      sizeof(struct mgos_fingerprint_snapshot_record) + info->model_size);
+  bitmap_size = mgos_fingerprint_snapshot_bitmap_size(hdr->capacity);
+  hdr->records_offset = sizeof(*hdr) + bitmap_size;
+  w->last_id = -1;
+
+  if (!(w->bitmap = calloc(1, bitmap_size))) goto err;
+  if (!(w->fp = fopen(path, "wb"))) {
+    LOG(LL_ERROR, ("Could not open %s", path));
+    goto err;
+  }
+  // Header and bitmap are only final once all records are written; until
+  // then the file starts with zeros and is rejected by the reader.
+  if (fseek(w->fp, hdr->records_offset, SEEK_SET) != 0) goto err;
+  return w;
+
+err:
+  if (w->fp) fclose(w->fp);
+  free(w->bitmap);
+  free(w);
+  return NULL;
+}
+
+int16_t mgos_fingerprint_snapshot_writer_add(
+    struct mgos_fingerprint_snapshot_writer *w, uint16_t id,
+    const uint8_t *data, size_t len) {
+  struct mgos_fingerprint_snapshot_record rec;
+  static const uint8_t pad[4] = {0};
+  size_t tail;
+
+  if (!w || !data) return MGOS_FINGERPRINT_READ_ERROR;
+  if (w->rc != MGOS_FINGERPRINT_OK) return w->rc;
+  if (id >= w->hdr.capacity || (int32_t) id <= w->last_id ||
+      len > w->hdr.model_size) {
+    LOG(LL_ERROR, ("Snapshot record %u (%u bytes) out of order or too large",
+                   id, (unsigned) len));
+    return w->rc = MGOS_FINGERPRINT_READ_ERROR;
+  }
+
+  rec.id = id;
+  rec.len = len;
+  rec.crc = cs_crc32(0, data, len);
+  tail = w->hdr.record_size - sizeof(rec) - len;
+  mgos_fingerprint_snapshot_rec_order(&rec);
+  if (fwrite(&rec, sizeof(rec), 1, w->fp) != 1 ||
+      fwrite(data, 1, len, w->fp) != len)
+    return w->rc = MGOS_FINGERPRINT_READ_ERROR;
+  while (tail > 0) {
+    size_t n = tail < sizeof(pad) ? tail : sizeof(pad);
+
+    // A short template is padded to the stride with zeros, too.
+    if (fwrite(pad, 1, n, w->fp) != n)
+      return w->rc = MGOS_FINGERPRINT_READ_ERROR;
+    tail -= n;
+  }
+
+  w->bitmap[id / 8] |= 1 << (id % 8);
+  w->last_id = id;
+  w->hdr.count++;
+  return MGOS_FINGERPRINT_OK;
+}
+
+int16_t mgos_fingerprint_snapshot_writer_close(
+    struct mgos_fingerprint_snapshot_writer **w) {
+  struct mgos_fingerprint_snapshot_writer *ww;
+  struct mgos_fingerprint_snapshot_header hdr;
+  uint16_t bitmap_size;
+  int16_t p;
+
+  if (!w || !*w) return MGOS_FINGERPRINT_READ_ERROR;
+  ww = *w;
+  p = ww->rc;
+  if (p == MGOS_FINGERPRINT_OK) {
+    bitmap_size = mgos_fingerprint_snapshot_bitmap_size(ww->hdr.capacity);
+    hdr = ww->hdr;
+    mgos_fingerprint_snapshot_hdr_order(&hdr);
+    hdr.crc = mgos_fingerprint_snapshot_le32(
+        mgos_fingerprint_snapshot_crc(&hdr, ww->bitmap, bitmap_size));
+    if (fseek(ww->fp, 0, SEEK_SET) != 0 ||
+        fwrite(&hdr, sizeof(hdr), 1, ww->fp) != 1 ||
+        fwrite(ww->bitmap, 1, bitmap_size, ww->fp) != bitmap_size)
+      p = MGOS_FINGERPRINT_READ_ERROR;
+  }
+  if (fclose(ww->fp) != 0 && p == MGOS_FINGERPRINT_OK)
+    p = MGOS_FINGERPRINT_READ_ERROR;
+  free(ww->bitmap);
+  free(ww);
+  *w = NULL;
+  return p;
+}
+
+struct mgos_fingerprint_snapshot_reader *mgos_fingerprint_snapshot_reader_open(
+    const char *path, struct mgos_fingerprint_snapshot_header *hdr) {
+  struct mgos_fingerprint_snapshot_reader *r;
+  struct mgos_fingerprint_snapshot_header file_hdr;
+  uint16_t bitmap_size;
+
+  if (!path) return NULL;
+  if (!(r = calloc(1, sizeof(*r)))) return NULL;
+  if (!(r->fp = fopen(path, "rb"))) {
+    LOG(LL_ERROR, ("Could not open %s", path));
+    goto err;
+  }
+  if (fread(&file_hdr, sizeof(file_hdr), 1, r->fp) != 1) goto bad;
+  r->hdr = file_hdr;
+  mgos_fingerprint_snapshot_hdr_order(&r->hdr);
+  if (r->hdr.magic == SNAPSHOT_MAGIC_SWAPPED) {
+    LOG(LL_ERROR, ("%s was written in big-endian byte order", path));
+    goto err;
+  }
+  if (r->hdr.magic != MGOS_FINGERPRINT_SNAPSHOT_MAGIC ||
+      r->hdr.version != MGOS_FINGERPRINT_SNAPSHOT_VERSION ||
+      r->hdr.header_size != sizeof(r->hdr) ||
+      r->hdr.record_size <
+          sizeof(struct mgos_fingerprint_snapshot_record) + r->hdr.model_size)
+    goto bad;
+  bitmap_size = mgos_fingerprint_snapshot_bitmap_size(r->hdr.capacity);
+  if (r->hdr.records_offset != sizeof(r->hdr) + bitmap_size) goto bad;
+  if (!(r->bitmap = malloc(bitmap_size))) goto err;
+  if (fread(r->bitmap, 1, bitmap_size, r->fp) != bitmap_size ||
+      mgos_fingerprint_snapshot_crc(&file_hdr, r->bitmap, bitmap_size) !=
+          r->hdr.crc)
+    goto bad;
+
+  if (hdr) memcpy(hdr, &r->hdr, sizeof(*hdr));
+  return r;
+
+bad:
+  LOG(LL_ERROR, ("%s is not a valid snapshot", path));
+err:
+  if (r->fp) fclose(r->fp);
+  free(r->bitmap);
+  free(r);
+  return NULL;
+}
+
+int16_t mgos_fingerprint_snapshot_reader_next(
+    struct mgos_fingerprint_snapshot_reader *r, uint16_t *id, uint8_t *buf,
+    size_t size, size_t *len) {
+  struct mgos_fingerprint_snapshot_record rec;
+  long pos;
+
+  if (!r || !buf) return MGOS_FINGERPRINT_READ_ERROR;
+  if (r->next >= r->hdr.count) return MGOS_FINGERPRINT_NOFREEINDEX;
+
+  pos = r->hdr.records_offset + (long) r->next * r->hdr.record_size;
+  if (fseek(r->fp, pos, SEEK_SET) != 0 ||
+      fread(&rec, sizeof(rec), 1, r->fp) != 1)
+    return MGOS_FINGERPRINT_READ_ERROR;
+  mgos_fingerprint_snapshot_rec_order(&rec);
+  if (rec.len > r->hdr.model_size || rec.id >= r->hdr.capacity ||
+      !(r->bitmap[rec.id / 8] & (1 << (rec.id % 8))))
+    return MGOS_FINGERPRINT_READ_ERROR;
+  if (rec.len > size) return MGOS_FINGERPRINT_ABORTED;
+  if (fread(buf, 1, rec.len, r->fp) != rec.len ||
+      cs_crc32(0, buf, rec.len) != rec.crc) {
+    LOG(LL_ERROR, ("Snapshot record %u is corrupt", rec.id));
+    return MGOS_FINGERPRINT_READ_ERROR;
+  }
+
+  r->next++;
+  if (id) *id = rec.id;
+  if (len) *len = rec.len;
+  return MGOS_FINGERPRINT_OK;
+}
+
+void mgos_fingerprint_snapshot_reader_close(
+    struct mgos_fingerprint_snapshot_reader **r) {
+  if (!r || !*r) return;
+  fclose((*r)->fp);
+  free((*r)->bitmap);
+  free(*r);
+  *r = NULL;
+}
+
+int16_t mgos_fingerprint_snapshot_save(struct mgos_fingerprint *dev,
+                                       const char *path) {
+  struct mgos_fingerprint_snapshot_writer *w;
+  uint8_t *buf;
+  int16_t p = MGOS_FINGERPRINT_OK;
+
+  if (!dev || !path) return MGOS_FINGERPRINT_READ_ERROR;
+  if (!dev->index_valid &&
+      MGOS_FINGERPRINT_OK != (p = mgos_fingerprint_index_refresh(dev)))
+    return p;
+  if (!(buf = malloc(dev->info.model_size)))
+    return MGOS_FINGERPRINT_READ_ERROR;
+  if (!(w = mgos_fingerprint_snapshot_writer_open(path, &dev->info))) {
+    free(buf);
+    return MGOS_FINGERPRINT_READ_ERROR;
+  }
+
+  for (int16_t id = mgos_fingerprint_model_next(dev, -1); id >= 0;
+       id = mgos_fingerprint_model_next(dev, id)) {
+    size_t len = 0;
+
+    if (MGOS_FINGERPRINT_OK != (p = mgos_fingerprint_model_load(dev, id, 1)) ||
+        MGOS_FINGERPRINT_OK !=
+            (p = mgos_fingerprint_model_download_buf(
+                 dev, 1, buf, dev->info.model_size, &len)) ||
+        MGOS_FINGERPRINT_OK !=
+            (p = mgos_fingerprint_snapshot_writer_add(w, id, buf, len))) {
+      LOG(LL_ERROR, ("Could not save template %d: %d", id, p));
+      break;
+    }
+  }
+
+  // A failed snapshot is left with an invalid header.
+  if (p != MGOS_FINGERPRINT_OK) w->rc = p;
+  p = mgos_fingerprint_snapshot_writer_close(&w);
+  free(buf);
+  return p;
+}
+
+// Feeds the import pipeline straight from the file: template bytes are read
+// into the outgoing data packet, and the record header and padding around
+// them are skipped. Records were verified before the first upload.
+static bool mgos_fingerprint_snapshot_source(uint8_t *chunk, size_t len,
+                                             void *ud) {
+  struct mgos_fingerprint_snapshot_reader *r =
+      (struct mgos_fingerprint_snapshot_reader *) ud;
+
+  if (r->off == 0) {
+    struct mgos_fingerprint_snapshot_record rec;
+    long pos = r->hdr.records_offset + (long) r->next * r->hdr.record_size;
+
+    if (fseek(r->fp, pos, SEEK_SET) != 0 ||
+        fread(&rec, sizeof(rec), 1, r->fp) != 1)
+      return false;
+    r->len = mgos_fingerprint_snapshot_le16(rec.len);
+  }
+  if (fread(chunk, 1, len, r->fp) != len) return false;
+  r->off += len;
+  if (r->off >= r->len) {
+    r->off = 0;
+    r->next++;
+  }
+  return true;
+}
+
+int16_t mgos_fingerprint_snapshot_restore(struct mgos_fingerprint *dev,
+                                          const char *path) {
+  struct mgos_fingerprint_snapshot_reader *r;
+  struct mgos_fingerprint_template *tpl = NULL;
+  struct mgos_fingerprint_delete_range *ranges = NULL;
+  uint8_t *buf = NULL, *extra = NULL;
+  uint16_t count, n;
+  int16_t p = MGOS_FINGERPRINT_READ_ERROR;
+
+  if (!dev || !path) return MGOS_FINGERPRINT_READ_ERROR;
+  if (!dev->index_valid &&
+      MGOS_FINGERPRINT_OK != (p = mgos_fingerprint_index_refresh(dev)))
+    return p;
+  if (!(r = mgos_fingerprint_snapshot_reader_open(path, NULL)))
+    return MGOS_FINGERPRINT_READ_ERROR;
+  count = r->hdr.count;
+  if (r->hdr.model_size != dev->info.model_size ||
+      r->hdr.capacity > dev->system_params.library_size) {
+    LOG(LL_ERROR, ("Snapshot of %u x %u bytes does not fit this module",
+                   r->hdr.capacity, r->hdr.model_size));
+    goto out;
+  }
+
+  // Every record is checked before the module is touched, so a corrupt file
+  // restores nothing. The same pass collects the ids for the pipeline.
+  buf = malloc(r->hdr.model_size);
+  tpl = calloc(count ? count : 1, sizeof(*tpl));
+  if (!buf || !tpl) goto out;
+  for (uint16_t i = 0; i < count; i++) {
+    size_t len;
+
+    p = mgos_fingerprint_snapshot_reader_next(r, &tpl[i].id, buf,
+                                              r->hdr.model_size, &len);
+    if (p != MGOS_FINGERPRINT_OK) goto out;
+    tpl[i].len = len;
+  }
+
+  r->next = 0;
+  r->off = 0;
+  p = mgos_fingerprint_import_run(dev, tpl, count, NULL, NULL, NULL,
+                                  mgos_fingerprint_snapshot_source, r);
+  if (p != MGOS_FINGERPRINT_OK) goto out;
+
+  // Then whatever the module holds beyond the snapshot goes, in as few
+  // commands as the gaps allow. The import kept the index current, so the
+  // plan made from it here sizes the list for the one made in delete_set().
+  if (!(extra = calloc(1, mgos_fingerprint_snapshot_bitmap_size(
+                              dev->system_params.library_size)))) {
+    p = MGOS_FINGERPRINT_READ_ERROR;
+    goto out;
+  }
+  for (int16_t id = mgos_fingerprint_model_next(dev, -1); id >= 0;
+       id = mgos_fingerprint_model_next(dev, id)) {
+    if (id >= r->hdr.capacity || !(r->bitmap[id / 8] & (1 << (id % 8))))
+      extra[id / 8] |= 1 << (id % 8);
+  }
+  if ((n = mgos_fingerprint_revoke_plan(
+           dev, extra, dev->system_params.library_size, NULL, 0)) > 0) {
+    if (!(ranges = calloc(n, sizeof(*ranges)))) {
+      p = MGOS_FINGERPRINT_READ_ERROR;
+      goto out;
+    }
+    p = mgos_fingerprint_model_delete_set(
+        dev, extra, dev->system_params.library_size, ranges, n, &n);
+    if (p != MGOS_FINGERPRINT_OK) goto out;
+  }
+  LOG(LL_INFO, ("Restored %u templates from %s", count, path));
+
+out:
+  if (p != MGOS_FINGERPRINT_OK)
+    LOG(LL_ERROR, ("Could not restore %s: %d", path, p));
+  free(ranges);
+  free(extra);
+  free(tpl);
+  free(buf);
+  mgos_fingerprint_snapshot_reader_close(&r);
+  return p;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Transaction statistics per instruction code: outcome counters and latency
+// histograms, kept by hooks in the protocol engine. Commands are bucketed by
+// their row in the timeout table, plus one row for everything else. The
+// block is only allocated when cfg.collect_stats is set, and every hook is a
+// no-op without it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+#define STATS_ROWS MGOS_FINGERPRINT_STATS_OPS  // timeout rows and the rest
+#define STATS_LOG_LEN 384
+
+struct mgos_fingerprint_stats {
+  struct mgos_fingerprint_op_stats ops[STATS_ROWS];
+  bool first_byte;  // time to first byte taken for the command in flight
+  mgos_timer_id log_timer_id;
+};
+
+static struct mgos_fingerprint_op_stats *mgos_fingerprint_stats_op(
+    struct mgos_fingerprint *dev, uint8_t cmd) {
+  int8_t slot = mgos_fingerprint_timeout_slot(cmd);
+
+  return &dev->stats->ops[slot < 0 ? STATS_ROWS - 1 : slot];
+}
+
+// Bucket 0 counts latencies under 1ms, bucket i those under 2^i ms, and the
+// last one everything slower.
+static void mgos_fingerprint_stats_hist_add(uint16_t *hist, uint32_t us) {
+  uint32_t ms = us / 1000;
+  uint8_t b = 0;
+
+  while (b < MGOS_FINGERPRINT_STATS_BUCKETS - 1 && ms >= (1UL << b)) b++;
+  if (hist[b] < UINT16_MAX) hist[b]++;
+}
+
+// Upper bound in ms of the bucket holding the `pct` percentile, 0 if empty.
+static uint32_t mgos_fingerprint_stats_hist_pct(const uint16_t *hist,
+                                                uint8_t pct) {
+  uint32_t total = 0, seen = 0;
+
+  for (uint8_t b = 0; b < MGOS_FINGERPRINT_STATS_BUCKETS; b++)
+    total += hist[b];
+  if (total == 0) return 0;
+  for (uint8_t b = 0; b < MGOS_FINGERPRINT_STATS_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen * 100 >= total * pct) return 1UL << b;
+  }
+  return 1UL << (MGOS_FINGERPRINT_STATS_BUCKETS - 1);
+}
+
+static void mgos_fingerprint_stats_clear(struct mgos_fingerprint_stats *s) {
+  memset(s->ops, 0, sizeof(s->ops));
+  for (uint8_t i = 0; i < MGOS_FINGERPRINT_TIMEOUT_SLOTS; i++)
+    s->ops[i].cmd = mgos_fingerprint_timeout_cmd(i);
+}
+
+static void mgos_fingerprint_stats_log_cb(void *arg) {
+  struct mgos_fingerprint *dev = (struct mgos_fingerprint *) arg;
+  char line[STATS_LOG_LEN];
+  size_t n = 0;
+
+  line[0] = '\0';
+  mgos_rlock(dev->lock);
+  for (uint8_t i = 0; i < STATS_ROWS && n < sizeof(line); i++) {
+    const struct mgos_fingerprint_op_stats *op = &dev->stats->ops[i];
+
+    if (op->count == 0) continue;
+    n += snprintf(line + n, sizeof(line) - n,
+                  " %02x:n=%u,p50<%u,p99<%u,to=%u,cs=%u,nak=%u", op->cmd,
+                  op->count,
+                  mgos_fingerprint_stats_hist_pct(op->total_hist, 50),
+                  mgos_fingerprint_stats_hist_pct(op->total_hist, 99),
+                  op->timeouts, op->checksum_errors, op->bad_packets);
+  }
+  mgos_runlock(dev->lock);
+  if (n > 0) LOG(LL_INFO, ("UART%d stats (ms):%s", dev->uart_no, line));
+}
+
+bool mgos_fingerprint_stats_init(struct mgos_fingerprint *dev,
+                                 const struct mgos_fingerprint_cfg *cfg) {
+  if (!cfg->collect_stats) return true;
+  if (!(dev->stats = calloc(1, sizeof(*dev->stats)))) return false;
+  mgos_fingerprint_stats_clear(dev->stats);
+  if (cfg->stats_log_secs > 0)
+    dev->stats->log_timer_id =
+        mgos_set_timer(cfg->stats_log_secs * 1000, MGOS_TIMER_REPEAT,
+                       mgos_fingerprint_stats_log_cb, dev);
+  return true;
+}
+
+void mgos_fingerprint_stats_deinit(struct mgos_fingerprint *dev) {
+  if (!dev->stats) return;
+  if (dev->stats->log_timer_id) mgos_clear_timer(dev->stats->log_timer_id);
+  free(dev->stats);
+  dev->stats = NULL;
+}
+
+void mgos_fingerprint_stats_sent(struct mgos_fingerprint *dev, uint8_t cmd,
+                                 uint32_t write_us) {
+  if (!dev->stats) return;
+  mgos_fingerprint_stats_hist_add(
+      mgos_fingerprint_stats_op(dev, cmd)->write_hist, write_us);
+  dev->stats->first_byte = false;
+}
+
+void mgos_fingerprint_stats_rx(struct mgos_fingerprint *dev) {
+  if (!dev->stats || dev->stats->first_byte || !dev->cmd_busy) return;
+  dev->stats->first_byte = true;
+  mgos_fingerprint_stats_hist_add(
+      mgos_fingerprint_stats_op(dev, dev->cmd.data[0])->ttfb_hist,
+      (uint32_t)(mgos_uptime_micros() - dev->cmd_sent_us));
+}
+
+void mgos_fingerprint_stats_checksum_error(struct mgos_fingerprint *dev) {
+  if (!dev->stats || !dev->cmd_busy) return;
+  mgos_fingerprint_stats_op(dev, dev->cmd.data[0])->checksum_errors++;
+}
+
+void mgos_fingerprint_stats_bad_packet(struct mgos_fingerprint *dev) {
+  if (!dev->stats || !dev->cmd_busy) return;
+  mgos_fingerprint_stats_op(dev, dev->cmd.data[0])->bad_packets++;
+}
+
+void mgos_fingerprint_stats_done(struct mgos_fingerprint *dev, uint8_t cmd,
+                                 int16_t rc) {
+  struct mgos_fingerprint_op_stats *op;
+
+  if (!dev->stats) return;
+  op = mgos_fingerprint_stats_op(dev, cmd);
+  op->count++;
+  if (rc == MGOS_FINGERPRINT_TIMEOUT) op->timeouts++;
+  mgos_fingerprint_stats_hist_add(
+      op->total_hist, (uint32_t)(mgos_uptime_micros() - dev->cmd_sent_us));
+}
+
+uint8_t mgos_fingerprint_get_stats(struct mgos_fingerprint *dev,
+                                   struct mgos_fingerprint_op_stats *ops,
+                                   uint8_t max) {
+  uint8_t n = 0;
+
+  if (!dev || !dev->stats || !ops) return 0;
+  mgos_rlock(dev->lock);
+  for (uint8_t i = 0; i < STATS_ROWS && n < max; i++) {
+    if (dev->stats->ops[i].count == 0) continue;
+    ops[n++] = dev->stats->ops[i];
+  }
+  mgos_runlock(dev->lock);
+  return n;
+}
+
+void mgos_fingerprint_reset_stats(struct mgos_fingerprint *dev) {
+  if (!dev || !dev->stats) return;
+  mgos_rlock(dev->lock);
+  mgos_fingerprint_stats_clear(dev->stats);
+  mgos_runlock(dev->lock);
+}
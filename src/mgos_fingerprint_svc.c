@@ -22,142 +22,353 @@
 #include "mgos.h"
 #include "mgos_fingerprint_internal.h"
 
-static void mgos_fingerprint_svc_match(struct mgos_fingerprint *finger) {
-  int16_t p;
-  if (!finger) return;
+// Raises an event while the chain still owns the module; the handler may
+// make synchronous calls, which run before the chain goes on.
+static void mgos_fingerprint_svc_event(struct mgos_fingerprint *finger,
+                                       int ev) {
+  if (!finger->handler) return;
+  finger->svc_event = true;
+  finger->handler(finger, ev, NULL, finger->handler_user_data);
+  finger->svc_event = false;
+}
+
+static void mgos_fingerprint_svc_match_error(struct mgos_fingerprint *finger,
+                                             int16_t p) {
+  uint32_t pack = p;
+
+  finger->svc_busy = false;
+  if (finger->handler)
+    finger->handler(finger, MGOS_FINGERPRINT_EV_MATCH_ERROR,
+                    (void *) (uintptr_t) &pack, finger->handler_user_data);
+}
+
+static void mgos_fingerprint_svc_match_search_cb(
+    struct mgos_fingerprint *finger, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  uint32_t pack = 0;
+
+  if (res->rc != MGOS_FINGERPRINT_OK) {
+    mgos_fingerprint_svc_match_error(finger, res->rc);
+    return;
+  }
+
+  finger->svc_busy = false;
+  pack = (res->score << 16) + res->finger_id;
+  if (finger->handler)
+    finger->handler(finger, MGOS_FINGERPRINT_EV_MATCH_OK,
+                    (void *) (uintptr_t) &pack, finger->handler_user_data);
+  (void) cb_arg;
+}
+
+static void mgos_fingerprint_svc_match_genchar_cb(
+    struct mgos_fingerprint *finger, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  int16_t p = res->rc;
 
-  p = mgos_fingerprint_image_genchar(finger, 1);
   if (p != MGOS_FINGERPRINT_OK) {
     LOG(LL_ERROR, ("Error image_genchar(): %d!", p));
-    goto out;
+    mgos_fingerprint_svc_match_error(finger, p);
+    return;
   }
 
-  uint16_t finger_id = -1, score = 0;
+  p = mgos_fingerprint_database_search_async(
+      finger, 1, mgos_fingerprint_svc_match_search_cb, NULL);
+  if (p != MGOS_FINGERPRINT_OK) mgos_fingerprint_svc_match_error(finger, p);
+  (void) cb_arg;
+}
+
+// AutoIdentify reports the capture, then the search result, in one command.
+// The capture was already reported by the image command before it.
+static void mgos_fingerprint_svc_auto_identify_cb(
+    struct mgos_fingerprint *finger, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
   uint32_t pack = 0;
-  p = mgos_fingerprint_database_search(finger, &finger_id, &score, 1);
-  if (p == MGOS_FINGERPRINT_OK) {
-    pack = (score << 16) + finger_id;
-    if (finger->handler)
-      finger->handler(finger, MGOS_FINGERPRINT_EV_MATCH_OK,
-                      (void *) (uintptr_t) &pack, finger->handler_user_data);
+
+  if (res->more) return;
+
+  if (res->rc == MGOS_FINGERPRINT_NOFINGER ||
+      res->rc == MGOS_FINGERPRINT_FAIL_FINGERTIMEOUT ||
+      !finger->auto_supported) {
+    finger->svc_busy = false;
+    return;
+  }
+  if (res->rc != MGOS_FINGERPRINT_OK) {
+    mgos_fingerprint_svc_match_error(finger, res->rc);
     return;
   }
 
-out:
-  pack = p;
+  finger->svc_busy = false;
+  pack = (res->score << 16) + res->finger_id;
   if (finger->handler)
-    finger->handler(finger, MGOS_FINGERPRINT_EV_MATCH_ERROR,
+    finger->handler(finger, MGOS_FINGERPRINT_EV_MATCH_OK,
                     (void *) (uintptr_t) &pack, finger->handler_user_data);
+  (void) cb_arg;
 }
 
-static void mgos_fingerprint_svc_enroll(struct mgos_fingerprint *finger) {
-  if (!finger) return;
+static void mgos_fingerprint_svc_match(struct mgos_fingerprint *finger) {
   int16_t p;
+  if (!finger) return;
+
+  p = mgos_fingerprint_image_genchar_async(
+      finger, 1, mgos_fingerprint_svc_match_genchar_cb, NULL);
+  if (p != MGOS_FINGERPRINT_OK) {
+    LOG(LL_ERROR, ("Error image_genchar(): %d!", p));
+    mgos_fingerprint_svc_match_error(finger, p);
+  }
+}
+
+// The application may switch modes while an enroll chain is running; the
+// rest of the chain then only winds down.
+static bool mgos_fingerprint_svc_enrolling(struct mgos_fingerprint *finger) {
+  return finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL1 ||
+         finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL_LIFT ||
+         finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL2;
+}
+
+// Bail with error, and return to enroll mode.
+static void mgos_fingerprint_svc_enroll_error(struct mgos_fingerprint *finger) {
   uint32_t pack = 0;
 
-  switch (finger->svc_state) {
-    case MGOS_FINGERPRINT_STATE_ENROLL1:
-      if (MGOS_FINGERPRINT_OK !=
-          (p = mgos_fingerprint_image_genchar(finger, 1))) {
-        LOG(LL_ERROR, ("Could not generate first image"));
-        goto err;
-      }
-      LOG(LL_DEBUG, ("Stored first fingerprint: Remove finger"));
+  finger->svc_busy = false;
+  if (!mgos_fingerprint_svc_enrolling(finger)) return;
+  if (finger->handler)
+    finger->handler(finger, MGOS_FINGERPRINT_EV_ENROLL_ERROR, NULL,
+                    finger->handler_user_data);
 
-      while (p != MGOS_FINGERPRINT_NOFINGER) {
-        p = mgos_fingerprint_image_get(finger);
-        usleep(50000);
-      }
+  LOG(LL_ERROR, ("Enroll error: returning to enroll mode"));
+  finger->svc_state = MGOS_FINGERPRINT_STATE_ENROLL1;
+  finger->svc_state_ts = mg_time();
 
+  if (finger->handler)
+    finger->handler(finger, MGOS_FINGERPRINT_EV_STATE_ENROLL1,
+                    (void *) (intptr_t) &pack, finger->handler_user_data);
+}
+
+static void mgos_fingerprint_svc_enroll_ok(struct mgos_fingerprint *finger,
+                                           uint16_t finger_id) {
+  uint32_t pack = 0;
+
+  LOG(LL_DEBUG, ("Model stored in flash slot %d", finger_id));
+
+  finger->svc_busy = false;
+  pack = finger_id;
+  if (finger->handler)
+    finger->handler(finger, MGOS_FINGERPRINT_EV_ENROLL_OK,
+                    (void *) (uintptr_t) &pack, finger->handler_user_data);
+
+  // The template is stored either way, but a mode set meanwhile stays.
+  if (!mgos_fingerprint_svc_enrolling(finger)) return;
+  finger->svc_state = MGOS_FINGERPRINT_STATE_ENROLL1;
+  finger->svc_state_ts = mg_time();
+  if (finger->handler)
+    finger->handler(finger, MGOS_FINGERPRINT_EV_STATE_ENROLL1, NULL,
+                    finger->handler_user_data);
+}
+
+static void mgos_fingerprint_svc_enroll_store_cb(
+    struct mgos_fingerprint *finger, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  uint16_t finger_id = (uint16_t)(uintptr_t) cb_arg;
+
+  if (res->rc != MGOS_FINGERPRINT_OK) {
+    LOG(LL_ERROR, ("Could not store model in flash slot %u", finger_id));
+    mgos_fingerprint_svc_enroll_error(finger);
+    return;
+  }
+  mgos_fingerprint_svc_enroll_ok(finger, finger_id);
+}
+
+// AutoEnroll captures both images, waits for the finger to be lifted in
+// between, and stores the model, all in one command. The first capture was
+// already reported by the image command before it.
+static void mgos_fingerprint_svc_auto_enroll_cb(
+    struct mgos_fingerprint *finger, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  if (res->more) {
+    if (res->step == MGOS_FINGERPRINT_AUTO_IMAGE &&
+        finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL2) {
+      LOG(LL_DEBUG, ("Fingerprint image taken (enroll mode)"));
+      mgos_fingerprint_svc_event(finger, MGOS_FINGERPRINT_EV_IMAGE);
+    } else if (res->step == MGOS_FINGERPRINT_AUTO_LIFT &&
+               finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL1) {
       finger->svc_state = MGOS_FINGERPRINT_STATE_ENROLL2;
       finger->svc_state_ts = mg_time();
-      if (finger->handler)
-        finger->handler(finger, MGOS_FINGERPRINT_EV_STATE_ENROLL2, NULL,
-                        finger->handler_user_data);
+      mgos_fingerprint_svc_event(finger, MGOS_FINGERPRINT_EV_STATE_ENROLL2);
+    }
+    return;
+  }
 
-      return;
+  if (!finger->auto_supported ||
+      (finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL1 &&
+       (res->rc == MGOS_FINGERPRINT_NOFINGER ||
+        res->rc == MGOS_FINGERPRINT_FAIL_FINGERTIMEOUT))) {
+    finger->svc_busy = false;
+    return;
+  }
+  if (res->rc != MGOS_FINGERPRINT_OK) {
+    LOG(LL_ERROR, ("Auto enroll failed at step %u: %d", res->step, res->rc));
+    mgos_fingerprint_svc_enroll_error(finger);
+    return;
+  }
+  mgos_fingerprint_svc_enroll_ok(finger, res->finger_id);
+  (void) cb_arg;
+}
 
-      break;
-    case MGOS_FINGERPRINT_STATE_ENROLL2: {
-      int16_t finger_id;
+// Stores the combined model in a free slot (or auto-enrolls into it).
+static int16_t mgos_fingerprint_svc_enroll_into(struct mgos_fingerprint *finger,
+                                                int16_t finger_id) {
+  if (mgos_fingerprint_auto_supported(finger))
+    return mgos_fingerprint_auto_enroll_async(
+        finger, finger_id, 2, mgos_fingerprint_svc_auto_enroll_cb, NULL);
+  return mgos_fingerprint_model_store_async(
+      finger, finger_id, 1, mgos_fingerprint_svc_enroll_store_cb,
+      (void *) (uintptr_t) finger_id);
+}
 
-      if (MGOS_FINGERPRINT_OK != mgos_fingerprint_image_genchar(finger, 2)) {
-        LOG(LL_ERROR, ("Could not generate second fingerprint"));
-        goto err;
-      }
-      LOG(LL_DEBUG, ("Stored second fingerprint"));
+// Walks the template index one page per acknowledge until a free slot turns
+// up. Only needed when the index cache could not be loaded.
+static void mgos_fingerprint_svc_enroll_index_cb(
+    struct mgos_fingerprint *finger, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  int16_t finger_id, p;
 
-      if (MGOS_FINGERPRINT_OK != mgos_fingerprint_model_combine(finger)) {
-        LOG(LL_ERROR, ("Could not combine fingerprints into a model"));
-        goto err;
+  if (!mgos_fingerprint_svc_enrolling(finger)) {
+    finger->svc_busy = false;
+    return;
+  }
+  if (res->rc != MGOS_FINGERPRINT_OK) goto err;
+
+  finger_id = mgos_fingerprint_index_page_free_id(finger->svc_page, res->data,
+                                                  res->len);
+  if (finger_id != MGOS_FINGERPRINT_NOFREEINDEX) {
+    if (MGOS_FINGERPRINT_OK !=
+        mgos_fingerprint_svc_enroll_into(finger, finger_id))
+      goto err;
+    return;
+  }
+
+  if (++finger->svc_page > finger->system_params.library_size /
+                               MGOS_FINGERPRINT_TEMPLATES_PER_PAGE)
+    goto err;
+  p = mgos_fingerprint_model_index_async(
+      finger, finger->svc_page, mgos_fingerprint_svc_enroll_index_cb, NULL);
+  if (p != MGOS_FINGERPRINT_OK) goto err;
+  return;
+
+err:
+  LOG(LL_ERROR, ("Could not get free flash slot"));
+  mgos_fingerprint_svc_enroll_error(finger);
+  (void) cb_arg;
+}
+
+// Picks the free slot from the index cache, falling back to walking the
+// module's index when the cache is not loaded.
+static int16_t mgos_fingerprint_svc_enroll_store(
+    struct mgos_fingerprint *finger) {
+  if (finger->index_valid) {
+    int16_t finger_id = mgos_fingerprint_index_first_free(finger);
+    if (finger_id == MGOS_FINGERPRINT_NOFREEINDEX) return finger_id;
+    return mgos_fingerprint_svc_enroll_into(finger, finger_id);
+  }
+  finger->svc_page = 0;
+  return mgos_fingerprint_model_index_async(
+      finger, 0, mgos_fingerprint_svc_enroll_index_cb, NULL);
+}
+
+static void mgos_fingerprint_svc_enroll_combine_cb(
+    struct mgos_fingerprint *finger, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  if (!mgos_fingerprint_svc_enrolling(finger)) {
+    finger->svc_busy = false;
+    return;
+  }
+  if (res->rc != MGOS_FINGERPRINT_OK) {
+    LOG(LL_ERROR, ("Could not combine fingerprints into a model"));
+    mgos_fingerprint_svc_enroll_error(finger);
+    return;
+  }
+  LOG(LL_DEBUG, ("Fingerprints combined successfully"));
+
+  if (MGOS_FINGERPRINT_OK != mgos_fingerprint_svc_enroll_store(finger)) {
+    LOG(LL_ERROR, ("Could not get free flash slot"));
+    mgos_fingerprint_svc_enroll_error(finger);
+  }
+  (void) cb_arg;
+}
+
+static void mgos_fingerprint_svc_enroll_genchar_cb(
+    struct mgos_fingerprint *finger, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  switch (finger->svc_state) {
+    case MGOS_FINGERPRINT_STATE_ENROLL1:
+      if (res->rc != MGOS_FINGERPRINT_OK) {
+        LOG(LL_ERROR, ("Could not generate first image"));
+        break;
       }
-      LOG(LL_DEBUG, ("Fingerprints combined successfully"));
+      LOG(LL_DEBUG, ("Stored first fingerprint: Remove finger"));
 
-      if (MGOS_FINGERPRINT_OK !=
-          mgos_fingerprint_get_free_id(finger, &finger_id)) {
-        LOG(LL_ERROR, ("Could not get free flash slot"));
-        goto err;
+      // The service timer polls for the finger to be lifted before asking
+      // for the second image.
+      finger->svc_state = MGOS_FINGERPRINT_STATE_ENROLL_LIFT;
+      finger->svc_busy = false;
+      return;
+
+    case MGOS_FINGERPRINT_STATE_ENROLL2:
+      if (res->rc != MGOS_FINGERPRINT_OK) {
+        LOG(LL_ERROR, ("Could not generate second fingerprint"));
+        break;
       }
+      LOG(LL_DEBUG, ("Stored second fingerprint"));
 
       if (MGOS_FINGERPRINT_OK !=
-          mgos_fingerprint_model_store(finger, finger_id, 1)) {
-        LOG(LL_ERROR, ("Could not store model in flash slot %u", finger_id));
-        goto err;
+          mgos_fingerprint_model_combine_async(
+              finger, mgos_fingerprint_svc_enroll_combine_cb, NULL)) {
+        LOG(LL_ERROR, ("Could not combine fingerprints into a model"));
+        break;
       }
-      LOG(LL_DEBUG, ("Model stored in flash slot %d", finger_id));
-      pack = finger_id;
-      if (finger->handler)
-        finger->handler(finger, MGOS_FINGERPRINT_EV_ENROLL_OK,
-                        (void *) (uintptr_t) &pack, finger->handler_user_data);
-
-      finger->svc_state = MGOS_FINGERPRINT_STATE_ENROLL1;
-      finger->svc_state_ts = mg_time();
-      if (finger->handler)
-        finger->handler(finger, MGOS_FINGERPRINT_EV_STATE_ENROLL1, NULL,
-                        finger->handler_user_data);
       return;
-    }
   }
 
-  // Bail with error, and return to enroll mode.
-err:
-  if (finger->handler)
-    finger->handler(finger, MGOS_FINGERPRINT_EV_ENROLL_ERROR, NULL,
-                    finger->handler_user_data);
+  mgos_fingerprint_svc_enroll_error(finger);
+  (void) cb_arg;
+}
 
-  LOG(LL_ERROR, ("Enroll error: returning to enroll mode"));
-  finger->svc_state = MGOS_FINGERPRINT_STATE_ENROLL1;
-  finger->svc_state_ts = mg_time();
+static void mgos_fingerprint_svc_enroll(struct mgos_fingerprint *finger) {
+  if (!finger) return;
+  uint8_t slot = finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL1 ? 1 : 2;
 
-  if (finger->handler)
-    finger->handler(finger, MGOS_FINGERPRINT_EV_STATE_ENROLL1,
-                    (void *) (intptr_t) &pack, finger->handler_user_data);
+  if (MGOS_FINGERPRINT_OK !=
+      mgos_fingerprint_image_genchar_async(
+          finger, slot, mgos_fingerprint_svc_enroll_genchar_cb, NULL)) {
+    LOG(LL_ERROR, ("Could not generate fingerprint %u", slot));
+    mgos_fingerprint_svc_enroll_error(finger);
+  }
 }
 
-static void mgos_fingerprint_svc_timer(void *arg) {
-  struct mgos_fingerprint *finger = (struct mgos_fingerprint *) arg;
+static void mgos_fingerprint_svc_image_cb(
+    struct mgos_fingerprint *finger, const struct mgos_fingerprint_result *res,
+    void *cb_arg) {
+  int16_t p = res->rc;
 
-  if (!finger) return;
+  if (finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL_LIFT) {
+    finger->svc_busy = false;
+    if (p != MGOS_FINGERPRINT_NOFINGER) return;
 
-  // Handle enroll timeout
-  if ((finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL1) ||
-      (finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL2)) {
-    if (finger->enroll_timeout_secs > 0) {
-      float now = mg_time();
-      if (now - finger->svc_state_ts > finger->enroll_timeout_secs) {
-        LOG(LL_WARN, ("Enroll timeout: switching back to match mode"));
-        mgos_fingerprint_svc_mode_set(finger, MGOS_FINGERPRINT_STATE_MATCH);
-        return;
-      }
-    }
+    finger->svc_state = MGOS_FINGERPRINT_STATE_ENROLL2;
+    finger->svc_state_ts = mg_time();
+    if (finger->handler)
+      finger->handler(finger, MGOS_FINGERPRINT_EV_STATE_ENROLL2, NULL,
+                      finger->handler_user_data);
+    return;
   }
 
-  int16_t p = mgos_fingerprint_image_get(finger);
   if (p == MGOS_FINGERPRINT_NOFINGER) {
+    finger->svc_busy = false;
     return;
   }
   if (p != MGOS_FINGERPRINT_OK) {
     LOG(LL_ERROR, ("image_get() error: %d", p));
+    finger->svc_busy = false;
     return;
   }
 
@@ -165,17 +376,62 @@ static void mgos_fingerprint_svc_timer(void *arg) {
       ("Fingerprint image taken (%s mode)",
        finger->svc_state == MGOS_FINGERPRINT_STATE_MATCH ? "match" : "enroll"));
 
-  if (finger->handler)
-    finger->handler(finger, MGOS_FINGERPRINT_EV_IMAGE, NULL,
-                    finger->handler_user_data);
+  mgos_fingerprint_svc_event(finger, MGOS_FINGERPRINT_EV_IMAGE);
 
+  // With a finger on the sensor, the auto commands capture at once instead
+  // of holding the queue while they wait for one.
+  if (mgos_fingerprint_auto_supported(finger) &&
+      finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL1) {
+    p = mgos_fingerprint_svc_enroll_store(finger);
+    if (p != MGOS_FINGERPRINT_OK) {
+      LOG(LL_ERROR, ("Could not get free flash slot"));
+      mgos_fingerprint_svc_enroll_error(finger);
+    }
+    return;
+  }
   if ((finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL1) ||
       (finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL2)) {
     mgos_fingerprint_svc_enroll(finger);
     return;
   }
+  if (mgos_fingerprint_auto_supported(finger)) {
+    p = mgos_fingerprint_auto_identify_async(
+        finger, mgos_fingerprint_svc_auto_identify_cb, NULL);
+    if (p != MGOS_FINGERPRINT_OK) mgos_fingerprint_svc_match_error(finger, p);
+    return;
+  }
   mgos_fingerprint_svc_match(finger);
-  return;
+  (void) cb_arg;
+}
+
+// Each tick starts at most one image -> genchar -> search/store chain. On
+// modules that support them, a captured finger is handed to a single
+// AutoIdentify / AutoEnroll command instead. The commands run
+// asynchronously, so the event loop is free while the module works; ticks
+// that arrive before the chain has finished are skipped.
+void mgos_fingerprint_svc_timer(void *arg) {
+  struct mgos_fingerprint *finger = (struct mgos_fingerprint *) arg;
+
+  if (!finger || finger->svc_busy) return;
+
+  // Handle enroll timeout
+  if ((finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL1) ||
+      (finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL_LIFT) ||
+      (finger->svc_state == MGOS_FINGERPRINT_STATE_ENROLL2)) {
+    if (finger->enroll_timeout_secs > 0) {
+      float now = mg_time();
+      if (now - finger->svc_state_ts > finger->enroll_timeout_secs) {
+        LOG(LL_WARN, ("Enroll timeout: switching back to match mode"));
+        mgos_fingerprint_svc_mode_set(finger, MGOS_FINGERPRINT_STATE_MATCH);
+        return;
+      }
+    }
+  }
+
+  finger->svc_busy = true;
+  int16_t p = mgos_fingerprint_image_get_async(
+      finger, mgos_fingerprint_svc_image_cb, NULL);
+  if (p != MGOS_FINGERPRINT_OK) finger->svc_busy = false;
 }
 
 bool mgos_fingerprint_svc_init(struct mgos_fingerprint *finger,
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Acknowledge timeouts per instruction code. Each command has a budget from
+// the table below, which the configuration may override. In adaptive mode the
+// driver also tracks the latency of the other commands the way TCP tracks
+// round trips: a smoothed mean and mean deviation, with the timeout at the
+// mean plus four deviations. Only successful commands are measured. The table
+// value stays the ceiling, and a timeout drops what was learned for that
+// command until it is measured again.
+//
+// Commands that work on the finger are never learned: a capture with no
+// finger on the sensor returns at once, and one with a finger takes the full
+// scan, so the quick answers of an idle sensor would time out the first real
+// capture.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+#define TIMEOUT_MIN_MS 100  // floor of a learned timeout
+#define TIMEOUT_SAMPLES 4   // samples before a learned timeout is used
+
+struct mgos_fingerprint_timeout_row {
+  uint8_t cmd;
+  uint16_t ms;
+  bool fixed;  // never learned
+};
+
+static const struct mgos_fingerprint_timeout_row
+    mgos_fingerprint_timeout_table[MGOS_FINGERPRINT_TIMEOUT_SLOTS] = {
+        // Sensor work: capture, feature extraction and matching.
+        {MGOS_FINGERPRINT_CMD_GETIMAGE, 1000, true},
+        {MGOS_FINGERPRINT_CMD_IMAGE2TZ, 1000, true},
+        {MGOS_FINGERPRINT_CMD_PAIRMATCH, 500, true},
+        {MGOS_FINGERPRINT_CMD_REGMODEL, 1000, true},
+        // Searches scale with the library, and stop early on a match.
+        {MGOS_FINGERPRINT_CMD_SEARCH, 2000, true},
+        {MGOS_FINGERPRINT_CMD_HISPEEDSEARCH, 2000, true},
+        // Capture through search or store in one command, each step with
+        // its own acknowledge; the first waits for a finger.
+        {MGOS_FINGERPRINT_CMD_AUTOENROLL, MGOS_FINGERPRINT_AUTO_TIMEOUT, true},
+        {MGOS_FINGERPRINT_CMD_AUTOIDENTIFY, MGOS_FINGERPRINT_AUTO_TIMEOUT,
+         true},
+        // Flash writes.
+        {MGOS_FINGERPRINT_CMD_STORE, 1000, false},
+        {MGOS_FINGERPRINT_CMD_DELETE, 1000, false},
+        {MGOS_FINGERPRINT_CMD_EMPTYDATABASE, 2000, false},
+        {MGOS_FINGERPRINT_CMD_SETSYSPARAM, 500, false},
+        {MGOS_FINGERPRINT_CMD_SETPASSWORD, 500, false},
+        {MGOS_FINGERPRINT_CMD_WRITENOTEPAD, 500, false},
+        // Transfers; also the budget of each data packet.
+        {MGOS_FINGERPRINT_CMD_LOAD, 500, false},
+        {MGOS_FINGERPRINT_CMD_UPCHAR, 1000, false},
+        {MGOS_FINGERPRINT_CMD_DOWNCHAR, 1000, false},
+        {MGOS_FINGERPRINT_CMD_IMGUPLOAD, 1000, false},
+        // Cheap queries and controls.
+        {MGOS_FINGERPRINT_CMD_READSYSPARAM, 300, false},
+        {MGOS_FINGERPRINT_CMD_VERIFYPASSWORD, 300, false},
+        {MGOS_FINGERPRINT_CMD_GETRANDOM, 300, false},
+        {MGOS_FINGERPRINT_CMD_READNOTEPAD, 300, false},
+        {MGOS_FINGERPRINT_CMD_TEMPLATECOUNT, 300, false},
+        {MGOS_FINGERPRINT_CMD_READTEMPLATEINDEX, 300, false},
+        {MGOS_FINGERPRINT_CMD_READPRODINFO, 300, false},
+        {MGOS_FINGERPRINT_CMD_HANDSHAKE, 300, false},
+        {MGOS_FINGERPRINT_CMD_STANDBY, 300, false},
+        {MGOS_FINGERPRINT_CMD_LED_CONTROL, 300, false},
+        {MGOS_FINGERPRINT_CMD_LEDON, 300, false},
+        {MGOS_FINGERPRINT_CMD_LEDOFF, 300, false},
+};
+
+// Returns the row of `cmd` in the table, or -1.
+int8_t mgos_fingerprint_timeout_slot(uint8_t cmd) {
+  for (int8_t i = 0; i < MGOS_FINGERPRINT_TIMEOUT_SLOTS; i++) {
+    if (mgos_fingerprint_timeout_table[i].cmd == cmd) return i;
+  }
+  return -1;
+}
+
+uint8_t mgos_fingerprint_timeout_cmd(int8_t slot) {
+  if (slot < 0 || slot >= MGOS_FINGERPRINT_TIMEOUT_SLOTS) return 0;
+  return mgos_fingerprint_timeout_table[slot].cmd;
+}
+
+void mgos_fingerprint_timeout_init(struct mgos_fingerprint *dev,
+                                   const struct mgos_fingerprint_cfg *cfg) {
+  memset(dev->latency, 0, sizeof(dev->latency));
+  dev->timeout_adaptive = cfg->adaptive_timeouts;
+  for (uint8_t i = 0; i < MGOS_FINGERPRINT_TIMEOUT_SLOTS; i++)
+    dev->timeout_ms[i] = mgos_fingerprint_timeout_table[i].ms;
+  for (uint8_t i = 0; cfg->timeouts && i < cfg->num_timeouts; i++) {
+    int8_t slot = mgos_fingerprint_timeout_slot(cfg->timeouts[i].cmd);
+
+    if (slot < 0 || cfg->timeouts[i].ms == 0) {
+      LOG(LL_WARN, ("Ignoring timeout for command 0x%02x",
+                    cfg->timeouts[i].cmd));
+      continue;
+    }
+    dev->timeout_ms[slot] = cfg->timeouts[i].ms;
+  }
+}
+
+// Budget for the next acknowledge of `cmd`, or for its next data packet.
+uint16_t mgos_fingerprint_timeout_get(struct mgos_fingerprint *dev,
+                                      uint8_t cmd, bool data_phase) {
+  int8_t slot = mgos_fingerprint_timeout_slot(cmd);
+  const struct mgos_fingerprint_latency *l;
+  uint32_t ms;
+
+  if (slot < 0) return MGOS_FINGERPRINT_DEFAULT_TIMEOUT;
+  l = &dev->latency[slot];
+  if (!dev->timeout_adaptive || data_phase ||
+      mgos_fingerprint_timeout_table[slot].fixed ||
+      l->samples < TIMEOUT_SAMPLES)
+    return dev->timeout_ms[slot];
+
+  ms = (l->srtt_us + 4 * l->rttvar_us) / 1000 + 1;
+  if (ms < TIMEOUT_MIN_MS) ms = TIMEOUT_MIN_MS;
+  if (ms > dev->timeout_ms[slot]) ms = dev->timeout_ms[slot];
+  return ms;
+}
+
+// Feeds the round trip of a successful command into its estimate.
+void mgos_fingerprint_timeout_sample(struct mgos_fingerprint *dev, uint8_t cmd,
+                                     uint32_t us) {
+  int8_t slot = mgos_fingerprint_timeout_slot(cmd);
+  struct mgos_fingerprint_latency *l;
+  int32_t err;
+
+  if (slot < 0 || mgos_fingerprint_timeout_table[slot].fixed) return;
+  l = &dev->latency[slot];
+  if (l->samples == 0) {
+    l->srtt_us = us;
+    l->rttvar_us = us / 2;
+  } else {
+    err = (int32_t) us - (int32_t) l->srtt_us;
+    l->srtt_us += err / 8;
+    l->rttvar_us += ((err < 0 ? -err : err) - (int32_t) l->rttvar_us) / 4;
+  }
+  if (l->samples < TIMEOUT_SAMPLES) l->samples++;
+}
+
+void mgos_fingerprint_timeout_expired(struct mgos_fingerprint *dev,
+                                      uint8_t cmd) {
+  int8_t slot = mgos_fingerprint_timeout_slot(cmd);
+
+  if (slot >= 0) dev->latency[slot].samples = 0;
+}
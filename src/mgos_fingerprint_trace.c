@@ -0,0 +1,345 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Frame trace: a ring of the last frames on the link, filled by the protocol
+// engine without allocating, and a transport that plays a saved ring back to
+// the driver. A trace taken from create() onwards replays a whole session.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+#define TRACE_MAGIC 0x52544746  // "FGTR"
+#define TRACE_VERSION 2
+
+struct __attribute__((packed)) mgos_fingerprint_trace_file {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t entry_size;
+  uint32_t count;
+  uint32_t address;  // of the module, for the frames played back
+};
+
+bool mgos_fingerprint_trace_init(struct mgos_fingerprint *dev, uint16_t len) {
+  dev->trace_head = dev->trace_count = 0;
+  dev->trace_len = 0;
+  if (len == 0) return true;
+  if (!(dev->trace = calloc(len, sizeof(*dev->trace)))) return false;
+  dev->trace_len = len;
+  return true;
+}
+
+void mgos_fingerprint_trace_deinit(struct mgos_fingerprint *dev) {
+  free(dev->trace);
+  dev->trace = NULL;
+  dev->trace_len = 0;
+}
+
+static struct mgos_fingerprint_trace_entry *mgos_fingerprint_trace_next(
+    struct mgos_fingerprint *dev, uint8_t dir) {
+  struct mgos_fingerprint_trace_entry *e = &dev->trace[dev->trace_head];
+
+  dev->trace_head = (dev->trace_head + 1) % dev->trace_len;
+  if (dev->trace_count < dev->trace_len) dev->trace_count++;
+  memset(e, 0, sizeof(*e));
+  e->time_us = (uint32_t) mgos_uptime_micros();
+  e->dir = dir;
+  return e;
+}
+
+static void mgos_fingerprint_trace_copy(struct mgos_fingerprint_trace_entry *e,
+                                        const uint8_t *data) {
+  uint16_t n = e->len > 2 ? e->len - 2 : 0;
+
+  e->truncated = n > sizeof(e->data);
+  memcpy(e->data, data, e->truncated ? sizeof(e->data) : n);
+}
+
+// `pkt` is a frame as put on the wire, its header in network order.
+void mgos_fingerprint_trace_tx(struct mgos_fingerprint *dev,
+                               const struct mgos_fingerprint_packet *pkt,
+                               size_t written) {
+  struct mgos_fingerprint_trace_entry *e;
+
+  if (!dev->trace) return;
+  e = mgos_fingerprint_trace_next(dev, MGOS_FINGERPRINT_TRACE_TX);
+  e->rc = written;
+  e->type = pkt->packettype;
+  e->len = ntohs(pkt->len);
+  mgos_fingerprint_trace_copy(e, pkt->data);
+}
+
+// Called as each frame completes, with the receiver's result. A timeout
+// leaves no frame to keep.
+void mgos_fingerprint_trace_rx(struct mgos_fingerprint *dev, int16_t rc) {
+  struct mgos_fingerprint_trace_entry *e;
+
+  if (!dev->trace) return;
+  e = mgos_fingerprint_trace_next(dev, MGOS_FINGERPRINT_TRACE_RX);
+  e->rc = rc;
+  if (rc == MGOS_FINGERPRINT_TIMEOUT) return;
+  e->type = dev->packet.packettype;
+  e->len = dev->packet.len;
+  mgos_fingerprint_trace_copy(e, dev->packet.data);
+}
+
+uint16_t mgos_fingerprint_trace_get(
+    struct mgos_fingerprint *dev, struct mgos_fingerprint_trace_entry *entries,
+    uint16_t max) {
+  uint16_t n = 0, first;
+
+  if (!dev || !dev->trace || !entries) return 0;
+  mgos_rlock(dev->lock);
+  first = (dev->trace_head + dev->trace_len - dev->trace_count) %
+          dev->trace_len;
+  for (; n < dev->trace_count && n < max; n++)
+    entries[n] = dev->trace[(first + n) % dev->trace_len];
+  mgos_runlock(dev->lock);
+  return n;
+}
+
+void mgos_fingerprint_trace_dump(struct mgos_fingerprint *dev) {
+  struct mgos_fingerprint_trace_entry e;
+  char hex[MGOS_FINGERPRINT_TRACE_BYTES * 2 + 1];
+  uint32_t t0 = 0;
+  uint16_t first, count;
+
+  if (!dev || !dev->trace) return;
+  mgos_rlock(dev->lock);
+  count = dev->trace_count;
+  first = (dev->trace_head + dev->trace_len - count) % dev->trace_len;
+  LOG(LL_INFO, ("UART%d trace of %u frames", dev->uart_no, count));
+  for (uint16_t i = 0; i < count; i++) {
+    uint16_t n;
+
+    e = dev->trace[(first + i) % dev->trace_len];
+    if (i == 0) t0 = e.time_us;
+    n = e.len > 2 ? e.len - 2 : 0;
+    if (n > sizeof(e.data)) n = sizeof(e.data);
+    for (uint16_t j = 0; j < n; j++)
+      snprintf(hex + j * 2, sizeof(hex) - j * 2, "%02x", e.data[j]);
+    hex[n * 2] = '\0';
+    LOG(LL_INFO, ("%10u %s type=%02x len=%u rc=%d %s%s", e.time_us - t0,
+                  e.dir == MGOS_FINGERPRINT_TRACE_TX ? "TX" : "RX", e.type,
+                  e.len, e.rc, hex, e.truncated ? "..." : ""));
+  }
+  mgos_runlock(dev->lock);
+}
+
+bool mgos_fingerprint_trace_save(struct mgos_fingerprint *dev,
+                                 const char *path) {
+  struct mgos_fingerprint_trace_file f;
+  struct mgos_fingerprint_trace_entry *entries;
+  FILE *fp;
+  bool ok;
+
+  if (!dev || !dev->trace || !path) return false;
+  if (!(entries = calloc(dev->trace_len, sizeof(*entries)))) return false;
+  memset(&f, 0, sizeof(f));
+  f.magic = TRACE_MAGIC;
+  f.version = TRACE_VERSION;
+  f.entry_size = sizeof(*entries);
+  f.count = mgos_fingerprint_trace_get(dev, entries, dev->trace_len);
+  f.address = dev->address;
+  if (!(fp = fopen(path, "wb"))) {
+    LOG(LL_ERROR, ("Could not open %s", path));
+    free(entries);
+    return false;
+  }
+  ok = fwrite(&f, sizeof(f), 1, fp) == 1 &&
+       fwrite(entries, sizeof(*entries), f.count, fp) == f.count;
+  if (fclose(fp) != 0) ok = false;
+  if (!ok) remove(path);
+  free(entries);
+  return ok;
+}
+
+void mgos_fingerprint_trace_clear(struct mgos_fingerprint *dev) {
+  if (!dev || !dev->trace) return;
+  mgos_rlock(dev->lock);
+  dev->trace_head = dev->trace_count = 0;
+  mgos_runlock(dev->lock);
+}
+
+// Replay transport. A frame written by the driver moves the trace to the next
+// matching frame that was sent, and the frames received after that one are
+// served until the next frame that was sent.
+struct mgos_fingerprint_replay {
+  struct mgos_fingerprint_trace_entry *entries;
+  uint32_t count;
+  uint32_t address;
+  bool realtime;
+  uint32_t tx_next;  // first entry to look for the next written frame in
+  uint32_t rx_next;  // next received frame to serve, or count
+  int64_t tx_at_us;     // when the matched frame was written here
+  uint32_t tx_time_us;  // and when it was in the trace
+  struct mgos_fingerprint_packet frame;  // frame being served
+  uint16_t frame_len;
+  uint16_t frame_pos;
+};
+
+// Rebuilds a received frame from its entry. A truncated data packet keeps its
+// length, and the bytes that were not kept come back as zeros. A frame that
+// failed its checksum in the field is played back with a wrong one.
+static void mgos_fingerprint_replay_frame(
+    struct mgos_fingerprint_replay *r,
+    const struct mgos_fingerprint_trace_entry *e) {
+  uint8_t *p = (uint8_t *) &r->frame;
+  uint16_t len = e->len < 2 ? 2 : e->len;
+  uint16_t n = len - 2, sum;
+
+  if (n > sizeof(r->frame.data) - 2) n = sizeof(r->frame.data) - 2;
+  len = n + 2;
+  p[0] = MGOS_FINGERPRINT_STARTCODE >> 8;
+  p[1] = MGOS_FINGERPRINT_STARTCODE & 0xFF;
+  p[2] = r->address >> 24;
+  p[3] = r->address >> 16;
+  p[4] = r->address >> 8;
+  p[5] = r->address;
+  p[6] = e->type;
+  p[7] = len >> 8;
+  p[8] = len & 0xFF;
+  memset(r->frame.data, 0, n);
+  memcpy(r->frame.data, e->data, n < sizeof(e->data) ? n : sizeof(e->data));
+  sum = len + e->type;
+  for (uint16_t i = 0; i < n; i++) sum += r->frame.data[i];
+  if (e->rc < 0) sum = ~sum;
+  r->frame.data[n] = sum >> 8;
+  r->frame.data[n + 1] = sum & 0xFF;
+  r->frame_len = MGOS_FINGERPRINT_HEADER_LEN + len;
+  r->frame_pos = 0;
+}
+
+static size_t mgos_fingerprint_replay_read(void *ctx, void *buf, size_t len) {
+  struct mgos_fingerprint_replay *r = (struct mgos_fingerprint_replay *) ctx;
+  size_t done = 0;
+
+  while (done < len) {
+    const struct mgos_fingerprint_trace_entry *e;
+    size_t n;
+
+    if (r->frame_pos < r->frame_len) {
+      n = r->frame_len - r->frame_pos;
+      if (n > len - done) n = len - done;
+      memcpy((uint8_t *) buf + done, (uint8_t *) &r->frame + r->frame_pos, n);
+      r->frame_pos += n;
+      done += n;
+      continue;
+    }
+    if (r->rx_next >= r->count) break;
+    e = &r->entries[r->rx_next];
+    if (e->dir != MGOS_FINGERPRINT_TRACE_RX) {
+      r->rx_next = r->count;
+      break;
+    }
+    if (r->realtime && mgos_uptime_micros() - r->tx_at_us <
+                           (int64_t)(uint32_t)(e->time_us - r->tx_time_us))
+      break;
+    r->rx_next++;
+    // A frame that never came is played back as silence.
+    if (e->rc == MGOS_FINGERPRINT_TIMEOUT) continue;
+    mgos_fingerprint_replay_frame(r, e);
+  }
+  return done;
+}
+
+static size_t mgos_fingerprint_replay_write(void *ctx, const void *buf,
+                                            size_t len) {
+  struct mgos_fingerprint_replay *r = (struct mgos_fingerprint_replay *) ctx;
+  const uint8_t *p = (const uint8_t *) buf;
+  uint8_t type, code;
+
+  if (len < MGOS_FINGERPRINT_HEADER_LEN + 1) return len;
+  type = p[6];
+  code = p[MGOS_FINGERPRINT_HEADER_LEN];
+  for (uint32_t i = r->tx_next; i < r->count; i++) {
+    const struct mgos_fingerprint_trace_entry *e = &r->entries[i];
+
+    if (e->dir != MGOS_FINGERPRINT_TRACE_TX || e->type != type) continue;
+    if (type == MGOS_FINGERPRINT_COMMANDPACKET && e->data[0] != code)
+      continue;
+    r->tx_next = r->rx_next = i + 1;
+    r->tx_at_us = mgos_uptime_micros();
+    r->tx_time_us = e->time_us;
+    r->frame_len = r->frame_pos = 0;
+    return len;
+  }
+  LOG(LL_WARN, ("Replay has no frame type %02x code %02x left", type, code));
+  r->rx_next = r->count;
+  return len;
+}
+
+// The trace was recorded at whatever rate it was; any rate will do.
+static bool mgos_fingerprint_replay_set_baud(void *ctx, uint32_t baud) {
+  (void) ctx;
+  (void) baud;
+  return true;
+}
+
+static void mgos_fingerprint_replay_close(void *ctx) {
+  struct mgos_fingerprint_replay *r = (struct mgos_fingerprint_replay *) ctx;
+
+  free(r->entries);
+  free(r);
+}
+
+bool mgos_fingerprint_replay_open(
+    const char *path, bool realtime,
+    struct mgos_fingerprint_transport *transport) {
+  struct mgos_fingerprint_trace_file f;
+  struct mgos_fingerprint_replay *r = NULL;
+  FILE *fp;
+
+  if (!path || !transport || !(fp = fopen(path, "rb"))) return false;
+  if (fread(&f, sizeof(f), 1, fp) != 1 || f.magic != TRACE_MAGIC ||
+      f.version != TRACE_VERSION ||
+      f.entry_size != sizeof(struct mgos_fingerprint_trace_entry) ||
+      !(r = calloc(1, sizeof(*r))) ||
+      (f.count > 0 && !(r->entries = calloc(f.count, f.entry_size))) ||
+      fread(r->entries, f.entry_size, f.count, fp) != f.count) {
+    LOG(LL_ERROR, ("Could not read trace from %s", path));
+    fclose(fp);
+    if (r) mgos_fingerprint_replay_close(r);
+    return false;
+  }
+  fclose(fp);
+  // The driver would take the missing bytes of an acknowledge for what the
+  // module said. Those of a data packet are only handed on as they are.
+  for (uint32_t i = 0; i < f.count; i++) {
+    if (r->entries[i].dir != MGOS_FINGERPRINT_TRACE_RX ||
+        !r->entries[i].truncated ||
+        r->entries[i].type != MGOS_FINGERPRINT_ACKPACKET)
+      continue;
+    LOG(LL_ERROR, ("Trace %s has a truncated frame at %u, not replaying it",
+                   path, i));
+    mgos_fingerprint_replay_close(r);
+    return false;
+  }
+  r->count = r->rx_next = f.count;
+  r->address = f.address;
+  r->realtime = realtime;
+
+  memset(transport, 0, sizeof(*transport));
+  transport->read = mgos_fingerprint_replay_read;
+  transport->write = mgos_fingerprint_replay_write;
+  transport->set_baud = mgos_fingerprint_replay_set_baud;
+  transport->close = mgos_fingerprint_replay_close;
+  transport->ctx = r;
+  return true;
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2019 Pim van Pelt <pim@ipng.nl>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Transports: the Mongoose OS UART the driver uses by default, and on Linux
+// a POSIX terminal, which covers USB serial adapters as well as the pseudo
+// terminal a simulator serves on. The replay and in-process transports live
+// with the trace and the simulator.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mgos.h"
+#include "mgos_fingerprint_internal.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+static size_t mgos_fingerprint_uart_read(void *ctx, void *buf, size_t len) {
+  return mgos_uart_read(((struct mgos_fingerprint *) ctx)->uart_no, buf, len);
+}
+
+static size_t mgos_fingerprint_uart_write(void *ctx, const void *buf,
+                                          size_t len) {
+  return mgos_uart_write(((struct mgos_fingerprint *) ctx)->uart_no, buf,
+                         len);
+}
+
+static void mgos_fingerprint_uart_flush(void *ctx) {
+  mgos_uart_flush(((struct mgos_fingerprint *) ctx)->uart_no);
+}
+
+static bool mgos_fingerprint_uart_set_baud(void *ctx, uint32_t baud) {
+  struct mgos_fingerprint *dev = (struct mgos_fingerprint *) ctx;
+  struct mgos_uart_config ucfg;
+
+  if (!mgos_uart_config_get(dev->uart_no, &ucfg)) return false;
+  mgos_uart_flush(dev->uart_no);
+  ucfg.baud_rate = baud;
+  return mgos_uart_configure(dev->uart_no, &ucfg);
+}
+
+void mgos_fingerprint_uart_transport(struct mgos_fingerprint *dev,
+                                     struct mgos_fingerprint_transport *t) {
+  memset(t, 0, sizeof(*t));
+  t->read = mgos_fingerprint_uart_read;
+  t->write = mgos_fingerprint_uart_write;
+  t->flush = mgos_fingerprint_uart_flush;
+  t->set_baud = mgos_fingerprint_uart_set_baud;
+  t->ctx = dev;
+}
+
+#ifdef __linux__
+struct mgos_fingerprint_tty {
+  int fd;
+};
+
+static speed_t mgos_fingerprint_tty_speed(uint32_t baud) {
+  switch (baud) {
+    case 9600:
+      return B9600;
+    case 19200:
+      return B19200;
+    case 38400:
+      return B38400;
+    case 57600:
+      return B57600;
+    case 115200:
+      return B115200;
+    default:
+      return B0;
+  }
+}
+
+static size_t mgos_fingerprint_tty_read(void *ctx, void *buf, size_t len) {
+  struct mgos_fingerprint_tty *tty = (struct mgos_fingerprint_tty *) ctx;
+  ssize_t n = read(tty->fd, buf, len);
+
+  return n > 0 ? (size_t) n : 0;
+}
+
+// Frames are small, so a short write only happens when the line is gone.
+static size_t mgos_fingerprint_tty_write(void *ctx, const void *buf,
+                                         size_t len) {
+  struct mgos_fingerprint_tty *tty = (struct mgos_fingerprint_tty *) ctx;
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = write(tty->fd, (const uint8_t *) buf + done, len - done);
+
+    if (n < 0 && errno == EAGAIN) {
+      tcdrain(tty->fd);
+      continue;
+    }
+    if (n <= 0) break;
+    done += n;
+  }
+  return done;
+}
+
+static void mgos_fingerprint_tty_flush(void *ctx) {
+  tcdrain(((struct mgos_fingerprint_tty *) ctx)->fd);
+}
+
+static bool mgos_fingerprint_tty_set_baud(void *ctx, uint32_t baud) {
+  struct mgos_fingerprint_tty *tty = (struct mgos_fingerprint_tty *) ctx;
+  speed_t speed = mgos_fingerprint_tty_speed(baud);
+  struct termios tio;
+
+  if (speed == B0 || tcgetattr(tty->fd, &tio) != 0) return false;
+  tcdrain(tty->fd);
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  return tcsetattr(tty->fd, TCSANOW, &tio) == 0;
+}
+
+static void mgos_fingerprint_tty_close(void *ctx) {
+  struct mgos_fingerprint_tty *tty = (struct mgos_fingerprint_tty *) ctx;
+
+  close(tty->fd);
+  free(tty);
+}
+
+bool mgos_fingerprint_tty_open(const char *path, uint32_t baud,
+                               struct mgos_fingerprint_transport *transport) {
+  struct mgos_fingerprint_tty *tty;
+  struct termios tio;
+
+  if (!path || !transport || !(tty = calloc(1, sizeof(*tty)))) return false;
+  tty->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (tty->fd < 0) {
+    LOG(LL_ERROR, ("Could not open %s", path));
+    free(tty);
+    return false;
+  }
+  // Raw 8N1, no flow control.
+  if (tcgetattr(tty->fd, &tio) != 0) goto err;
+  cfmakeraw(&tio);
+  tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  if (tcsetattr(tty->fd, TCSANOW, &tio) != 0) goto err;
+  if (!mgos_fingerprint_tty_set_baud(tty, baud)) goto err;
+  tcflush(tty->fd, TCIOFLUSH);
+
+  memset(transport, 0, sizeof(*transport));
+  transport->read = mgos_fingerprint_tty_read;
+  transport->write = mgos_fingerprint_tty_write;
+  transport->flush = mgos_fingerprint_tty_flush;
+  transport->set_baud = mgos_fingerprint_tty_set_baud;
+  transport->close = mgos_fingerprint_tty_close;
+  transport->ctx = tty;
+  return true;
+
+err:
+  LOG(LL_ERROR, ("Could not set up %s at %u baud", path, baud));
+  mgos_fingerprint_tty_close(tty);
+  return false;
+}
+#endif  // __linux__